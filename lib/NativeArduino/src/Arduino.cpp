@@ -0,0 +1,95 @@
+#include <Arduino.h>
+#include <chrono>
+#include <thread>
+
+static const auto startTime = std::chrono::steady_clock::now();
+
+unsigned long millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us) {
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+int analogReadValue = 0;
+
+void pinMode(uint8_t, uint8_t) {}
+
+void digitalWrite(uint8_t, uint8_t) {}
+
+int digitalRead(uint8_t) { return LOW; }
+
+void analogWrite(uint8_t, int) {}
+
+int analogRead(uint8_t) { return analogReadValue; }
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+  size_t len = 0;
+  while (len < size && write(buffer[len])) len++;
+  return len;
+}
+
+size_t Print::print(long value, int base) {
+  if (base == DEC) return print(value < 0 ? "-" : "") + print(value < 0 ? 0UL - (unsigned long)value : (unsigned long)value, base);
+  return print((unsigned long)value, base);
+}
+
+size_t Print::print(unsigned long value, int base) {
+  char buffer[8 * sizeof(long) + 1];
+  char* str = buffer + sizeof buffer - 1;
+  *str = '\0';
+  if (base < 2) base = DEC;
+  do {
+    uint8_t digit = value % base;
+    *--str = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    value /= base;
+  } while (value);
+  return write(str);
+}
+
+size_t Print::print(double value, int digits) {
+  char buffer[48];
+  snprintf(buffer, sizeof buffer, "%.*f", digits, value);
+  return write(buffer);
+}
+
+int Stream::timedRead() {
+  unsigned long start = millis();
+  do {
+    int c = read();
+    if (c >= 0) return c;
+  } while (millis() - start < timeout);
+  return -1;
+}
+
+size_t Stream::readBytes(char* buffer, size_t length) {
+  size_t count = 0;
+  while (count < length) {
+    int c = timedRead();
+    if (c < 0) break;
+    buffer[count++] = (char)c;
+  }
+  return count;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  if (out) fputc(c, out);
+  return 1;
+}
+
+void HardwareSerial::flush() {
+  if (out) fflush(out);
+}
+
+HardwareSerial Serial(stdout);
+// Nothing attached, writes are dropped
+HardwareSerial Serial1(nullptr);
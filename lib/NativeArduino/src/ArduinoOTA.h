@@ -0,0 +1,19 @@
+#ifndef NATIVE_ARDUINO_OTA_H
+#define NATIVE_ARDUINO_OTA_H
+
+// The storage interface from ArduinoOTA, so the OTA writer and patch decoder can be run against RAM on the host
+
+#include <Arduino.h>
+
+class OTAStorage {
+public:
+  virtual ~OTAStorage() {}
+  virtual int open(int length) = 0;
+  virtual size_t write(uint8_t) = 0;
+  virtual void close() = 0;
+  virtual void clear() = 0;
+  virtual void apply() = 0;
+  virtual long maxSize() { return 0; }
+};
+
+#endif
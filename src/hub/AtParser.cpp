@@ -0,0 +1,103 @@
+#include <./hub/AtParser.h>
+#include <./hub/Hal.h>
+#include <./hub/Log.h>
+
+AtParser atParser;
+
+struct UrcPrefix {
+  const char* prefix;
+  AtUrc urc;
+};
+
+const UrcPrefix URC_PREFIXES[] = {
+  { "RDY", URC_RDY },
+  { "+CFUN:", URC_CFUN },
+  { "+CPIN:", URC_CPIN },
+  { "Call Ready", URC_CALL_READY },
+  { "SMS Ready", URC_SMS_READY },
+  { "+CREG:", URC_CREG },
+  { "+HTTPACTION:", URC_HTTPACTION },
+  { "NORMAL POWER DOWN", URC_POWER_DOWN },
+};
+
+AtEvent AtParser::classify() {
+  AtEvent event;
+  event.line = line;
+  if (strcmp(line, "OK") == 0) event.type = AT_OK;
+  else if (strcmp(line, "ERROR") == 0 || strncmp(line, "+CME ERROR", 10) == 0 || strncmp(line, "+CMS ERROR", 10) == 0) event.type = AT_ERROR;
+  else if (strcmp(line, "DOWNLOAD") == 0 || strcmp(line, "> ") == 0) event.type = AT_PROMPT;
+  else if (strncmp(line, "AT", 2) == 0) event.type = AT_ECHO;
+  else {
+    for (uint8_t i = 0; i < sizeof URC_PREFIXES / sizeof * URC_PREFIXES; i++) {
+      if (strncmp(line, URC_PREFIXES[i].prefix, strlen(URC_PREFIXES[i].prefix)) == 0) {
+        event.type = AT_URC;
+        event.urc = URC_PREFIXES[i].urc;
+        break;
+      }
+    }
+  }
+  return event;
+}
+
+bool AtParser::next(AtEvent& event) {
+  while (Hal::modem().available()) {
+    char c = Hal::modem().read();
+    // The echo ends with \r\r\n, so carriage returns are dropped and lines split on \n only
+    if (c == '\r') continue;
+    if (c != '\n') {
+      if (lineLen < AT_LINE_SIZE - 1) line[lineLen++] = c;
+      line[lineLen] = '\0';
+      // The SMS prompt isn't followed by a newline
+      if (lineLen == 2 && line[0] == '>' && line[1] == ' ') {
+        lineLen = 0;
+        event = classify();
+        return true;
+      }
+      continue;
+    }
+    if (lineLen == 0) continue;
+    line[lineLen] = '\0';
+    lineLen = 0;
+    event = classify();
+    return true;
+  }
+  return false;
+}
+
+bool AtParser::waitNext(AtEvent& event, unsigned long deadline, BLELocalDevice* BLE) {
+  while (millis() < deadline) {
+    if (next(event)) return true;
+    if (BLE) BLE->poll();
+  }
+  return false;
+}
+
+bool AtParser::waitResult(unsigned long deadline, BLELocalDevice* BLE, const char* head, char* info, uint8_t infoSize) {
+  bool didReadHead = !head;
+  AtEvent event;
+  while (waitNext(event, deadline, BLE)) {
+    if (event.type == AT_OK) return true;
+    if (event.type == AT_ERROR) {
+      LOG_WARNLN(LOG_NETWORK, "ERROR received");
+      return false;
+    }
+    // Nothing to match without a head, and an empty one would take any URC as the answer
+    bool canMatch = !didReadHead && (event.type == AT_LINE || (event.type == AT_URC && *head));
+    if (canMatch && strncmp(event.line, head, strlen(head)) == 0) {
+      strncpy(info, event.line + strlen(head), infoSize - 1);
+      info[infoSize - 1] = '\0';
+      didReadHead = true;
+    }
+  }
+  LOG_WARNLN(LOG_NETWORK, ">>READ TIMEOUT<<");
+  return false;
+}
+
+void AtParser::clear(bool print) {
+  while (Hal::modem().available()) {
+    char c = Hal::modem().read();
+    if (print) LOG_DEBUG(LOG_NETWORK, c);
+  }
+  lineLen = 0;
+  line[0] = '\0';
+}
@@ -0,0 +1,76 @@
+#ifndef HUB_AT_PARSER_H
+#define HUB_AT_PARSER_H
+
+#include <Arduino.h>
+#include <./hub/Hal.h>
+
+// Longest line kept, the rest of a longer line is dropped (+CGNSINF is ~100)
+const uint8_t AT_LINE_SIZE = 160;
+
+enum AtEventType : uint8_t {
+  AT_ECHO,   // The command being echoed back
+  AT_LINE,   // Information response, ie +HTTPREAD: 27 or the IMEI
+  AT_OK,
+  AT_ERROR,  // ERROR, +CME ERROR or +CMS ERROR
+  AT_PROMPT, // DOWNLOAD or >, the modem is waiting for data
+  AT_URC,    // Unsolicited result code, see AtUrc
+};
+
+enum AtUrc : uint8_t {
+  URC_NONE,
+  URC_RDY,
+  URC_CFUN,
+  URC_CPIN,
+  URC_CALL_READY,
+  URC_SMS_READY,
+  URC_CREG, // Also the response to AT+CREG?
+  URC_HTTPACTION,
+  URC_POWER_DOWN,
+};
+
+struct AtEvent {
+  AtEventType type = AT_LINE;
+  AtUrc urc = URC_NONE;
+  // Line without the trailing \r\n, only valid until the next call to the parser
+  const char* line = nullptr;
+};
+
+/**
+ * Incrementally splits everything the modem sends into events, one line at a time
+ * Only consumes bytes that have already been received, so it never waits on the modem
+ */
+class AtParser {
+private:
+  char line[AT_LINE_SIZE]{};
+  uint8_t lineLen = 0;
+
+  AtEvent classify();
+
+public:
+  /**
+   * Consumes received bytes until an event completes, returns false if none has yet
+   * Stops right after the event so a payload following it (ie AT+HTTPREAD body) can be read directly
+   */
+  bool next(AtEvent& event);
+
+  /**
+   * Calls next until it returns an event or millis() reaches deadline, polling BLE if provided
+   * Returns false on timeout
+   */
+  bool waitNext(AtEvent& event, unsigned long deadline, BLELocalDevice* BLE = nullptr);
+
+  /**
+   * Waits for the final result code, returns true for OK and false for ERROR or timeout
+   * If head is provided, the rest of the first line starting with it is copied into info
+   */
+  bool waitResult(unsigned long deadline, BLELocalDevice* BLE = nullptr, const char* head = nullptr, char* info = nullptr, uint8_t infoSize = 0);
+
+  /**
+   * Discards everything received so far including a partially read line, printing it if print is true
+   */
+  void clear(bool print = false);
+};
+
+extern AtParser atParser;
+
+#endif
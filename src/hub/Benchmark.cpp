@@ -0,0 +1,310 @@
+#ifdef HUB_BENCHMARK
+
+#include <ArduinoJson.h>
+#include <./hub/Benchmark.h>
+#include <./hub/Hal.h>
+#include <./hub/Location.h>
+#include <./hub/ModemEmulator.h>
+#include <./hub/Network.h>
+#include <./hub/Queries.h>
+#include <./hub/Track.h>
+#include <./hub/Uploads.h>
+#include <./hub/Utilities.h>
+
+// Bytes below the caller's frame filled with STACK_PAINT before each measurement
+const uint16_t STACK_PAINT_SIZE = 4096;
+const uint8_t STACK_PAINT = 0xA5;
+// Space left for paintStack's own frame and memset's
+const uint8_t STACK_PAINT_MARGIN = 64;
+#ifdef HUB_NATIVE
+// Cycles only mean something on the SAMD21, the host reports time alone
+const uint32_t CYCLES_PER_MICRO = 0;
+#else
+const uint32_t CYCLES_PER_MICRO = F_CPU / 1000000;
+#endif
+
+volatile uint32_t allocCount = 0;
+volatile uint32_t allocBytes = 0;
+
+// Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, see platformio.ini
+extern "C" {
+  void* __real_malloc(size_t size);
+  void* __real_calloc(size_t count, size_t size);
+  void* __real_realloc(void* ptr, size_t size);
+
+  void* __wrap_malloc(size_t size) {
+    allocCount++;
+    allocBytes += size;
+    return __real_malloc(size);
+  }
+
+  void* __wrap_calloc(size_t count, size_t size) {
+    allocCount++;
+    allocBytes += count * size;
+    return __real_calloc(count, size);
+  }
+
+  void* __wrap_realloc(void* ptr, size_t size) {
+    allocCount++;
+    allocBytes += size;
+    return __real_realloc(ptr, size);
+  }
+}
+
+/**
+ * Replays a fixed response as if it came from the modem, writes are discarded
+ */
+class CannedStream : public Stream {
+private:
+  const char* data;
+  size_t idx = 0;
+
+public:
+  CannedStream(const char* data) : data(data) {}
+
+  void rewind() { idx = 0; }
+
+  int available() override { return strlen(data + idx); }
+  int read() override { return data[idx] ? data[idx++] : -1; }
+  int peek() override { return data[idx] ? data[idx] : -1; }
+  size_t write(uint8_t) override { return 1; }
+};
+
+const char* CGNSINF_LINE = "1,1,20221012235342.000,40.71280,-74.00600,10.500,0.00,0.0,1,,1.1,1.4,0.9,,10,7,,,35,,";
+const char* CGNSINF_RESP = "AT+CGNSINF\r\r\n+CGNSINF: 1,1,20221012235342.000,40.71280,-74.00600,10.500,0.00,0.0,1,,1.1,1.4,0.9,,10,7,,,35,,\r\n\r\nOK\r\n";
+const char* HTTPREAD_BODY = "{\"data\":{\"hubViewer\":{\"sensors\":[{\"serial\":\"a4:c1:38:12:34:56\"},{\"serial\":\"a4:c1:38:65:43:21\"}]}}}";
+
+CannedStream cgnsInfStream(CGNSINF_RESP);
+
+void benchParseInf() {
+  char infBuffer[100]{};
+  strcpy(infBuffer, CGNSINF_LINE);
+  Location::parseInf(infBuffer);
+}
+
+void benchReadUntilResp() {
+  char infBuffer[200]{};
+  cgnsInfStream.rewind();
+  Utilities::readUntilResp("+CGNSINF: ", infBuffer, sizeof infBuffer);
+}
+
+void benchDeserializeResponse() {
+  DynamicJsonDocument doc(RESPONSE_SIZE);
+  deserializeJson(doc, HTTPREAD_BODY);
+}
+
+void benchParseRawCommand() {
+  char rawCommand[30] = "SensorConnect:1";
+  Utilities::parseRawCommand(rawCommand);
+}
+
+Track benchTrack;
+char benchTrackJson[TRACK_JSON_SIZE]{};
+size_t benchTrackJsonLen = 0;
+
+/**
+ * A drive of TRACK_UPLOAD_SIZE fixes 500m apart, turning every fourth one
+ */
+void fillBenchTrack() {
+  LocReading reading;
+  reading.hasFix = true;
+  reading.lat = 40.7128;
+  reading.lng = -74.006;
+  reading.kmph = 48.5;
+  reading.hdop = 1.1;
+  benchTrack.remove(TRACK_SIZE);
+  for (uint8_t i = 0; i < TRACK_UPLOAD_SIZE; i++) {
+    reading.deg = (i / 4) % 2 ? 90 : 0;
+    if (reading.deg) reading.lng += 0.0059;
+    else reading.lat += 0.0045;
+    benchTrack.add(reading, i * 37);
+  }
+}
+
+void benchTrackWriteJson() {
+  uint8_t count;
+  benchTrackJsonLen = benchTrack.writeJson(benchTrackJson, sizeof benchTrackJson, TRACK_UPLOAD_SIZE * 37, count);
+}
+
+#ifdef HUB_MODEM_EMULATOR
+Network benchNetwork;
+char benchQuery[] = "{\"query\":\"mutation CreateEvent{createEvent(serial:\\\"a4:c1:38:12:34:56\\\"){ id }}\",\"variables\":{}}";
+
+const ModemScript HTTPACTION_ERROR_SCRIPT[] = { { "AT+HTTPACTION", 0, "ERROR" } };
+
+void benchPowerOnAndWaitForReg() {
+  benchNetwork.setPower(false);
+  benchNetwork.setPowerOnAndWaitForReg(&BLE);
+}
+
+void benchGetImei() {
+  char imei[20]{};
+  benchNetwork.GetImei(imei);
+}
+
+void benchSendRequest() {
+  benchNetwork.SendRequest(benchQuery, &BLE);
+}
+
+UploadQueue benchUploads;
+
+/**
+ * Flushes a battery level and event together, reporting the payload bytes sent for them
+ * With HUB_PERSISTED_QUERIES the first flush sends the document, later ones only its hash
+ */
+void benchFlushUploads(const char* name) {
+  benchUploads.add(UPLOAD_BATTERY, UPDATE_HUB_BATTERY_LEVEL, nullptr, 3.9, 80.0);
+  benchUploads.add(UPLOAD_EVENT, CREATE_EVENT, nullptr, "a4:c1:38:12:34:56");
+  uint32_t bytesUploaded = modemEmulator.bytesUploaded;
+  unsigned long start = millis();
+  benchUploads.flush(benchNetwork, &BLE);
+  while (benchNetwork.isRequestActive()) {
+    benchNetwork.tick();
+    BLE.poll();
+  }
+  Serial.print(name);
+  Serial.print("\ttime(ms): ");
+  Serial.print(millis() - start);
+  Serial.print("\tbytes uploaded: ");
+  Serial.println(modemEmulator.bytesUploaded - bytesUploaded);
+}
+
+/**
+ * Time from the module standing by in state until it's registered again
+ * Waits out the emulator's sleepDelay first so a sleeping module has actually dozed off
+ */
+void benchWake(const char* name, ModemPowerState state) {
+  benchNetwork.setPowerOnAndWaitForReg(&BLE);
+  benchNetwork.setPowerState(state, &BLE);
+  Utilities::bleDelay(modemEmulator.config.sleepDelay + 100, &BLE);
+  unsigned long start = millis();
+  bool isRegistered = benchNetwork.setPowerOnAndWaitForReg(&BLE);
+  Serial.print(name);
+  Serial.print("	time(ms): ");
+  Serial.print(millis() - start);
+  Serial.print("	registered: ");
+  Serial.println(isRegistered);
+}
+
+/**
+ * Wall clock cost of the modem paths against the emulator, including fault scenarios
+ */
+void runModemBenchmarks() {
+  if (!BLE.begin()) {
+    Serial.println("starting BLE failed! Skipping modem benchmarks");
+    return;
+  }
+  strcpy(benchNetwork.tokenData.accessToken, "benchmark");
+  benchNetwork.tokenData.isValid = true;
+  modemEmulator.install();
+
+  Benchmark::report("Network::setPowerOnAndWaitForReg", Benchmark::measure(benchPowerOnAndWaitForReg, 1));
+  Benchmark::report("Network::GetImei", Benchmark::measure(benchGetImei, 5));
+  Benchmark::report("Network::SendRequest", Benchmark::measure(benchSendRequest, 1));
+
+  modemEmulator.config.scripts = HTTPACTION_ERROR_SCRIPT;
+  modemEmulator.config.scriptsLen = 1;
+  Benchmark::report("Network::SendRequest (HTTPACTION ERROR)", Benchmark::measure(benchSendRequest, 1));
+  modemEmulator.config.scriptsLen = 0;
+
+  modemEmulator.config.actionLatency = 6000;
+  Benchmark::report("Network::SendRequest (6s HTTPACTION)", Benchmark::measure(benchSendRequest, 1));
+  modemEmulator.config.actionLatency = ModemEmulatorConfig().actionLatency;
+
+  modemEmulator.config.dropEvery = 50;
+  Benchmark::report("Network::SendRequest (dropped bytes)", Benchmark::measure(benchSendRequest, 1));
+  modemEmulator.config.dropEvery = 0;
+
+  modemEmulator.config.regTime = 25000;
+  Benchmark::report("Network::setPowerOnAndWaitForReg (slow reg)", Benchmark::measure(benchPowerOnAndWaitForReg, 1));
+  modemEmulator.config = ModemEmulatorConfig();
+
+  modemEmulator.config.httpBody = "{\"data\":{\"m0\":{\"id\":1},\"m1\":{\"id\":2}}}";
+  benchFlushUploads("UploadQueue::flush");
+  benchFlushUploads("UploadQueue::flush (repeated)");
+  modemEmulator.forgetPersistedQueries();
+  benchFlushUploads("UploadQueue::flush (server forgot query)");
+  modemEmulator.config = ModemEmulatorConfig();
+
+  benchWake("Network wake (sleep)", MODEM_SLEEP);
+  benchWake("Network wake (airplane)", MODEM_AIRPLANE);
+  benchWake("Network wake (off)", MODEM_OFF);
+
+  benchNetwork.setPower(false);
+  modemEmulator.uninstall();
+  BLE.end();
+}
+#endif
+
+namespace Benchmark {
+  __attribute__((noinline)) char* paintStack(uint16_t size) {
+    char marker;
+    char* bottom = &marker - STACK_PAINT_MARGIN - size;
+    memset(bottom, STACK_PAINT, size);
+    return bottom;
+  }
+
+  BenchResult measure(void (*fn)(), uint16_t iterations) {
+    char marker;
+    BenchResult result;
+    int free = Utilities::freeMemory() - 256;
+    uint16_t paintSize = free < 0 ? 0 : (free < STACK_PAINT_SIZE ? free : STACK_PAINT_SIZE);
+    char* bottom = paintStack(paintSize);
+
+    allocCount = 0;
+    allocBytes = 0;
+    unsigned long start = micros();
+    for (uint16_t i = 0; i < iterations; i++) fn();
+    unsigned long elapsed = micros() - start;
+
+    char* deepest = bottom;
+    while (deepest < &marker && (uint8_t)*deepest == STACK_PAINT) deepest++;
+
+    result.micros = elapsed / iterations;
+    result.cycles = result.micros * CYCLES_PER_MICRO;
+    result.allocCount = allocCount / iterations;
+    result.allocBytes = allocBytes / iterations;
+    result.peakStack = &marker - deepest;
+    return result;
+  }
+
+  void report(const char* name, const BenchResult& result) {
+    Serial.print(name);
+    Serial.print("\ttime(us): ");
+    Serial.print(result.micros);
+    Serial.print("\tcycles: ");
+    Serial.print(result.cycles);
+    Serial.print("\tallocs: ");
+    Serial.print(result.allocCount);
+    Serial.print("\talloc bytes: ");
+    Serial.print(result.allocBytes);
+    Serial.print("\tpeak stack: ");
+    Serial.println(result.peakStack);
+  }
+
+  void runAll() {
+    Serial.println("\n===== Benchmarks =======");
+    Serial.print("Free Memory is: ");
+    Serial.println(Utilities::freeMemory());
+
+    report("Location::parseInf", measure(benchParseInf, 100));
+
+    Hal::setModem(&cgnsInfStream);
+    report("Utilities::readUntilResp", measure(benchReadUntilResp, 100));
+    Hal::setModem(nullptr);
+
+    report("deserializeJson response", measure(benchDeserializeResponse, 20));
+    report("Utilities::parseRawCommand", measure(benchParseRawCommand, 100));
+
+    fillBenchTrack();
+    report("Track::writeJson", measure(benchTrackWriteJson, 100));
+    Serial.print("Track bytes per fix: ");
+    Serial.println((double)benchTrackJsonLen / benchTrack.length());
+#ifdef HUB_MODEM_EMULATOR
+    runModemBenchmarks();
+#endif
+    Serial.println("===== End Benchmarks =======");
+  }
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef HUB_BENCHMARK_H
+#define HUB_BENCHMARK_H
+
+#include <Arduino.h>
+
+// Hot path benchmarks, only compiled into the nano33iot_bench and native environments (HUB_BENCHMARK)
+// Those environments also wrap malloc/calloc/realloc so allocations can be counted
+
+struct BenchResult {
+  uint32_t micros = 0;
+  uint32_t cycles = 0;
+  uint32_t allocCount = 0;
+  uint32_t allocBytes = 0;
+  uint16_t peakStack = 0;
+};
+
+namespace Benchmark {
+  /**
+   * Runs fn for the number of iterations and returns the average time and allocations
+   * per iteration, along with the deepest stack usage (in bytes) seen across all of them
+   */
+  BenchResult measure(void (*fn)(), uint16_t iterations);
+
+  /**
+   * Prints a single result as a row of the benchmark table
+   */
+  void report(const char* name, const BenchResult& result);
+
+  /**
+   * Runs every benchmark and prints the results to Serial
+   */
+  void runAll();
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef HUB_CRC32_H
+#define HUB_CRC32_H
+
+#include <Arduino.h>
+
+namespace Crc32 {
+  const uint32_t INITIAL = 0xFFFFFFFF;
+
+  /**
+   * Continues crc (start from INITIAL) over len bytes of data, so it can be computed as data arrives
+   */
+  uint32_t update(uint32_t crc, const uint8_t* data, size_t len);
+
+  /**
+   * The standard CRC-32 (as zlib and most tools compute it) of everything passed to update
+   */
+  inline uint32_t finish(uint32_t crc) { return ~crc; }
+}
+
+#endif
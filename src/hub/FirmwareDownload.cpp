@@ -0,0 +1,112 @@
+#include <FlashStorage.h>
+#include <./hub/FirmwareDownload.h>
+#include <./hub/Hal.h>
+#include <./hub/Log.h>
+
+HUB_FLASH_STORAGE(flashFirmwareDownload, FirmwareDownloadState);
+
+// Not tied to an address, every call passes its own
+FlashClass otaFlash;
+
+void ResumableStorage::writePage() {
+  const uint8_t* address = data() + pos;
+  if (pos % OTA_ROW_SIZE == 0) otaFlash.erase(address, OTA_ROW_SIZE);
+  otaFlash.write(address, page, OTA_PAGE_SIZE);
+  pos += OTA_PAGE_SIZE;
+  pageLen = 0;
+}
+
+int ResumableStorage::open(int length) {
+  pos = pageLen = 0;
+  return length <= maxSize();
+}
+
+void ResumableStorage::resume(uint32_t offset) {
+  pos = offset;
+  pageLen = 0;
+}
+
+size_t ResumableStorage::write(uint8_t b) {
+  page[pageLen++] = b;
+  if (pageLen == OTA_PAGE_SIZE) writePage();
+  return 1;
+}
+
+void ResumableStorage::close() {
+  if (pageLen == 0) return;
+  memset(page + pageLen, 0xFF, OTA_PAGE_SIZE - pageLen);
+  writePage();
+}
+
+void FirmwareDownload::save() {
+  flashFirmwareDownload.write(state);
+}
+
+bool FirmwareDownload::load() {
+  state = flashFirmwareDownload.read();
+  if (!state.isValid) return false;
+  written = state.saved;
+  storage.resume(written);
+  LOG_INFO(LOG_OTA, "Firmware download resumes at ");
+  LOG_INFO(LOG_OTA, written);
+  LOG_INFO(LOG_OTA, " of ");
+  LOG_INFOLN(LOG_OTA, state.length);
+  return true;
+}
+
+bool FirmwareDownload::start(uint16_t version, const char* url, uint32_t length, const uint8_t sha256[SHA256_SIZE]) {
+  if (strlen(url) >= FIRMWARE_URL_SIZE || length == 0 || length > (uint32_t)storage.maxSize()) return false;
+  bool isSameImage = state.isValid && state.length == length && memcmp(state.sha256, sha256, SHA256_SIZE) == 0;
+  if (isSameImage && strcmp(state.url, url) == 0) return true;
+  // A new URL for the same image, ie a signed one that expired, keeps what's stored
+  if (!isSameImage) {
+    state = FirmwareDownloadState();
+    state.version = version;
+    state.length = length;
+    memcpy(state.sha256, sha256, SHA256_SIZE);
+    state.isValid = true;
+    written = 0;
+    storage.open(length);
+  }
+  strcpy(state.url, url);
+  save();
+  return true;
+}
+
+bool FirmwareDownload::write(const uint8_t* data, size_t len) {
+  if (!state.isValid || len > state.length - written) return false;
+  for (size_t i = 0; i < len; i++) storage.write(data[i]);
+  written += len;
+  if (written == state.length) {
+    storage.close();
+    state.saved = written;
+    save();
+  } else if (written - state.saved >= FIRMWARE_SAVE_EVERY) {
+    // Only whole pages are in flash yet
+    state.saved = written - written % FIRMWARE_SAVE_EVERY;
+    save();
+  }
+  return true;
+}
+
+bool FirmwareDownload::verify() {
+  if (!isComplete()) return false;
+  uint8_t digest[SHA256_SIZE];
+  Sha256::hash(storage.data(), state.length, digest);
+  bool isMatch = memcmp(digest, state.sha256, SHA256_SIZE) == 0;
+  if (!isMatch) {
+    char hex[SHA256_SIZE * 2 + 1];
+    Sha256::toHex(digest, hex);
+    LOG_ERROR(LOG_OTA, "Downloaded firmware hash doesn't match: ");
+    LOG_ERRORLN(LOG_OTA, hex);
+  }
+  forget();
+  return isMatch;
+}
+
+void FirmwareDownload::forget() {
+  if (!state.isValid) return;
+  state = FirmwareDownloadState();
+  written = 0;
+  save();
+}
@@ -0,0 +1,119 @@
+#ifndef HUB_FIRMWARE_DOWNLOAD_H
+#define HUB_FIRMWARE_DOWNLOAD_H
+
+#include <Arduino.h>
+#include <ArduinoOTA.h>
+#include <./hub/Ota.h>
+#include <./hub/Sha256.h>
+
+// Longest image URL the manifest can point to
+const uint8_t FIRMWARE_URL_SIZE = 120;
+// Progress is saved to flash this often, so a power cycle costs at most this much of the download
+const uint32_t FIRMWARE_SAVE_EVERY = 8192;
+
+static_assert(FIRMWARE_SAVE_EVERY % OTA_ROW_SIZE == 0, "Downloads resume at the start of a row");
+
+/**
+ * Writes to the same half of flash as InternalStorage, so InternalStorage.apply() applies what it stored
+ * Each row is erased just before it's written instead of all of them on open, so resume can pick up at any row
+ */
+class ResumableStorage : public OTAStorage {
+private:
+  uint8_t page[OTA_PAGE_SIZE];
+  uint8_t pageLen = 0;
+  // Bytes written to flash, always a whole number of pages
+  uint32_t pos = 0;
+
+  void writePage();
+
+public:
+  /**
+   * Stored image, memory mapped
+   */
+  const uint8_t* data() const { return (const uint8_t*)(SKETCH_START + InternalStorage.maxSize()); }
+
+  int open(int length) override;
+
+  /**
+   * Carries on writing at offset, a multiple of OTA_ROW_SIZE, leaving what's before it alone
+   */
+  void resume(uint32_t offset);
+
+  size_t write(uint8_t b) override;
+
+  /**
+   * Writes out the last page, padded with 0xFF like erased flash
+   */
+  void close() override;
+
+  void clear() override { pos = pageLen = 0; }
+
+  void apply() override { InternalStorage.apply(); }
+
+  long maxSize() override { return InternalStorage.maxSize(); }
+};
+
+/**
+ * Image the hub is downloading over cellular and how far it got, kept in flash to resume after a power cycle
+ */
+typedef struct {
+  uint16_t version = 0;
+  char url[FIRMWARE_URL_SIZE]{};
+  uint32_t length = 0;
+  uint8_t sha256[SHA256_SIZE]{};
+  // Bytes stored as of the last save, a multiple of FIRMWARE_SAVE_EVERY until complete
+  uint32_t saved = 0;
+  boolean isValid = false;
+} FirmwareDownloadState;
+
+/**
+ * Stores an image fetched with Network::DownloadAsync, pass write as its sink
+ * The image is only applied once its SHA-256 matches the one in the manifest
+ */
+class FirmwareDownload {
+private:
+  FirmwareDownloadState state;
+  ResumableStorage storage;
+  uint32_t written = 0;
+
+  void save();
+
+public:
+  /**
+   * Picks up an interrupted download from flash, returns true if there is one
+   */
+  bool load();
+
+  /**
+   * Starts downloading an image, or carries on if it's the one already being downloaded
+   * Returns false if it doesn't fit
+   */
+  bool start(uint16_t version, const char* url, uint32_t length, const uint8_t sha256[SHA256_SIZE]);
+
+  /**
+   * Stores the next bytes of the image, false if there are more than it has room for
+   */
+  bool write(const uint8_t* data, size_t len);
+
+  /**
+   * Hashes what was stored, true if it matches the manifest so it can be applied
+   * The download is forgotten either way, it starts over from the next manifest if it didn't match
+   */
+  bool verify();
+
+  void forget();
+
+  bool isActive() const { return state.isValid; }
+
+  bool isComplete() const { return state.isValid && written == state.length; }
+
+  const char* getUrl() const { return state.url; }
+
+  uint16_t getVersion() const { return state.version; }
+
+  uint32_t getWritten() const { return written; }
+
+  uint32_t getLength() const { return state.length; }
+};
+
+#endif
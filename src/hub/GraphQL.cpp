@@ -0,0 +1,89 @@
+#include <./hub/GraphQL.h>
+
+size_t GraphQL::writeString(char* out, const char* value, size_t maxLen, bool isJson) {
+  size_t len = 0;
+  if (!isJson) out[len++] = '\\';
+  out[len++] = '"';
+  for (size_t i = 0; i < maxLen && value[i]; i++) {
+    char c = value[i];
+    // Neither fits in a single line GraphQL string, and nothing we send has them
+    if (c < ' ') continue;
+    if (c == '"' || c == '\\') {
+      // Escaped for GraphQL, then both characters escaped again for JSON
+      if (!isJson) {
+        out[len++] = '\\';
+        out[len++] = '\\';
+      }
+      out[len++] = '\\';
+    }
+    out[len++] = c;
+  }
+  if (!isJson) out[len++] = '\\';
+  out[len++] = '"';
+  out[len] = '\0';
+  return len;
+}
+
+size_t GraphQL::writeFloat(char* out, double value, uint8_t digits, uint8_t decimals) {
+  double limit = 1;
+  for (uint8_t i = 0; i < digits; i++) limit *= 10;
+  limit -= 1;
+  if (isnan(value)) value = 0;
+  if (value > limit) value = limit;
+  else if (value < -limit) value = -limit;
+  return sprintf(out, "%.*f", decimals, value);
+}
+
+size_t GraphQL::writeReferences(char* out, const char* text, const char* prefix) {
+  size_t len = 0;
+  char name = 'a';
+  for (; *text; text++) {
+    out[len++] = *text;
+    if (*text != '$') continue;
+    len += sprintf(out + len, "%s%c", prefix, name++);
+  }
+  out[len] = '\0';
+  return len;
+}
+
+size_t GraphQL::writeDefinitions(char* out, const char* types, const char* prefix) {
+  size_t len = 0;
+  for (uint8_t i = 0; types[i]; i++) {
+    const char* typeName = types[i] == 'S' ? "String!" : types[i] == 'I' ? "Int!" : "Float!";
+    len += sprintf(out + len, "%s$%s%c:%s", i ? "," : "", prefix, 'a' + i, typeName);
+  }
+  return len;
+}
+
+size_t GraphQL::writeVariables(char* out, const char* types, const char* values, const char* prefix) {
+  size_t len = 0;
+  for (uint8_t i = 0; types[i]; i++) {
+    len += sprintf(out + len, "%s\"%s%c\":%s", i ? "," : "", prefix, 'a' + i, values);
+    values += strlen(values) + 1;
+  }
+  return len;
+}
+
+size_t GraphQL::varCountMismatch() {
+  return 0;
+}
+
+int8_t GraphQL::PersistedQueries::find(const uint8_t digest[SHA256_SIZE]) {
+  for (uint8_t i = 0; i < knownLen; i++) {
+    if (memcmp(known[i], digest, PREFIX_SIZE) == 0) return i;
+  }
+  return -1;
+}
+
+void GraphQL::PersistedQueries::remember(const uint8_t digest[SHA256_SIZE]) {
+  if (isKnown(digest)) return;
+  memcpy(known[nextIdx], digest, PREFIX_SIZE);
+  nextIdx = (nextIdx + 1) % SIZE;
+  if (knownLen < SIZE) knownLen++;
+}
+
+void GraphQL::PersistedQueries::forget(const uint8_t digest[SHA256_SIZE]) {
+  int8_t idx = find(digest);
+  // Zeroed rather than removed, it's replaced in turn like any other
+  if (idx >= 0) memset(known[idx], 0, PREFIX_SIZE);
+}
@@ -0,0 +1,214 @@
+#ifndef HUB_GRAPHQL_H
+#define HUB_GRAPHQL_H
+
+#include <Arduino.h>
+#include <./hub/Sha256.h>
+
+/**
+ * Builds GraphQL requests from templates declared once with the types of their variables
+ * Each $ in the text is replaced with the next value, escaped for the query string inside the JSON body
+ * or with a reference to a variable whose value goes in the variables object, see writeReferences
+ * The longest possible result is known at compile time so buffers can be sized with maxLength()
+ */
+namespace GraphQL {
+  // Longest variable type written by writeDefinitions
+  const uint8_t TYPE_NAME_SIZE = 7;
+
+  /**
+   * Quoted and escaped, for the query string when isJson is false and as a JSON value when it's true
+   */
+  size_t writeString(char* out, const char* value, size_t maxLen, bool isJson);
+
+  /**
+   * Values that don't fit in digits are clamped so the result never grows past Float::maxLength
+   */
+  size_t writeFloat(char* out, double value, uint8_t digits, uint8_t decimals);
+
+  /**
+   * String of at most Len characters, quoted and escaped, anything longer is cut off
+   * A quote or backslash becomes 4 characters once escaped for both GraphQL and JSON
+   */
+  template<size_t Len>
+  struct String {
+    typedef const char* Value;
+    static constexpr char type = 'S';
+    static constexpr size_t maxLength() { return 4 + 4 * Len; }
+    static constexpr size_t maxJsonLength() { return 2 + 2 * Len; }
+    static size_t write(char* out, Value value) { return writeString(out, value, Len, false); }
+    static size_t writeJson(char* out, Value value) { return writeString(out, value, Len, true); }
+  };
+
+  struct Int {
+    typedef long Value;
+    static constexpr char type = 'I';
+    static constexpr size_t maxLength() { return 11; }
+    static constexpr size_t maxJsonLength() { return 11; }
+    static size_t write(char* out, Value value) { return sprintf(out, "%ld", value); }
+    static size_t writeJson(char* out, Value value) { return write(out, value); }
+  };
+
+  /**
+   * Fixed point number, Digits is the most digits before the point
+   */
+  template<uint8_t Digits, uint8_t Decimals>
+  struct Float {
+    typedef double Value;
+    static constexpr char type = 'F';
+    static constexpr size_t maxLength() { return 2 + Digits + Decimals; }
+    static constexpr size_t maxJsonLength() { return maxLength(); }
+    static size_t write(char* out, Value value) { return writeFloat(out, value, Digits, Decimals); }
+    static size_t writeJson(char* out, Value value) { return write(out, value); }
+  };
+
+  /**
+   * Writes text with each $ replaced by a reference to a variable named prefix followed by a, b, c...
+   * ie createEvent(serial:$){ id } with prefix m0 becomes createEvent(serial:$m0a){ id }
+   */
+  size_t writeReferences(char* out, const char* text, const char* prefix);
+
+  /**
+   * Writes a definition for each of types (see Template::types) named like writeReferences, separated by commas
+   * ie $m0a:String!,$m0b:Float!
+   */
+  size_t writeDefinitions(char* out, const char* types, const char* prefix);
+
+  /**
+   * Writes the members of the variables object for values written by Template::writeValues, separated by commas
+   * ie "m0a":"12:34:56:78:9a:bc","m0b":1.50
+   */
+  size_t writeVariables(char* out, const char* types, const char* values, const char* prefix);
+
+  constexpr size_t countVars(const char* text) {
+    return *text ? (*text == '$') + countVars(text + 1) : 0;
+  }
+
+  // Not constexpr, so a template with the wrong number of $ fails to compile
+  size_t varCountMismatch();
+
+  template<typename... Vars>
+  struct VarsLength;
+
+  template<>
+  struct VarsLength<> {
+    static constexpr size_t value = 0;
+    static constexpr size_t json = 0;
+  };
+
+  template<typename Var, typename... Rest>
+  struct VarsLength<Var, Rest...> {
+    static constexpr size_t value = Var::maxLength() + VarsLength<Rest...>::value;
+    static constexpr size_t json = Var::maxJsonLength() + VarsLength<Rest...>::json;
+  };
+
+  template<typename... Vars>
+  class Template {
+  private:
+    const char* text;
+    size_t textLen;
+
+    size_t writeText(char* out, const char*& pos) const {
+      const char* end = strchr(pos, '$');
+      size_t len = end ? end - pos : strlen(pos);
+      memcpy(out, pos, len);
+      pos += end ? len + 1 : len;
+      return len;
+    }
+
+    template<int = 0>
+    size_t writeVars(char* out, const char*& pos) const {
+      size_t len = writeText(out, pos);
+      out[len] = '\0';
+      return len;
+    }
+
+    template<typename Var, typename... Rest>
+    size_t writeVars(char* out, const char*& pos, typename Var::Value value, typename Rest::Value... rest) const {
+      size_t len = writeText(out, pos);
+      len += Var::write(out + len, value);
+      return len + writeVars<Rest...>(out + len, pos, rest...);
+    }
+
+    template<int = 0>
+    static size_t writeValueList(char* out) {
+      out[0] = '\0';
+      return 0;
+    }
+
+    template<typename Var, typename... Rest>
+    static size_t writeValueList(char* out, typename Var::Value value, typename Rest::Value... rest) {
+      size_t len = Var::writeJson(out, value) + 1;
+      return len + writeValueList<Rest...>(out + len, rest...);
+    }
+
+  public:
+    /**
+     * Type of each variable, S, I or F, see writeDefinitions
+     */
+    static constexpr char types[sizeof...(Vars) + 1] = { Vars::type..., '\0' };
+
+    template<size_t N>
+    constexpr Template(const char (&text)[N])
+      : text(text), textLen(countVars(text) == sizeof...(Vars) ? N - 1 - sizeof...(Vars) : varCountMismatch()) {}
+
+    const char* getText() const { return text; }
+
+    /**
+     * Longest possible result, not including the null terminator
+     */
+    constexpr size_t maxLength() const { return textLen + VarsLength<Vars...>::value; }
+
+    /**
+     * Longest result of writeReferences plus writeDefinitions with a prefix of prefixLen
+     */
+    constexpr size_t maxReferencesLength(size_t prefixLen) const {
+      return textLen + sizeof...(Vars) * (2 * (prefixLen + 2) + 2 + TYPE_NAME_SIZE);
+    }
+
+    /**
+     * Longest result of writeValues, including the null terminator
+     */
+    static constexpr size_t maxValuesLength() { return VarsLength<Vars...>::json + sizeof...(Vars) + 1; }
+
+    /**
+     * Writes the template with values into out, which needs room for maxLength() + 1
+     * Returns the length written
+     */
+    size_t write(char* out, typename Vars::Value... values) const {
+      const char* pos = text;
+      return writeVars<Vars...>(out, pos, values...);
+    }
+
+    /**
+     * Writes each value as JSON followed by a null terminator, for writeVariables
+     */
+    static size_t writeValues(char* out, typename Vars::Value... values) {
+      return writeValueList<Vars...>(out, values...);
+    }
+  };
+
+  template<typename... Vars>
+  constexpr char Template<Vars...>::types[sizeof...(Vars) + 1];
+
+  /**
+   * Hashes of documents the server is known to have stored, so only the hash needs to be sent
+   * Kept in RAM since the server may forget them anyway, the oldest is replaced once full
+   */
+  class PersistedQueries {
+  private:
+    static const uint8_t SIZE = 8;
+    // Only the start of each hash is kept, plenty to tell a handful of documents apart
+    static const uint8_t PREFIX_SIZE = 8;
+    uint8_t known[SIZE][PREFIX_SIZE]{};
+    uint8_t knownLen = 0;
+    uint8_t nextIdx = 0;
+
+    int8_t find(const uint8_t digest[SHA256_SIZE]);
+
+  public:
+    bool isKnown(const uint8_t digest[SHA256_SIZE]) { return find(digest) >= 0; }
+    void remember(const uint8_t digest[SHA256_SIZE]);
+    void forget(const uint8_t digest[SHA256_SIZE]);
+  };
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef HUB_NATIVE
+#include <RTCZero.h>
+#include <ArduinoLowPower.h>
+#include <utility/HCI.h>
+#endif
+#include <./hub/Hal.h>
+#include <./hub/Utilities.h>
+
+#ifdef HUB_NATIVE
+BLELocalDevice BLE;
+#endif
+
+namespace Hal {
+  Stream* modemStream = nullptr;
+  void (*modemPowerListener)(bool on) = nullptr;
+  // Constant initialized, so it's already nullptr when the rows register during static initialization
+  const uint8_t* storageStart = nullptr;
+
+  StorageRow::StorageRow(const uint8_t* row) {
+    if (!storageStart || row < storageStart) storageStart = row;
+  }
+
+  const uint8_t* firstStorageRow() {
+    return storageStart;
+  }
+
+  Stream& modem() {
+    if (modemStream) return *modemStream;
+    return Serial1;
+  }
+
+  void setModem(Stream* stream) {
+    modemStream = stream;
+  }
+
+  void setModemPower(bool on) {
+    digitalWrite(SIM_MOSFET, on ? HIGH : LOW);
+    if (modemPowerListener) modemPowerListener(on);
+  }
+
+  void setModemPowerListener(void (*listener)(bool on)) {
+    modemPowerListener = listener;
+  }
+
+  int readBattery() {
+    return analogRead(BATT_PIN);
+  }
+
+#ifdef HUB_NATIVE
+  // millis() when the clock was started
+  unsigned long clockStart = 0;
+
+  void beginModem(unsigned long baud) {}
+
+  void beginClock() {
+    clockStart = millis();
+  }
+
+  uint32_t getEpoch() {
+    return (millis() - clockStart) / 1000;
+  }
+
+  void standby(uint32_t seconds) {
+    delay(seconds * 1000);
+  }
+
+  void idle(unsigned long ms) {
+    delay(ms);
+  }
+
+  bool setBlePower(bool on) {
+    return true;
+  }
+#else
+  RTCZero rtc;
+
+  void beginModem(unsigned long baud) {
+    Serial1.begin(baud);
+    while (!Serial1);
+  }
+
+  void beginClock() {
+    rtc.begin(true);
+  }
+
+  uint32_t getEpoch() {
+    return rtc.getEpoch();
+  }
+
+  void standby(uint32_t seconds) {
+    rtc.setAlarmEpoch(rtc.getEpoch() + seconds);
+    rtc.enableAlarm(rtc.MATCH_SS);
+    rtc.standbyMode();
+  }
+
+  void idle(unsigned long ms) {
+    LowPower.idle(ms);
+  }
+
+  bool setBlePower(bool on) {
+    digitalWrite(NINA_RESETN, on ? HIGH : LOW);
+    if (!on) return true;
+    Utilities::idle(750);
+    if (!HCI.begin()) return false;
+    if (HCI.reset() != 0) return false;
+    if (HCI.setEventMask(0x3FFFFFFFFFFFFFFF) != 0) return false;
+    return HCI.setLeEventMask(0x00000000000003FF) == 0;
+  }
+#endif
+}
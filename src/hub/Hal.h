@@ -0,0 +1,128 @@
+#ifndef HUB_HAL_H
+#define HUB_HAL_H
+
+#include <Arduino.h>
+
+// Every peripheral the hub logic touches goes through here, so the modem, ADC, clock,
+// BLE and flash can be replaced without changing their callers
+// With HUB_NATIVE (the native env) they're host stand-ins, see lib/NativeArduino for the Arduino core
+
+#ifdef HUB_NATIVE
+/**
+ * No radio on the host, modules that poll BLE while waiting on the modem get this instead of ArduinoBLE's
+ */
+class BLELocalDevice {
+public:
+  int begin() { return 1; }
+  void end() {}
+  void poll(unsigned long timeout = 0) {}
+};
+
+extern BLELocalDevice BLE;
+
+/**
+ * Same interface as FlashStorage's, kept in RAM, so it starts out zeroed like a row that was never written
+ */
+template<class T>
+class FlashStorageClass {
+private:
+  T value;
+
+public:
+  FlashStorageClass(const void* row) { memcpy((void*)&value, row, sizeof(T)); }
+  void write(T data) { value = data; }
+  void read(T* data) { *data = value; }
+  T read() { return value; }
+};
+
+#define HUB_FLASH_STORAGE(name, T) \
+  static const uint8_t name##Row[sizeof(T)] = {}; \
+  static Hal::StorageRow name##Registration(name##Row); \
+  FlashStorageClass<T> name(name##Row)
+#else
+#include <ArduinoBLE.h>
+#include <FlashStorage.h>
+
+/**
+ * A value of type T kept in a flash row of its own, read() and write() it like FlashStorage
+ * Same as FlashStorage(name, T), but the row is registered so firmware patches can leave it out, see firstStorageRow
+ */
+#define HUB_FLASH_STORAGE(name, T) \
+  __attribute__((__aligned__(256))) static const uint8_t name##Row[(sizeof(T) + 255) / 256 * 256] = {}; \
+  static Hal::StorageRow name##Registration(name##Row); \
+  FlashStorageClass<T> name(name##Row)
+#endif
+
+namespace Hal {
+  /**
+   * Registers a row HUB_FLASH_STORAGE keeps its value in, constructed along with it
+   */
+  class StorageRow {
+  public:
+    StorageRow(const uint8_t* row);
+  };
+
+  /**
+   * Lowest row registered by HUB_FLASH_STORAGE, nullptr if there aren't any
+   * The image is only the same as it was built up to here, the rows change as the hub runs
+   */
+  const uint8_t* firstStorageRow();
+
+  /**
+   * Starts the UART connected to the SIMCOM module
+   */
+  void beginModem(unsigned long baud);
+
+  /**
+   * Stream connected to the SIMCOM module, Serial1 unless replaced with setModem
+  **/
+  Stream& modem();
+
+  /**
+   * Replaces the stream returned by modem(), nullptr restores Serial1
+  **/
+  void setModem(Stream* stream);
+
+  /**
+   * Switches the SIM_MOSFET supply of the SIMCOM module
+   */
+  void setModemPower(bool on);
+
+  /**
+   * Called with the new state on every setModemPower, so a stand-in modem can follow along
+   */
+  void setModemPowerListener(void (*listener)(bool on));
+
+  /**
+   * Raw ADC reading of the battery voltage divider
+   */
+  int readBattery();
+
+  /**
+   * Starts the RTC, resetting the time
+   */
+  void beginClock();
+
+  /**
+   * Seconds since the RTC was started
+   */
+  uint32_t getEpoch();
+
+  /**
+   * Puts the MCU in standby until the RTC wakes it up in the provided number of seconds
+   */
+  void standby(uint32_t seconds);
+
+  /**
+   * Idles the CPU for up to the provided number of ms, an interrupt can end it early
+   */
+  void idle(unsigned long ms);
+
+  /**
+   * Resets the NINA module and brings up its HCI transport, or holds it in reset
+   * Returns false if it didn't come up
+   */
+  bool setBlePower(bool on);
+}
+
+#endif
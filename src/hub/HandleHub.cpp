@@ -1,18 +1,32 @@
 #include <ArduinoBLE.h>
 #include <ArduinoOTA.h>
 #include <ArduinoJson.h>
-#include <RTCZero.h>
+#include <./hub/Hal.h>
 #include <./hub/Utilities.h>
 #include <./hub/Network.h>
 #include <./hub/Location.h>
+#include <./hub/Benchmark.h>
+#include <./hub/ModemEmulator.h>
+#include <./hub/Uploads.h>
+#include <./hub/Queries.h>
+#include <./hub/Timings.h>
+#include <./hub/Log.h>
+#include <./hub/Sensors.h>
+#include <./hub/Ota.h>
+#include <./hub/Patch.h>
+#include <./hub/FirmwareDownload.h>
+#include <./hub/Track.h>
+#include <./sensor/ForceDetector.h>
 
 const int VERSION = 1;
 
 const char* DEVICE_NAME = "HandleIt Hub";
 
 const char* PERIPHERAL_NAME = "HandleIt Client";
-const char* SENSOR_SERVICE_UUID = "1000181a-0000-1000-8000-00805f9b34fb";
-const char* VOLT_CHARACTERISTIC_UUID = "10002A58-0000-1000-8000-00805f9b34fb";
+const char* SENSOR_SERVICE_UUID = "0000181a-0000-1000-8000-00805f9b34fb";
+const char* VOLT_CHARACTERISTIC_UUID = "00002A58-0000-1000-8000-00805f9b34fb";
+const char* EVENTS_CHARACTERISTIC_UUID = "00002A59-0000-1000-8000-00805f9b34fb";
+const char* EVENTS_ACK_CHARACTERISTIC_UUID = "00002A5A-0000-1000-8000-00805f9b34fb";
 
 const char* BATTERY_SERVICE_UUID = "0000180f-0000-1000-8000-00805f9b34fb";
 const char* BATTERY_LEVEL_CHARACTERISTIC_UUID = "00002a19-0000-1000-8000-00805f9b34fb";
@@ -21,15 +35,24 @@ const char* HUB_SERVICE_UUID = "0000181a-0000-1000-8000-00805f9b34fc";
 const char* COMMAND_CHARACTERISTIC_UUID = "00002A58-0000-1000-8000-00805f9b34fd";
 const char* TRANSFER_CHARACTERISTIC_UUID = "00002A58-0000-1000-8000-00805f9b34fe";
 const char* FIRMWARE_CHARACTERISTIC_UUID = "2A26";
+const char* TIMINGS_CHARACTERISTIC_UUID = "00002A58-0000-1000-8000-00805f9b34ff";
 
 const char* COMMAND_START_SENSOR_SEARCH = "StartSensorSearch";
 const char* COMMAND_SENSOR_CONNECT = "SensorConnect";
 
-const uint16_t CHUNK_SIZE = 250;
+const uint16_t CHUNK_SIZE = OTA_HEADER_SIZE + OTA_MAX_CHUNK;
+// Longest command a phone writes, ie StartHubPatch:262144,244,cbf43926,262144
+const uint8_t COMMAND_SIZE = 48;
+// Preferred connection interval for phones (in 1.25ms units), short enough to move a chunk every event during OTA
+const uint16_t PHONE_CONN_INTERVAL_MIN = 12;
+const uint16_t PHONE_CONN_INTERVAL_MAX = 24;
 BLEService hubService = BLEService(HUB_SERVICE_UUID);
-BLEStringCharacteristic commandChar(COMMAND_CHARACTERISTIC_UUID, BLERead | BLEWrite, 30);
-BLECharacteristic transferChar(TRANSFER_CHARACTERISTIC_UUID, BLERead | BLEWrite, CHUNK_SIZE);
+BLEStringCharacteristic commandChar(COMMAND_CHARACTERISTIC_UUID, BLERead | BLEWrite, COMMAND_SIZE);
+// OTA chunks are written without response, acks are notified back, see OtaTransfer
+BLECharacteristic transferChar(TRANSFER_CHARACTERISTIC_UUID, BLERead | BLEWrite | BLEWriteWithoutResponse | BLENotify, CHUNK_SIZE);
 BLEIntCharacteristic firmwareChar(FIRMWARE_CHARACTERISTIC_UUID, BLERead);
+// CommandTimings::write, refreshed when a phone connects and when uploaded
+BLECharacteristic timingsChar(TIMINGS_CHARACTERISTIC_UUID, BLERead, TIMINGS_BINARY_SIZE, true);
 
 BLEService battService = BLEService(BATTERY_SERVICE_UUID);
 BLEIntCharacteristic battLevelChar(BATTERY_LEVEL_CHARACTERISTIC_UUID, BLERead | BLEWrite);
@@ -42,13 +65,54 @@ const unsigned long BLE_SCAN_DURATION = 1 * 1000;
 const unsigned long BLE_COOLDOWN = 20 * 1000;
 
 const unsigned long BATT_UPDATE_INTERVAL = 30 * 60 * 1000;
+// Command timings are sent with the first radio wake after this long, then start over (in seconds)
+const uint32_t TIMINGS_UPLOAD_INTERVAL = 6 * 60 * 60;
 
 BLEDevice* peripheral;
+// The sensor's volts once subscribed, it indicates whenever its force level changes
+BLECharacteristic sensorVolts;
+// Its ring of level changes, read in bulk and acknowledged up to the last one handled
+BLECharacteristic sensorEvents;
+BLECharacteristic sensorEventsAck;
+uint16_t lastSensorEventSeq = 0;
+bool hasSensorEventSeq = false;
+// Set when the last read didn't get every event, so it's read again once there's room in the upload queue
+bool hasMoreSensorEvents = false;
+// Set when a sensor that advertises its state was connected to only to read its ring, it's let go once that's done
+bool isReadingSensorRing = false;
+// Presses a sensor can advertise since its ring was last read before it's connected to just to read it,
+// each is at least 2 of the ring's FORCE_EVENTS_SIZE level changes so it's read before dropping any
+const uint16_t SENSOR_RING_READ_EVENTS = FORCE_EVENTS_SIZE / 2 - 2;
+// Manufacturer data paired sensors advertise their state in, see updateAdvData in HandleSensor.cpp
+// company id, format version, force level (volts * 10), event count (LE), battery % (0xFF if unknown)
+const uint16_t SENSOR_ADV_COMPANY_ID = 0xFFFF;
+const uint8_t SENSOR_ADV_FORMAT_VERSION = 1;
+const uint8_t SENSOR_ADV_DATA_SIZE = 7;
 bool isAddingNewSensor = false;
 bool isScanning = false;
 unsigned long lastScanTime = 0;
 unsigned long lastEventTime = 0;
 unsigned long lastBatteryUpdateTime = 0;
+uint32_t lastTimingsUploadTime = 0;
+// Static memory for the timings request, sent on its own since it's too large for the upload queue
+char timingsQuery[TIMINGS_JSON_SIZE + 160]{};
+// Sensors are fetched with the first radio wake after this long (in seconds), known ones are kept in flash meanwhile
+const uint32_t SENSORS_SYNC_INTERVAL = 24 * 60 * 60;
+// Room for KNOWN_SENSORS_SIZE serials
+const size_t SENSORS_RESPONSE_SIZE = 3072;
+char sensorsQuery[] = "{\"query\":\"query getMySensors{hubViewer{sensors{serial}}}\",\"variables\":{}}";
+ResponseFilter sensorsFilter;
+bool isSensorsSynced = false;
+uint32_t lastSensorsSyncTime = 0;
+// The firmware manifest is checked with the first radio wake after this long (in seconds)
+const uint32_t FIRMWARE_CHECK_INTERVAL = 24 * 60 * 60;
+const size_t FIRMWARE_RESPONSE_SIZE = 512;
+char firmwareQuery[] = "{\"query\":\"query hubFirmware{hubFirmware{version url size sha256}}\",\"variables\":{}}";
+ResponseFilter firmwareFilter;
+bool isFirmwareChecked = false;
+uint32_t lastFirmwareCheckTime = 0;
+// Image fetched over cellular when the manifest has a newer version, a range at a time
+FirmwareDownload firmwareDownload;
 
 unsigned long advStartTime = 0;
 unsigned long pairButtonHoldStartTime = 0;
@@ -56,35 +120,55 @@ BLEDevice* phone;
 
 Network network;
 Location location;
+UploadQueue uploads;
+// Fixes waiting to be uploaded, and how many of them the request in flight has
+Track track;
+char trackQuery[TRACK_JSON_SIZE + 160]{};
+uint8_t trackSentLen = 0;
 
 Command currentCommand;
+// Kept across disconnects so an interrupted update resumes where it stopped
+OtaTransfer ota;
+OtaWriter otaWriter(InternalStorage);
+PatchDecoder patcher(otaWriter, (const uint8_t*)SKETCH_START);
+// Whether the transfer is a patch for patcher rather than the image itself
+bool isPatching = false;
 String lastReadCommand = "";
 
-String knownSensorAddrs[10];
-uint8_t knownSensorAddrsLen = 0;
+KnownSensors knownSensors;
 int32_t lastReadVoltage = 0;
-
-RTCZero rtc;
+#ifdef HUB_BENCHMARK
+// Passes of the state machine averaged once the sketch has booted against the emulator
+const uint16_t LOOP_BENCHMARK_PASSES = 200;
+bool isLoopBenchmarked = false;
+#endif
 
 uint32_t epochMillis() {
-  return rtc.getEpoch() * 1000;
+  return Hal::getEpoch() * 1000;
 }
 
 void setAdvMode(bool turnOn) {
   if (turnOn && advStartTime == 0) {
     if (!isScanning) Utilities::setBlePower(true);
-    Serial.println("Now advertising");
+    LOG_INFOLN(LOG_BLE, "Now advertising");
     BLE.advertise();
   } else if (!turnOn) {
     advStartTime = 0;
     BLE.stopAdvertise();
-    Serial.println("Stopped advertising");
+    LOG_INFOLN(LOG_BLE, "Stopped advertising");
   }
 }
 
+void UpdateTimingsChar() {
+  uint8_t timings[TIMINGS_BINARY_SIZE]{};
+  commandTimings.write(timings);
+  timingsChar.writeValue(timings, sizeof timings);
+}
+
 void onBLEConnected(BLEDevice d) {
-  Serial.print("\n>>> BLEConnected to: ");
-  Serial.println(d.address());
+  LOG_INFO(LOG_APP, "\n>>> BLEConnected to: ");
+  LOG_INFOLN(LOG_APP, d.address());
+  UpdateTimingsChar();
 
   // d not populated with localName for some reason
   bool dNameMatch = peripheral && peripheral->address().compareTo(d.address()) == 0;
@@ -92,104 +176,112 @@ void onBLEConnected(BLEDevice d) {
   setAdvMode(false);
   if (dNameMatch) {
     // if we just connectd to a peripheral then there's nothing else to do
-    Serial.println("Connected to a sensor");
+    LOG_INFOLN(LOG_APP, "Connected to a sensor");
     return;
   }
-  Serial.println("Connected to a phone");
+  LOG_INFOLN(LOG_APP, "Connected to a phone");
   phone = new BLEDevice();
   *phone = d;
   digitalWrite(LED_BUILTIN, HIGH);
   if (network.tokenData.isValid) {
-    Serial.println("Already have accessToken");
+    LOG_INFOLN(LOG_APP, "Already have accessToken");
     return;
   }
   // Grab access_token from userId of connected phone
-  char rawCommand[30]{};
-  Serial.print("Trying to read userid...");
+  char rawCommand[COMMAND_SIZE]{};
+  LOG_INFO(LOG_APP, "Trying to read userid...");
   while (strlen(rawCommand) < 1 && phone) {
     // Required to allow the phone to finish connecting properly
     BLE.poll();
     if (commandChar.written()) {
       String writtenVal = commandChar.value();
-      writtenVal.toCharArray(rawCommand, 30);
+      writtenVal.toCharArray(rawCommand, COMMAND_SIZE);
     }
-    Serial.print(".");
+    LOG_DEBUG(LOG_APP, ".");
     Utilities::bleDelay(50, &BLE);
   }
   if (!phone) return;
-  Serial.print("\nUserID value: ");
-  Serial.println(rawCommand);
+  LOG_INFO(LOG_APP, "\nUserID value: ");
+  LOG_INFOLN(LOG_APP, rawCommand);
 
   Command command = Utilities::parseRawCommand(rawCommand);
   if (strcmp(command.type, "UserId") != 0) {
-    Serial.print("Error: command.type is not equal to UserId, command.type: ");
-    Serial.println(command.type);
+    LOG_WARN(LOG_APP, "Error: command.type is not equal to UserId, command.type: ");
+    LOG_WARNLN(LOG_APP, command.type);
     return;
   } else {
-    Serial.println("command.type is UserId");
+    LOG_INFOLN(LOG_APP, "command.type is UserId");
   }
 
   if (!network.setPowerOnAndWaitForReg(&BLE)) return;
   BLE.poll(); // helps recover from starting up
 
-  char loginMutationStr[100 + strlen(command.value) + strlen(deviceImei)]{};
-  sprintf(loginMutationStr, "{\"query\":\"mutation loginAsHub{loginAsHub(userId:%s, serial:\\\"%s\\\", imei:\\\"%s\\\")}\",\"variables\":{}}", command.value, BLE.address().c_str(), deviceImei);
-  DynamicJsonDocument loginDoc = network.SendRequest(loginMutationStr, &BLE);
+  char loginMutationStr[LOGIN_AS_HUB.maxLength() + 1]{};
+  LOGIN_AS_HUB.write(loginMutationStr, strtol(command.value, NULL, 10), BLE.address().c_str(), deviceImei);
+  ResponseFilter loginFilter;
+  loginFilter["data"]["loginAsHub"] = true;
+  DynamicJsonDocument loginDoc = network.SendRequest(loginMutationStr, &BLE, &loginFilter, 384);
   if (loginDoc["data"] && loginDoc["data"]["loginAsHub"]) {
     const char* token = (const char*)(loginDoc["data"]["loginAsHub"]);
     network.SetAccessToken(token);
-    Serial.print("token is: ");
-    Serial.println(token);
-    Serial.print("network.accessToken is: ");
-    Serial.println(network.tokenData.accessToken);
-    Serial.print("And strlen: ");
-    Serial.println(strlen(network.tokenData.accessToken));
+    LOG_DEBUG(LOG_APP, "token is: ");
+    LOG_DEBUGLN(LOG_APP, token);
+    LOG_DEBUG(LOG_APP, "network.accessToken is: ");
+    LOG_DEBUGLN(LOG_APP, network.tokenData.accessToken);
+    LOG_DEBUG(LOG_APP, "And strlen: ");
+    LOG_DEBUGLN(LOG_APP, strlen(network.tokenData.accessToken));
     // TODO check if token is different from existing token in flash storage, if so replace it
     // cmaglie/FlashStorage
   } else {
-    Serial.println("Error reading token");
-    network.setPower(false);
+    LOG_WARNLN(LOG_APP, "Error reading token");
+    network.release(&BLE);
     return;
   }
 
   char getHubQueryStr[] = "{\"query\":\"query getHubViewer{hubViewer{id}}\",\"variables\":{}}";
-  DynamicJsonDocument hubViewerDoc = network.SendRequest(getHubQueryStr, &BLE);
+  ResponseFilter hubViewerFilter;
+  hubViewerFilter["data"]["hubViewer"]["id"] = true;
+  DynamicJsonDocument hubViewerDoc = network.SendRequest(getHubQueryStr, &BLE, &hubViewerFilter, 256);
   if (hubViewerDoc["data"] && hubViewerDoc["data"]["hubViewer"]) {
     const uint16_t id = (const uint16_t)(hubViewerDoc["data"]["hubViewer"]["id"]);
-    Serial.print("getHubViewer id: ");
-    Serial.println(id);
+    LOG_INFO(LOG_APP, "getHubViewer id: ");
+    LOG_INFOLN(LOG_APP, id);
     String hubCommand = "HubId:";
     hubCommand.concat(id);
-    Serial.print("Wrote HubId command back to phone: ");
-    Serial.println(hubCommand);
+    LOG_INFO(LOG_APP, "Wrote HubId command back to phone: ");
+    LOG_INFOLN(LOG_APP, hubCommand);
     commandChar.writeValue(hubCommand);
     Utilities::bleDelay(5000, &BLE);
     setAdvMode(false);
   } else {
-    Serial.println("Error getting hubId");
+    LOG_WARNLN(LOG_APP, "Error getting hubId");
   }
-  network.setPower(false);
+  network.release(&BLE);
 }
 
 void onBLEDisconnected(BLEDevice d) {
-  Serial.print("\n>>> BLEDisconnecting from: ");
-  Serial.println(d.address());
+  LOG_INFO(LOG_BLE, "\n>>> BLEDisconnecting from: ");
+  LOG_INFOLN(LOG_BLE, d.address());
   if (phone) {
-    Serial.print("Phone address: ");
-    Serial.println(phone->address());
+    LOG_INFO(LOG_BLE, "Phone address: ");
+    LOG_INFOLN(LOG_BLE, phone->address());
   }
   if (peripheral) {
-    Serial.print("Peripheral address: ");
-    Serial.println(peripheral->address());
+    LOG_INFO(LOG_BLE, "Peripheral address: ");
+    LOG_INFOLN(LOG_BLE, peripheral->address());
   }
   digitalWrite(LED_BUILTIN, LOW);
   if (peripheral && peripheral->address() == d.address()) {
-    Serial.println("Peripheral disconnected");
+    LOG_INFOLN(LOG_BLE, "Peripheral disconnected");
     Utilities::analogWriteRGB(0, 0, 0);
+    sensorVolts = BLECharacteristic();
+    sensorEvents = BLECharacteristic();
+    sensorEventsAck = BLECharacteristic();
+    isReadingSensorRing = false;
     delete peripheral;
     peripheral = nullptr;
   } else if (phone && phone->address() == d.address()) {
-    Serial.println("Phone disconnected");
+    LOG_INFOLN(LOG_BLE, "Phone disconnected");
     delete phone;
     phone = nullptr;
     isAddingNewSensor = false;
@@ -199,9 +291,21 @@ void onBLEDisconnected(BLEDevice d) {
   }
 }
 
+bool writeToStorage(const uint8_t* data, size_t len) {
+  return isPatching ? patcher.write(data, len) : otaWriter.write(data, len);
+}
+
+/**
+ * Called from BLE.poll for every chunk, so chunks written back to back without response aren't lost
+ */
+void onTransferWritten(BLEDevice device, BLECharacteristic characteristic) {
+  if (!ota.isActive()) return;
+  ota.receive(characteristic.value(), characteristic.valueLength(), millis());
+}
+
 bool initializeBLE() {
   if (!BLE.begin()) {
-    Serial.println("starting BLE failed!");
+    LOG_ERRORLN(LOG_BLE, "starting BLE failed!");
     return false;
   }
   // BLE service to advertise to phone
@@ -209,7 +313,9 @@ bool initializeBLE() {
   BLE.setAdvertisedService(hubService);
   hubService.addCharacteristic(commandChar);
   hubService.addCharacteristic(transferChar);
+  transferChar.setEventHandler(BLEWritten, onTransferWritten);
   hubService.addCharacteristic(firmwareChar);
+  hubService.addCharacteristic(timingsChar);
   BLE.addService(hubService);
   firmwareChar.writeValue(VERSION);
   battService.addCharacteristic(battLevelChar);
@@ -218,24 +324,143 @@ bool initializeBLE() {
   // Bluetooth LE connection handlers
   BLE.setEventHandler(BLEConnected, onBLEConnected);
   BLE.setEventHandler(BLEDisconnected, onBLEDisconnected);
+  // Requested by the hub once a phone connects, the phone picks the MTU and sends its chunk size with StartHubUpdate
+  BLE.setConnectionInterval(PHONE_CONN_INTERVAL_MIN, PHONE_CONN_INTERVAL_MAX);
   BLE.stopAdvertise();
-  Serial.print("BLE address: ");
-  Serial.println(BLE.address());
+  LOG_INFO(LOG_BLE, "BLE address: ");
+  LOG_INFOLN(LOG_BLE, BLE.address());
   return true;
 }
 
+bool writeFirmware(const uint8_t* data, size_t len, void* context) {
+  return firmwareDownload.write(data, len);
+}
+
+/**
+ * Applies the downloaded image if its hash matches the manifest, only returns if it didn't
+ */
+void ApplyFirmware() {
+  LOG_INFO(LOG_OTA, "Verifying downloaded firmware version ");
+  LOG_INFOLN(LOG_OTA, firmwareDownload.getVersion());
+  if (!firmwareDownload.verify()) return;
+  LOG_INFOLN(LOG_OTA, "Sketch update apply and reset.");
+  Serial.flush();
+  InternalStorage.apply(); // this doesn't return
+}
+
+/**
+ * Chains the next range of the image until all of it is stored, then applies it
+ */
+void onFirmwareDownloaded(bool success, JsonDocument& doc, void* context) {
+  if (success && firmwareDownload.isComplete()) {
+    ApplyFirmware();
+  } else if (success) {
+    uint32_t written = firmwareDownload.getWritten();
+    if (network.DownloadAsync(firmwareDownload.getUrl(), written, firmwareDownload.getLength() - written, writeFirmware, onFirmwareDownloaded, nullptr, &BLE)) return;
+  } else {
+    LOG_WARN(LOG_OTA, "Firmware download stopped at ");
+    LOG_WARN(LOG_OTA, firmwareDownload.getWritten());
+    LOG_WARNLN(LOG_OTA, " bytes, it carries on with the next radio wake.");
+  }
+  if (!location.isPowered) network.release(&BLE);
+}
+
+/**
+ * Carries on with the image being downloaded, returns false if there isn't one or it couldn't be requested
+ */
+bool DownloadFirmware() {
+  if (!firmwareDownload.isActive() || firmwareDownload.isComplete()) return false;
+  uint32_t written = firmwareDownload.getWritten();
+  return network.DownloadAsync(firmwareDownload.getUrl(), written, firmwareDownload.getLength() - written, writeFirmware, onFirmwareDownloaded, nullptr, &BLE) != 0;
+}
+
+void onFirmwareChecked(bool success, JsonDocument& doc, void* context) {
+  if (success && doc["data"]) {
+    isFirmwareChecked = true;
+    lastFirmwareCheckTime = Hal::getEpoch();
+    // Null without a release, which reads as version 0
+    JsonVariant firmware = doc["data"]["hubFirmware"];
+    const int version = firmware["version"];
+    const uint32_t size = firmware["size"];
+    const char* url = firmware["url"];
+    uint8_t sha256[SHA256_SIZE];
+    if (version <= VERSION) {
+      // Whatever was being downloaded was superseded or already applied
+      firmwareDownload.forget();
+    } else if (!url || !Sha256::fromHex(firmware["sha256"], sha256) || !firmwareDownload.start(version, url, size, sha256)) {
+      LOG_WARNLN(LOG_OTA, "Firmware manifest is invalid or the image doesn't fit");
+    } else {
+      LOG_INFO(LOG_OTA, "Downloading firmware version ");
+      LOG_INFOLN(LOG_OTA, version);
+      if (DownloadFirmware()) return;
+    }
+  } else {
+    LOG_WARNLN(LOG_OTA, "Get firmware manifest failed");
+  }
+  if (!location.isPowered) network.release(&BLE);
+}
+
+/**
+ * Fetches the firmware manifest if it's due, otherwise carries on with an interrupted download
+ * Returns false if there's nothing to do or it couldn't be requested
+ */
+bool CheckFirmware() {
+  // Shares storage with an update from a phone, which resumes if the phone comes back
+  if (!network.tokenData.isValid || ota.isActive()) return false;
+  if (isFirmwareChecked && Hal::getEpoch() < lastFirmwareCheckTime + FIRMWARE_CHECK_INTERVAL) return DownloadFirmware();
+  return network.SendRequestAsync(firmwareQuery, onFirmwareChecked, nullptr, &BLE, &firmwareFilter, FIRMWARE_RESPONSE_SIZE) != 0;
+}
+
+void onSensorsSynced(bool success, JsonDocument& doc, void* context) {
+  if (success && doc["data"] && doc["data"]["hubViewer"] && doc["data"]["hubViewer"]["sensors"]) {
+    isSensorsSynced = true;
+    lastSensorsSyncTime = Hal::getEpoch();
+    const JsonArrayConst sensors = doc["data"]["hubViewer"]["sensors"];
+    uint8_t macs[KNOWN_SENSORS_SIZE][MAC_SIZE];
+    uint8_t macsLen = 0;
+    for (size_t i = 0; i < sensors.size() && macsLen < KNOWN_SENSORS_SIZE; i++) {
+      if (KnownSensors::parseMac(sensors[i]["serial"], macs[macsLen])) macsLen++;
+    }
+    // Flash is only written when the server's list differs from it
+    if (knownSensors.sync(macs, macsLen)) knownSensors.save();
+    LOG_INFO(LOG_APP, "Known sensors synced: ");
+    LOG_INFOLN(LOG_APP, knownSensors.length());
+  } else {
+    LOG_WARN(LOG_APP, "Get sensors failed, but accessToken strlen is: ");
+    LOG_WARNLN(LOG_APP, strlen(network.tokenData.accessToken));
+  }
+  if (success && CheckFirmware()) return;
+  if (!location.isPowered) network.release(&BLE);
+}
+
+/**
+ * Fetches the sensors paired to this hub if they're due, returns false if they aren't or couldn't be fetched
+ */
+bool SyncSensors() {
+  if (!network.tokenData.isValid) return false;
+  if (isSensorsSynced && Hal::getEpoch() < lastSensorsSyncTime + SENSORS_SYNC_INTERVAL) return false;
+  return network.SendRequestAsync(sensorsQuery, onSensorsSynced, nullptr, &BLE, &sensorsFilter, SENSORS_RESPONSE_SIZE) != 0;
+}
+
 void setup() {
   Utilities::setupPins();
-  rtc.begin(true);
+  Hal::beginClock();
   Serial.begin(115200);
   while (!Serial);
-  Serial.println("Booting...");
+  LOG_INFOLN(LOG_APP, "Booting...");
   Utilities::happyDance();
   Utilities::analogWriteRGB(0, 0, 0);
-  Serial1.begin(115200);
-  while (!Serial1);
-  Serial.println("Serial1 started at 115200 baud");
-  while (Serial1.available()) Serial1.read();
+  Hal::beginModem(115200);
+  LOG_INFOLN(LOG_APP, "Serial1 started at 115200 baud");
+#ifdef HUB_BENCHMARK
+  // Then boots against the emulator, so loop() can be benchmarked too
+  Benchmark::runAll();
+#endif
+#ifdef HUB_MODEM_EMULATOR
+  modemEmulator.install();
+  LOG_INFOLN(LOG_APP, "Using SIM800 emulator instead of Serial1");
+#endif
+  while (Hal::modem().available()) Hal::modem().read();
 
   // while (true)
   // {
@@ -266,40 +491,30 @@ void setup() {
   network.waitForPowerOn();
   while (strlen(deviceImei) < 1) {
     network.GetImei(deviceImei);
-    Serial.print("Device IMEI: ");
-    Serial.println(deviceImei);
+    LOG_INFO(LOG_APP, "Device IMEI: ");
+    LOG_INFOLN(LOG_APP, deviceImei);
   }
   location.setGPSPower(false);
 
   // begin BLE initialization
   if (!initializeBLE()) while (true);
-  Serial.print("Sketch version ");
-  Serial.print(VERSION);
-  Serial.print(". Free Memory is: ");
-  Serial.println(Utilities::freeMemory());
+  LOG_INFO(LOG_APP, "Sketch version ");
+  LOG_INFO(LOG_APP, VERSION);
+  LOG_INFO(LOG_APP, ". Free Memory is: ");
+  LOG_INFOLN(LOG_APP, Utilities::freeMemory());
 
   network.InitializeAccessToken();
 
-  if (network.tokenData.isValid && network.setPowerOnAndWaitForReg()) {
-    char sensorQuery[] = "{\"query\":\"query getMySensors{hubViewer{sensors{serial}}}\",\"variables\":{}}";
-    DynamicJsonDocument doc = network.SendRequest(sensorQuery, &BLE);
-    if (doc["data"] && doc["data"]["hubViewer"] && doc["data"]["hubViewer"]["sensors"]) {
-      const JsonArrayConst sensors = doc["data"]["hubViewer"]["sensors"];
-      if (sensors.size()) {
-        for (uint8_t i = 0; i < sensors.size(); i++) {
-          knownSensorAddrs[i] = String((const char*)sensors[i]["serial"]);
-          knownSensorAddrsLen++;
-          Serial.print(knownSensorAddrs[i]);
-          Serial.print(" is knownSensorAddrs at idx: ");
-          Serial.println(i);
-        }
-      }
-    } else {
-      Serial.print("Get sensors failed, but accessToken strlen is: ");
-      Serial.println(strlen(network.tokenData.accessToken));
-    }
-  }
-  network.setPower(false);
+  // Known right away, even with no network
+  bool isRosterSaved = knownSensors.load();
+  LOG_INFO(LOG_APP, "Known sensors in flash: ");
+  LOG_INFOLN(LOG_APP, knownSensors.length());
+  sensorsFilter["data"]["hubViewer"]["sensors"][0]["serial"] = true;
+  firmwareFilter["data"]["hubFirmware"] = true;
+  firmwareDownload.load();
+  // Nothing's saved on the first boot, so they're fetched now instead of with the next upload
+  if (!isRosterSaved && SyncSensors()) return;
+  network.release(&BLE);
 }
 
 void CheckInput() {
@@ -326,7 +541,7 @@ void PairToPhone() {
   if (epochMillis() > advStartTime + BLE_ADV_DURATION) {
     // pairing timed out
     setAdvMode(false);
-    network.setPower(false);
+    network.release(&BLE);
     Utilities::analogWriteRGB(255, 0, 0);
     return;
   }
@@ -340,7 +555,7 @@ void PairToPhone() {
 void ListenForPhoneCommands() {
   if (!phone || !commandChar.written()) return;
   // Grab access_token from userId of connected phone
-  char rawCommand[30]{};
+  char rawCommand[COMMAND_SIZE]{};
   String writtenVal = commandChar.value();
   if (writtenVal == lastReadCommand) return;
   lastReadCommand = writtenVal;
@@ -350,22 +565,22 @@ void ListenForPhoneCommands() {
     isAddingNewSensor = false;
     return;
   }
-  writtenVal.toCharArray(rawCommand, 30);
+  writtenVal.toCharArray(rawCommand, COMMAND_SIZE);
 
-  Serial.print("\nCommand value: ");
-  Serial.println(rawCommand);
+  LOG_INFO(LOG_APP, "\nCommand value: ");
+  LOG_INFOLN(LOG_APP, rawCommand);
 
   currentCommand = Utilities::parseRawCommand(rawCommand);
 
   if (strcmp(currentCommand.type, COMMAND_START_SENSOR_SEARCH) == 0) {
-    Serial.println("Now adding new sensor");
+    LOG_DEBUGLN(LOG_APP, "Now adding new sensor");
     isAddingNewSensor = true;
   }
 
-  Serial.print("Parsed command type: ");
-  Serial.println(currentCommand.type);
-  Serial.print("Parsed command value: ");
-  Serial.println(currentCommand.value);
+  LOG_DEBUG(LOG_APP, "Parsed command type: ");
+  LOG_DEBUGLN(LOG_APP, currentCommand.type);
+  LOG_DEBUG(LOG_APP, "Parsed command value: ");
+  LOG_DEBUGLN(LOG_APP, currentCommand.value);
 }
 
 // Returns battery level represented from 0 - 100
@@ -383,35 +598,149 @@ double getBatteryLevel(double volts) {
   return 0.0;
 }
 
+void onBatteryLevelUpdated(JsonVariant result) {
+  const uint16_t id = (const uint16_t)(result["id"]);
+  LOG_INFO(LOG_POWER, "updatedHubBatteryLevel hubId is: ");
+  LOG_INFOLN(LOG_POWER, id);
+}
+
 void UpdateBatteryLevel() {
   double avgVoltage = 0;
   uint8_t sampleSize = 90;
   for (uint8_t i = 0; i < sampleSize; i++) {
-    avgVoltage += analogRead(BATT_PIN);
+    avgVoltage += Hal::readBattery();
     // if (i % 5 == 0) delay(1);
   }
   avgVoltage /= sampleSize;
   double level = getBatteryLevel(avgVoltage);
-  Serial.print("avgVoltage is: ");
-  Serial.print(avgVoltage);
-  Serial.print(", level: ");
-  Serial.println(level);
+  LOG_INFO(LOG_POWER, "avgVoltage is: ");
+  LOG_INFO(LOG_POWER, avgVoltage);
+  LOG_INFO(LOG_POWER, ", level: ");
+  LOG_INFOLN(LOG_POWER, level);
   battLevelChar.writeValue((uint8_t)round(level));
+  network.setBatteryLevel((uint8_t)round(level));
 
   lastBatteryUpdateTime = epochMillis();
-  if (!network.tokenData.isValid || !network.setPowerOnAndWaitForReg()) return;
-
-  char updateHubBatteryLevel[150]{};
-  sprintf(updateHubBatteryLevel, "{\"query\":\"mutation UpdateHubBatteryLevel{updateHubBatteryLevel(volts:%.2f, percent:%.2f){ id }}\",\"variables\":{}}", avgVoltage, level);
-  DynamicJsonDocument doc = network.SendRequest(updateHubBatteryLevel, &BLE);
-  if (doc["data"] && doc["data"]["updateHubBatteryLevel"]) {
-    const uint16_t id = (const uint16_t)(doc["data"]["updateHubBatteryLevel"]["id"]);
-    Serial.print("updatedHubBatteryLevel hubId is: ");
-    Serial.println(id);
+  if (!network.tokenData.isValid) return;
+
+  // Sent with the next radio wake instead of waking the module just for this
+  uploads.add(UPLOAD_BATTERY, UPDATE_HUB_BATTERY_LEVEL, onBatteryLevelUpdated, avgVoltage, level);
+}
+
+void onTimingsUploaded(bool success, JsonDocument& doc, void* context) {
+  if (success && doc["data"]) {
+    // Each upload only covers the time since the last one
+    commandTimings.clear();
+    lastTimingsUploadTime = Hal::getEpoch();
+    if (SyncSensors() || CheckFirmware()) return;
+  }
+  if (!location.isPowered) network.release(&BLE);
+}
+
+/**
+ * Sends the command timings if they're due, returns false if they aren't or couldn't be sent
+ */
+bool UploadTimings() {
+  if (lastTimingsUploadTime == 0) lastTimingsUploadTime = Hal::getEpoch();
+  if (Hal::getEpoch() < lastTimingsUploadTime + TIMINGS_UPLOAD_INTERVAL) return false;
+  if (LOG_ENABLED(LOG_LEVEL_DEBUG, LOG_NETWORK)) commandTimings.print(Log::out(LOG_LEVEL_DEBUG, LOG_NETWORK));
+  UpdateTimingsChar();
+  size_t len = strlen(UPDATE_HUB_COMMAND_TIMINGS);
+  memcpy(timingsQuery, UPDATE_HUB_COMMAND_TIMINGS, len);
+  len += commandTimings.writeJson(timingsQuery + len);
+  strcpy(timingsQuery + len, "}}");
+  return network.SendRequestAsync(timingsQuery, onTimingsUploaded, nullptr, &BLE) != 0;
+}
+
+void onTrackUploaded(bool success, JsonDocument& doc, void* context) {
+  if (success && doc["data"]) {
+    LOG_INFO(LOG_GPS, "Uploaded track points: ");
+    LOG_INFOLN(LOG_GPS, trackSentLen);
+    track.remove(trackSentLen);
+    if (UploadTimings() || SyncSensors() || CheckFirmware()) return;
   } else {
-    Serial.println("error parsing doc");
+    // They stay in the track for the next attempt
+    track.uploadFailed(Hal::getEpoch());
+  }
+  if (!location.isPowered) network.release(&BLE);
+}
+
+/**
+ * Sends the oldest points of the track as one mutation, returns false if there are none or it couldn't be sent
+ */
+bool UploadTrack() {
+  if (!track.length()) return false;
+  track.simplify(TRACK_TOLERANCE);
+  size_t len = strlen(CREATE_LOCATION_TRACK);
+  memcpy(trackQuery, CREATE_LOCATION_TRACK, len);
+  len += track.writeJson(trackQuery + len, TRACK_JSON_SIZE, Hal::getEpoch(), trackSentLen);
+  strcpy(trackQuery + len, "}}");
+  return network.SendRequestAsync(trackQuery, onTrackUploaded, nullptr, &BLE) != 0;
+}
+
+/**
+ * Lets the module back down to standby once the upload queue is sent, unless GPS is still using it
+ * The track, timings, the sensor sync and the firmware check go out first if they're due since the module is already awake
+ */
+void onUploadsFlushed(bool success) {
+  if (success && (UploadTrack() || UploadTimings() || SyncSensors() || CheckFirmware())) return;
+  if (!location.isPowered) network.release(&BLE);
+}
+
+void onEventCreated(JsonVariant result) {
+  const uint16_t id = (const uint16_t)(result["id"]);
+  LOG_INFO(LOG_NETWORK, "created event id is: ");
+  LOG_INFOLN(LOG_NETWORK, id);
+}
+
+/**
+ * Uploads an event for each press a known sensor counted since it was last seen, read from its manufacturer data
+ * Returns false if it doesn't advertise its state, or if its ring is due a read, so it needs a connection instead
+ */
+bool ReadSensorAdvData(BLEDevice& device, KnownSensor& sensor, const char* address) {
+  if (!device.hasManufacturerData() || device.manufacturerDataLength() < SENSOR_ADV_DATA_SIZE) return false;
+  uint8_t data[SENSOR_ADV_DATA_SIZE];
+  device.manufacturerData(data, SENSOR_ADV_DATA_SIZE);
+  uint16_t companyId = data[0] | data[1] << 8;
+  if (companyId != SENSOR_ADV_COMPANY_ID || data[2] != SENSOR_ADV_FORMAT_VERSION) return false;
+  uint16_t eventCount = data[4] | data[5] << 8;
+  LOG_DEBUG(LOG_BLE, "\nSensor force level: ");
+  LOG_DEBUG(LOG_BLE, data[3]);
+  LOG_DEBUG(LOG_BLE, " events: ");
+  LOG_DEBUG(LOG_BLE, eventCount);
+  LOG_DEBUG(LOG_BLE, " battery: ");
+  LOG_DEBUGLN(LOG_BLE, data[6]);
+
+  // Presses before the hub first saw it are unknown, only count from here
+  if (!sensor.hasEventCount) {
+    sensor.eventCount = sensor.ringEventCount = eventCount;
+    sensor.hasEventCount = true;
+    return true;
+  }
+  // A lower count means the sensor restarted, its count started over at 0
+  if (eventCount < sensor.eventCount) sensor.eventCount = sensor.ringEventCount = 0;
+  uint16_t newEvents = eventCount - sensor.eventCount;
+  if (newEvents > 0) {
+    LOG_INFO(LOG_BLE, "Sensor events: ");
+    LOG_INFOLN(LOG_BLE, newEvents);
+    // Only counted once queued, the rest are picked up again from a later advertisement or the ring
+    for (uint16_t i = 0; i < newEvents; i++) {
+      if (!uploads.add(UPLOAD_EVENT, CREATE_EVENT, onEventCreated, address)) {
+        LOG_WARNLN(LOG_BLE, "Upload queue full, the rest of the sensor events wait");
+        break;
+      }
+      sensor.eventCount++;
+    }
+    // If this fails the events stay queued and loop retries them
+    uploads.flush(network, &BLE, onUploadsFlushed);
+  }
+  // A burst the queue can't take is read from the ring in one connection, as is a ring about to drop events
+  if (newEvents > UPLOAD_QUEUE_SIZE || eventCount - sensor.ringEventCount >= SENSOR_RING_READ_EVENTS) {
+    LOG_INFOLN(LOG_BLE, "Reading the sensor's ring");
+    isReadingSensorRing = true;
+    return false;
   }
-  network.setPower(false);
+  return true;
 }
 
 void ScanForSensor() {
@@ -419,13 +748,13 @@ void ScanForSensor() {
   if (advStartTime > 0) return;
   if (lastEventTime > 0) {
     if (epochMillis() < lastEventTime + BLE_COOLDOWN) {
-      Serial.print("-");
+      LOG_DEBUG(LOG_BLE, "-");
       BLE.poll();
     } else {
       lastEventTime = 0;
       setAdvMode(false);
       Utilities::setBlePower(false);
-      Serial.println(">\nCooldown complete");
+      LOG_DEBUGLN(LOG_BLE, ">\nCooldown complete");
     }
     return;
   }
@@ -436,9 +765,9 @@ void ScanForSensor() {
     lastScanTime = epochMillis();
     isScanning = true;
     Utilities::analogWriteRGB(255, 0, 0, false);
-    Serial.print("Hub scanning for peripheral...");
+    LOG_DEBUG(LOG_BLE, "Hub scanning for peripheral...");
   } else if (!phone && isScanning && epochMillis() > lastScanTime + BLE_SCAN_DURATION) {
-    Serial.println("😴💤");
+    LOG_DEBUGLN(LOG_BLE, "😴💤");
     BLE.stopScan();
     Utilities::setBlePower(false);
     Utilities::analogWriteRGB(0, 0, 0, false);
@@ -448,59 +777,56 @@ void ScanForSensor() {
 
   BLEDevice scannedDevice = BLE.available();
   if (scannedDevice.hasLocalName()) {
-    Serial.print("Scanned: (localName) ");
-    Serial.println(scannedDevice.localName());
+    LOG_DEBUG(LOG_BLE, "Scanned: (localName) ");
+    LOG_DEBUGLN(LOG_BLE, scannedDevice.localName());
   } else if (scannedDevice.deviceName().length() > 0) {
-    Serial.print("Scanned: (deviceName) ");
-    Serial.println(scannedDevice.deviceName());
+    LOG_DEBUG(LOG_BLE, "Scanned: (deviceName) ");
+    LOG_DEBUGLN(LOG_BLE, scannedDevice.deviceName());
   } else {
-    Serial.print(".");
+    LOG_DEBUG(LOG_BLE, ".");
   }
   bool isPeripheral = scannedDevice.deviceName() == PERIPHERAL_NAME || scannedDevice.localName() == PERIPHERAL_NAME;
   if (!isPeripheral) return;
-  Serial.print("\nFound possible sensor: ");
-  Serial.println(scannedDevice.address());
-
-  bool isKnownSensor = false;
-  for (uint8_t i = 0; i < knownSensorAddrsLen; i++) {
-    Serial.print("Checking for a match with: ");
-    Serial.println(knownSensorAddrs[i]);
-    if (scannedDevice.address() == knownSensorAddrs[i]) {
-      isKnownSensor = true;
-      break;
-    }
-  }
+  String address = scannedDevice.address();
+  LOG_INFO(LOG_BLE, "\nFound possible sensor: ");
+  LOG_INFOLN(LOG_BLE, address);
+
+  KnownSensor* knownSensor = knownSensors.find(address.c_str());
+  bool isKnownSensor = knownSensor != nullptr;
   // if we're not adding new sensors and it's unknown
   if (!isAddingNewSensor && !isKnownSensor) {
-    Serial.println("Sensor not paired to this hub");
+    LOG_INFOLN(LOG_BLE, "Sensor not paired to this hub");
     return;
   }
   // if we're adding new sensors and it's already added
   if (isAddingNewSensor && isKnownSensor) {
-    Serial.println("Sensor already added to this hub");
+    LOG_INFOLN(LOG_BLE, "Sensor already added to this hub");
     return;
   }
+  // Paired sensors are read straight from their advertising and scanning carries on for the others
+  // connecting is left for pairing, reading a sensor's ring, and sensors that don't advertise their state
+  if (!isAddingNewSensor && ReadSensorAdvData(scannedDevice, *knownSensor, address.c_str())) return;
 
   // We found a Sensor!
   peripheral = new BLEDevice();
   *peripheral = scannedDevice;
   Utilities::analogWriteRGB(255, 30, 0);
-  Serial.println("\nPERIPHERAL FOUND");
-  Serial.print("Address found: ");
-  Serial.println(peripheral->address());
-  Serial.print("Local Name: ");
-  Serial.println(peripheral->localName());
-  Serial.print("Device Name: ");
-  Serial.println(peripheral->deviceName());
-  Serial.print("Advertised Service UUID: ");
-  Serial.println(peripheral->advertisedServiceUuid());
-  Serial.print("Advertised Service UUID Count: ");
-  Serial.println(peripheral->advertisedServiceUuidCount());
+  LOG_INFOLN(LOG_BLE, "\nPERIPHERAL FOUND");
+  LOG_INFO(LOG_BLE, "Address found: ");
+  LOG_INFOLN(LOG_BLE, peripheral->address());
+  LOG_INFO(LOG_BLE, "Local Name: ");
+  LOG_INFOLN(LOG_BLE, peripheral->localName());
+  LOG_INFO(LOG_BLE, "Device Name: ");
+  LOG_INFOLN(LOG_BLE, peripheral->deviceName());
+  LOG_INFO(LOG_BLE, "Advertised Service UUID: ");
+  LOG_INFOLN(LOG_BLE, peripheral->advertisedServiceUuid());
+  LOG_INFO(LOG_BLE, "Advertised Service UUID Count: ");
+  LOG_INFOLN(LOG_BLE, peripheral->advertisedServiceUuidCount());
   BLE.stopScan();
   isScanning = false;
 
   if (isAddingNewSensor) {
-    Serial.print("Waiting for command to connect~~~");
+    LOG_INFO(LOG_BLE, "Waiting for command to connect~~~");
     String sensorFound = "SensorFound:";
     sensorFound.concat(peripheral->address());
     commandChar.writeValue(sensorFound);
@@ -513,32 +839,33 @@ void ConnectToFoundSensor() {
   if (isAddingNewSensor && strcmp(currentCommand.type, COMMAND_SENSOR_CONNECT) != 0) {
     // TODO handle the form timing out at this location better
     BLE.poll();
-    Serial.print("~");
+    LOG_DEBUG(LOG_BLE, "~");
     return;
   }
   if (!peripheral->connect()) {
     Utilities::analogWriteRGB(255, 0, 0);
-    Serial.println("\nFailed to connect, resetting....");
+    LOG_WARNLN(LOG_BLE, "\nFailed to connect, resetting....");
     delete peripheral;
     peripheral = nullptr;
+    isReadingSensorRing = false;
     Utilities::bleDelay(1000, &BLE);
     return;
   }
 
   // We're connected to sensor!
   Utilities::analogWriteRGB(255, 100, 200);
-  Serial.println("\nPeripheral connected!");
-  Serial.println(peripheral->discoverService(SENSOR_SERVICE_UUID));
+  LOG_INFOLN(LOG_BLE, "\nPeripheral connected!");
+  LOG_DEBUGLN(LOG_BLE, peripheral->discoverService(SENSOR_SERVICE_UUID));
   // FIXME discoverAttributes should work quickly
   // Serial.println(peripheral->discoverAttributes());
-  Serial.print("Service count: ");
-  Serial.println(peripheral->serviceCount());
-  Serial.print("Appearance: ");
-  Serial.println(peripheral->appearance());
-  Serial.print("Has force service: ");
-  Serial.println(peripheral->hasService(SENSOR_SERVICE_UUID));
-  Serial.print("Has volts: ");
-  Serial.println(peripheral->hasCharacteristic(VOLT_CHARACTERISTIC_UUID));
+  LOG_DEBUG(LOG_BLE, "Service count: ");
+  LOG_DEBUGLN(LOG_BLE, peripheral->serviceCount());
+  LOG_DEBUG(LOG_BLE, "Appearance: ");
+  LOG_DEBUGLN(LOG_BLE, peripheral->appearance());
+  LOG_DEBUG(LOG_BLE, "Has force service: ");
+  LOG_DEBUGLN(LOG_BLE, peripheral->hasService(SENSOR_SERVICE_UUID));
+  LOG_DEBUG(LOG_BLE, "Has volts: ");
+  LOG_DEBUGLN(LOG_BLE, peripheral->hasCharacteristic(VOLT_CHARACTERISTIC_UUID));
 
   if (!isAddingNewSensor) return;
 
@@ -547,220 +874,337 @@ void ConnectToFoundSensor() {
     return;
   }
 
-  const char* sensorSerial = peripheral->address().c_str();
-  char mutationStr[155 + strlen(sensorSerial)]{};
-  sprintf(mutationStr, "{\"query\":\"mutation createSensor{createSensor(doorColumn: 0, doorRow: 0, isOpen: false, isConnected: true, serial:\\\"%s\\\"){id}}\",\"variables\":{}}", sensorSerial);
-  DynamicJsonDocument doc = network.SendRequest(mutationStr, &BLE);
+  char mutationStr[CREATE_SENSOR.maxLength() + 1]{};
+  CREATE_SENSOR.write(mutationStr, peripheral->address().c_str());
+  ResponseFilter createSensorFilter;
+  createSensorFilter["data"]["createSensor"]["id"] = true;
+  DynamicJsonDocument doc = network.SendRequest(mutationStr, &BLE, &createSensorFilter, 256);
   if (doc["data"] && doc["data"]["createSensor"]) {
     const uint16_t id = (const uint16_t)(doc["data"]["createSensor"]["id"]);
-    Serial.print("createSensor id: ");
-    Serial.println(id);
-    Serial.print("Adding to knownSensorAddrs: ");
-    Serial.println(peripheral->address());
-    knownSensorAddrs[knownSensorAddrsLen] = peripheral->address();
-    knownSensorAddrsLen++;
+    LOG_INFO(LOG_NETWORK, "createSensor id: ");
+    LOG_INFOLN(LOG_NETWORK, id);
+    LOG_INFO(LOG_NETWORK, "Adding to known sensors: ");
+    LOG_INFOLN(LOG_NETWORK, peripheral->address());
+    if (knownSensors.add(peripheral->address().c_str())) {
+      knownSensors.save();
+    } else {
+      LOG_WARNLN(LOG_NETWORK, "Known sensors full, it won't be monitored");
+    }
     if (peripheral) peripheral->disconnect();
     if (phone) {
       commandChar.writeValue("SensorAdded:1");
       Utilities::bleDelay(2000, &BLE);
     }
-    Serial.print("Cooling down to prevent peripheral reconnection---");
+    LOG_INFO(LOG_BLE, "Cooling down to prevent peripheral reconnection---");
     lastEventTime = epochMillis();
     lastScanTime = lastEventTime + BLE_COOLDOWN;
   } else {
-    Serial.println("doc not valid");
+    LOG_WARNLN(LOG_BLE, "doc not valid");
   }
 
   setAdvMode(false);
-  network.setPower(false);
+  network.release(&BLE);
   memset(currentCommand.type, 0, sizeof currentCommand.type);
   memset(currentCommand.value, 0, sizeof currentCommand.value);
 }
 
-void MonitorSensor() {
-  BLEService forceService = peripheral->service(SENSOR_SERVICE_UUID);
-  bool hasVolts = forceService.hasCharacteristic(VOLT_CHARACTERISTIC_UUID);
-  Serial.print("Has volts: ");
-  Serial.println(hasVolts);
-  // if(!hasVolts) return;
-  BLECharacteristic volts = forceService.characteristic(VOLT_CHARACTERISTIC_UUID);
-  Serial.print("Characteristic value length: ");
-  Serial.println(volts.valueLength());
-  Serial.print("Characteristic descriptor: ");
-  Serial.println(volts.descriptor(0));
-  Serial.print("Can read: ");
-  Serial.println(volts.canRead());
-  Serial.print("Can subscribe: ");
-  Serial.println(volts.canSubscribe());
-
-  // if(volts.canRead()) {
-    // int32_t voltage = 0;
-    // volts.readValue(voltage);
-    // Serial.print("Volts value: ");
-    // Serial.println(voltage);
-  if (!network.setPowerOnAndWaitForReg(&BLE)) {
-    peripheral->disconnect();
-    network.setPower(false);
-    return;
+/**
+ * Reads the sensor's unacknowledged events in one go, uploads one for each touch or open from idle,
+ * then acknowledges them so the sensor drops them
+ * Presses are counted like the sensor counts them, so ones already uploaded from its advertising are only acknowledged
+ * Events that don't fit in the upload queue are left on the sensor for the next read
+ */
+void ReadSensorEvents() {
+  hasMoreSensorEvents = false;
+  uint8_t value[FORCE_EVENTS_VALUE_SIZE];
+  int len = sensorEvents.readValue(value, sizeof value);
+  if (len < (int)sizeof(ForceEventsHeader)) return;
+  ForceEventsHeader header;
+  memcpy(&header, value, sizeof header);
+  // Only whole events, the read may have been cut short by the MTU
+  uint8_t count = min((size_t)header.count, (len - sizeof header) / sizeof(ForceEvent));
+  if (count < header.count) hasMoreSensorEvents = true;
+
+  String address = peripheral->address();
+  KnownSensor* sensor = knownSensors.find(address.c_str());
+  bool hasEventCount = sensor && sensor->hasEventCount;
+  bool isAcked = false;
+  bool isQueued = false;
+  bool isFull = false;
+  // Presses that were dropped from a full ring before they were read, uploaded without their event
+  while (hasEventCount && (int16_t)(header.firstEventCount - sensor->eventCount) > 0) {
+    if (!uploads.add(UPLOAD_EVENT, CREATE_EVENT, onEventCreated, address.c_str())) {
+      isFull = true;
+      break;
+    }
+    sensor->eventCount++;
+    isQueued = true;
   }
-  BLE.poll();
-  const char* address = peripheral->address().c_str();
-  char createEvent[100 + strlen(address)]{};
-  sprintf(createEvent, "{\"query\":\"mutation CreateEvent{createEvent(serial:\\\"%s\\\"){ id }}\",\"variables\":{}}\n", address);
-  DynamicJsonDocument doc = network.SendRequest(createEvent, &BLE);
-  if (doc["data"] && doc["data"]["createEvent"]) {
-    const uint16_t id = (const uint16_t)(doc["data"]["createEvent"]["id"]);
-    Serial.print("created event id is: ");
-    Serial.println(id);
-    // lastReadVoltage = voltage;
-  } else {
-    Serial.println("error parsing doc");
-  }
-  network.setPower(false);
-  peripheral->disconnect();
-  setAdvMode(true);
-  Serial.print("Cooling down to prevent peripheral reconnection---");
-  lastEventTime = epochMillis();
-  lastScanTime = lastEventTime + BLE_COOLDOWN;
-  // } 
-  // else {
-  //   Serial.println("Unable to read volts");
-  // }
+  uint16_t eventCount = header.firstEventCount;
+  for (uint8_t i = 0; i < count && !isFull; i++) {
+    ForceEvent event;
+    memcpy(&event, value + sizeof header + i * sizeof event, sizeof event);
+    bool isPress = event.previousLevel == FORCE_IDLE;
+    if (isPress) eventCount++;
+    // Handled already, the sensor hadn't seen the last acknowledgement yet
+    if (hasSensorEventSeq && (int16_t)(event.seq - lastSensorEventSeq) <= 0) continue;
+    LOG_DEBUG(LOG_BLE, "Sensor event level: ");
+    LOG_DEBUG(LOG_BLE, event.level);
+    LOG_DEBUG(LOG_BLE, " ms ago: ");
+    LOG_DEBUGLN(LOG_BLE, header.time - event.time);
+    if (isPress && (!hasEventCount || (int16_t)(eventCount - sensor->eventCount) > 0)) {
+      if (!uploads.add(UPLOAD_EVENT, CREATE_EVENT, onEventCreated, address.c_str())) {
+        isFull = true;
+        break;
+      }
+      if (sensor) sensor->eventCount = eventCount;
+      isQueued = true;
+    }
+    lastSensorEventSeq = event.seq;
+    hasSensorEventSeq = true;
+    isAcked = true;
+  }
+  if (isFull) hasMoreSensorEvents = true;
+  if (isAcked) sensorEventsAck.writeValue((const uint8_t*)&lastSensorEventSeq, sizeof lastSensorEventSeq);
+  if (sensor && !hasMoreSensorEvents) sensor->ringEventCount = sensor->eventCount;
+  // Events go out right away, along with anything else waiting for a radio wake
+  // If this fails they stay queued and loop retries them
+  if (isQueued) uploads.flush(network, &BLE, onUploadsFlushed);
 }
 
-void FirmwareUpdate() {
-  unsigned long fileLength = strtoul(currentCommand.value, NULL, 10);
-  if (fileLength == 0) {
-    Serial.println("Phone didn't provide fileLength with command. Can't continue with update.");
+/**
+ * Subscribes to the connected sensor's volts once, then reads its events whenever it indicates a level change
+ */
+void MonitorSensor() {
+  if (!sensorVolts) {
+    BLECharacteristic volts = peripheral->characteristic(VOLT_CHARACTERISTIC_UUID);
+    sensorEvents = peripheral->characteristic(EVENTS_CHARACTERISTIC_UUID);
+    sensorEventsAck = peripheral->characteristic(EVENTS_ACK_CHARACTERISTIC_UUID);
+    if (!sensorEvents || !sensorEventsAck || !volts || !volts.canSubscribe() || !volts.subscribe()) {
+      LOG_WARNLN(LOG_BLE, "Couldn't subscribe to volts, disconnecting");
+      peripheral->disconnect();
+      return;
+    }
+    LOG_INFOLN(LOG_BLE, "Subscribed to volts");
+    sensorVolts = volts;
+    hasSensorEventSeq = false;
+    // Whatever happened while disconnected
+    ReadSensorEvents();
     return;
   }
-  Serial.print("Phone returned update file of size ");
-  Serial.print(fileLength);
-  Serial.println(" bytes");
+  if (sensorVolts.valueUpdated() || (hasMoreSensorEvents && !uploads.isFlushing())) ReadSensorEvents();
+  // It goes back to advertising its state once the ring is read
+  if (isReadingSensorRing && !hasMoreSensorEvents) peripheral->disconnect();
+}
 
-  if (!InternalStorage.open(fileLength)) {
-    Serial.println("There is not enough space to store the update. Can't continue with update.");
+/**
+ * Receives the update the phone asked to send with StartHubUpdate:<length>,<chunk size>,<CRC32 in hex>
+ * or a patch against the running image with StartHubPatch:<patch length>,<chunk size>,<CRC32 in hex>,<length>
+ * where the CRC32 and length are of the image the patch produces, see PatchDecoder for the format
+ * Replies HubUpdateReady:<offset>,<chunk size> with the offset to start from, which is past 0 when resuming
+ * The image is only applied if its CRC32 matches, otherwise it replies HubUpdateFailed:crc
+ * A patch that doesn't apply to the running image replies HubUpdateFailed:patch, the phone sends the full image instead
+ */
+void FirmwareUpdate(bool isPatch) {
+  char* chunkStr = nullptr;
+  char* crcStr = nullptr;
+  char* imageStr = nullptr;
+  unsigned long fileLength = strtoul(currentCommand.value, &chunkStr, 10);
+  uint16_t chunkSize = *chunkStr == ',' ? strtoul(chunkStr + 1, &crcStr, 10) : 0;
+  chunkSize = constrain(chunkSize, 1, OTA_MAX_CHUNK);
+  bool hasCrc = crcStr && *crcStr == ',';
+  uint32_t expectedCrc = hasCrc ? strtoul(crcStr + 1, &imageStr, 16) : 0;
+  unsigned long imageLength = fileLength;
+  if (isPatch) imageLength = imageStr && *imageStr == ',' ? strtoul(imageStr + 1, NULL, 10) : 0;
+  // Handled once, the phone sends it again to resume
+  memset(currentCommand.type, 0, sizeof currentCommand.type);
+  memset(currentCommand.value, 0, sizeof currentCommand.value);
+  if (fileLength == 0 || imageLength == 0 || !hasCrc) {
+    LOG_WARNLN(LOG_OTA, "Phone didn't provide fileLength and CRC with command. Can't continue with update.");
     return;
   }
-
-  uint8_t buff[CHUNK_SIZE];
-  uint16_t chunkLen = 0;
-  uint8_t emptyByteArr[1] = { 0x00 };
-  while (fileLength > 0 && phone && phone->connected()) {
-    BLE.available();
-    chunkLen = transferChar.valueLength();
-    if (chunkLen < min(CHUNK_SIZE, fileLength)) {
-      continue;
+  LOG_INFO(LOG_OTA, isPatch ? "Phone returned patch file of size " : "Phone returned update file of size ");
+  LOG_INFO(LOG_OTA, fileLength);
+  LOG_INFOLN(LOG_OTA, " bytes");
+
+  if (!ota.canResume(fileLength) || otaWriter.getExpectedCrc() != expectedCrc || isPatching != isPatch) {
+    if (ota.isActive()) otaWriter.abort();
+    ota.end();
+    // Its storage is about to be erased
+    firmwareDownload.forget();
+    if (!otaWriter.open(imageLength, expectedCrc)) {
+      LOG_WARNLN(LOG_OTA, "There is not enough space to store the update. Can't continue with update.");
+      return;
     }
-    transferChar.readValue(buff, chunkLen);
-    Serial.print("\nValue length is ");
-    Serial.print(chunkLen);
-    Serial.print(" and content size is ");
-    Serial.print(sizeof(buff));
-    Serial.print(" and Free Memory is: ");
-    Serial.println(Utilities::freeMemory());
-    transferChar.writeValue(emptyByteArr, 1, true);
-    BLE.available();
-
-
-    for (uint8_t i = 0; i < chunkLen; i++) {
-      InternalStorage.write(buff[i]);
-      fileLength--;
+    isPatching = isPatch;
+    if (isPatch) {
+      // Storage rows are written as the hub runs, so the patch can only use the image before them
+      uint32_t maxOldSize = InternalStorage.maxSize();
+      if (Hal::firstStorageRow()) maxOldSize = min(maxOldSize, (uint32_t)((uintptr_t)Hal::firstStorageRow() - SKETCH_START));
+      patcher.begin(imageLength, maxOldSize);
     }
-    Serial.print("Bytes left to write: ");
-    Serial.println(fileLength);
-  }
-  InternalStorage.close();
-  if (fileLength > 0) {
-    Serial.print("Timeout downloading update file at ");
-    Serial.print(fileLength);
-    Serial.println(" bytes. Can't continue with update.");
+  }
+  // Resuming with the same length and CRC leaves storage open at the bytes already written
+  uint32_t offset = ota.start(fileLength, chunkSize, writeToStorage);
+  char readyCommand[30];
+  sprintf(readyCommand, "HubUpdateReady:%lu,%u", (unsigned long)offset, chunkSize);
+  LOG_INFO(LOG_OTA, "Writing ");
+  LOG_INFOLN(LOG_OTA, readyCommand);
+  commandChar.writeValue(readyCommand);
+
+  uint8_t ack[OTA_ACK_SIZE];
+  while (!ota.isComplete() && phone && phone->connected()) {
+    // Chunks are handled by onTransferWritten as they're polled
+    BLE.poll();
+    // Flash is written here between polls, chunks that didn't fit meanwhile are taken once a row is out
+    if (otaWriter.commit()) {
+      // A COPY can produce far more than the chunk it came in, it carries on here
+      if (isPatching) patcher.pump();
+      ota.drain();
+    }
+    if (isPatching && patcher.isFailed()) break;
+    if (ota.isAckDue(millis())) {
+      ota.writeAck(ack, millis());
+      transferChar.writeValue(ack, sizeof ack);
+    }
+  }
+  if (!ota.isComplete() && !(isPatching && patcher.isFailed())) {
+    LOG_WARN(LOG_OTA, "Update interrupted at ");
+    LOG_WARN(LOG_OTA, ota.getWritten());
+    LOG_WARNLN(LOG_OTA, " bytes, it resumes from there if the phone starts it again.");
+    return;
+  }
+  // The last chunks' ack
+  if (ota.isAckDue(millis())) {
+    ota.writeAck(ack, millis());
+    transferChar.writeValue(ack, sizeof ack);
+  }
+  ota.end();
+  // What's left of the last chunk
+  while (isPatching && !patcher.isIdle()) {
+    otaWriter.commit();
+    patcher.pump();
+  }
+  if (isPatching && !patcher.isDone()) {
+    LOG_ERRORLN(LOG_OTA, "Patch doesn't apply to the running image, not applying it.");
+    otaWriter.abort();
+    commandChar.writeValue("HubUpdateFailed:patch");
+    return;
+  }
+  if (!otaWriter.close()) {
+    LOG_ERROR(LOG_OTA, "Update CRC ");
+    LOG_ERROR(LOG_OTA, otaWriter.getCrc(), HEX);
+    LOG_ERRORLN(LOG_OTA, " doesn't match, not applying it.");
+    commandChar.writeValue("HubUpdateFailed:crc");
     return;
   }
 
   String hubCommand = "HubUpdateEnd:";
   hubCommand.concat(VERSION + 1);
-  Serial.print("Writing ");
-  Serial.println(hubCommand);
+  LOG_INFO(LOG_OTA, "Writing ");
+  LOG_INFOLN(LOG_OTA, hubCommand);
   commandChar.writeValue(hubCommand);
   BLE.poll();
   delay(10);
   BLE.poll();
-  Serial.println("Stalling...");
+  LOG_INFOLN(LOG_OTA, "Stalling...");
 
   Utilities::bleDelay(2000, &BLE);
 
-  Serial.println("Sketch update apply and reset.");
+  LOG_INFOLN(LOG_OTA, "Sketch update apply and reset.");
   Serial.flush();
   InternalStorage.apply(); // this doesn't return
 }
 
+/**
+ * Powers off GPS, and sends the upload queue or the track if either is due since the module is already awake
+ * While moving that's not every check, fixes wait in the track to go out together
+ */
+void EndGPSUpdate() {
+  location.setGPSPower(false);
+  if (uploads.isFlushDue() && uploads.flush(network, &BLE, onUploadsFlushed)) return;
+  if (track.isUploadDue(Hal::getEpoch()) && UploadTrack()) return;
+  network.release(&BLE);
+}
+
 void UpdateGPS() {
   if (!network.tokenData.isValid) return;
-  if (epochMillis() < location.lastGPSTime + GPS_UPDATE_INTERVAL) return;
-  if (epochMillis() < location.lastGPSTime + GPS_UPDATE_INTERVAL + GPS_BUFFER_TIME) {
-    if (!location.isPowered) {
-      network.setPower(true);
-      network.waitForPowerOn();
+  // GPS shares the module with the request in flight
+  if (network.isRequestActive()) return;
+  if (!location.isPowered) {
+    if (epochMillis() < location.lastGPSTime + location.gpsInterval) return;
+    // GPS works in airplane mode, so the radio can stay off until there's something to send
+    if (network.getPowerState() > MODEM_BOOTING) {
+      if (network.wake(nullptr, false)) location.setGPSPower(true);
+    } else if (network.pollBooted()) {
+      // Checked again every loop until the module is done booting, AT+CGNSPWR before SMS Ready is lost
       location.setGPSPower(true);
     }
+    if (location.isPowered) location.warmupStartTime = location.lastPollTime = epochMillis();
     return;
   }
-  location.lastGPSTime = epochMillis();
-  Serial1.println("AT+CGNSINF");
-  Serial1.flush();
+  if (epochMillis() < location.lastPollTime + GPS_POLL_INTERVAL) return;
+  location.lastPollTime = epochMillis();
+  Hal::modem().println("AT+CGNSINF");
+  Hal::modem().flush();
 
   char infBuffer[200]{};
   memset(infBuffer, 0, 200);
-  bool didRead = Utilities::readUntilResp("AT+CGNSINF\r\r\n+CGNSINF: ", infBuffer);
+  unsigned long startTime = millis();
+  bool didRead = Utilities::readUntilResp("+CGNSINF: ", infBuffer, sizeof infBuffer);
+  if (didRead) commandTimings.add("AT+CGNSINF", millis() - startTime);
+  else commandTimings.addTimeout("AT+CGNSINF");
+
+  LocReading reading;
+  if (didRead) {
+    LOG_DEBUG(LOG_GPS, "\nBuffer: ");
+    LOG_DEBUGLN(LOG_GPS, infBuffer);
+    reading = location.parseInf(infBuffer);
+  }
+  // Polled until there's a precise enough fix, or the warm-up runs out and whatever it has is used
+  bool isWarmupOver = epochMillis() >= location.warmupStartTime + GPS_BUFFER_TIME;
+  if (didRead && !isWarmupOver && !Location::isGoodFix(reading)) return;
+
+  location.lastGPSTime = epochMillis();
+  location.schedule(reading);
   if (!didRead) {
-    location.setGPSPower(false);
-    network.setPower(false);
+    EndGPSUpdate();
     return;
   }
-
-  Serial.print("\nBuffer: ");
-  Serial.println(infBuffer);
-  LocReading reading = location.parseInf(infBuffer);
-  Serial.println("\n\r*****Updating GPS location*****");
+  LOG_INFOLN(LOG_GPS, "\n\r*****Updating GPS location*****");
   if (!reading.hasFix) {
-    Serial.println("No GPS fix yet, aborting");
-    location.setGPSPower(false);
-    network.setPower(false);
+    LOG_WARNLN(LOG_GPS, "No GPS fix yet, aborting");
+    EndGPSUpdate();
     return;
   }
+  LOG_INFO(LOG_GPS, "Warm-up time(ms): ");
+  LOG_INFOLN(LOG_GPS, epochMillis() - location.warmupStartTime);
   location.printLocReading(reading);
 
-  double dist = location.distanceFromLastPoint(reading.lat, reading.lng);
-  if (dist < 20) {
-    Serial.print("New location is less than 20m away from previously sent location, aborting.\nDistance(m): ");
-    Serial.println(dist);
-    location.setGPSPower(false);
-    network.setPower(false);
+  if (!location.isNewLocation(reading)) {
+    LOG_INFO(LOG_GPS, "New location is within its error or 20m of the last tracked location, aborting.\nDistance(m): ");
+    LOG_INFOLN(LOG_GPS, location.distanceFromLastPoint(reading.lat, reading.lng));
+    EndGPSUpdate();
     return;
   }
 
-  char createLocation[200]{};
-  sprintf(createLocation, "{\"query\":\"mutation CreateLocation{createLocation(lat:%.5f, lng: %.5f, hdop: %.2f, speed: %.2f, course: %.2f, age: 0){ id }}\",\"variables\":{}}", reading.lat, reading.lng, reading.hdop, reading.kmph, reading.deg);
-  DynamicJsonDocument doc = network.SendRequest(createLocation, &BLE);
-  if (doc["data"] && doc["data"]["createLocation"]) {
-    const uint16_t id = (const uint16_t)(doc["data"]["createLocation"]["id"]);
-    Serial.print("created location id is: ");
-    Serial.println(id);
-    location.lastSentReading = reading;
-  } else {
-    Serial.println("error parsing doc");
-  }
-  location.setGPSPower(false);
-  network.setPower(false);
+  track.add(reading, Hal::getEpoch());
+  location.lastTrackedReading = reading;
+  EndGPSUpdate();
 }
 
-void loop() {
-
+/**
+ * One pass of the state machine, everything loop() does apart from idling
+ */
+void StepLoop() {
   CheckInput();
 
+  network.tick();
+
   if (strcmp(currentCommand.type, "StartHubUpdate") == 0) {
-    FirmwareUpdate();
+    FirmwareUpdate(false);
+  } else if (strcmp(currentCommand.type, "StartHubPatch") == 0) {
+    FirmwareUpdate(true);
   }
 
   // Hub has entered pairing mode
@@ -779,23 +1223,38 @@ void loop() {
     MonitorSensor();
   }
 
-  // Update GPS
-  if (!phone && !peripheral && advStartTime == 0) {
+  // Update GPS, a subscribed sensor only needs BLE polled to get its indications
+  if (!phone && (!peripheral || sensorVolts) && advStartTime == 0) {
     UpdateGPS();
     if (lastBatteryUpdateTime == 0 || epochMillis() > lastBatteryUpdateTime + BATT_UPDATE_INTERVAL) {
       UpdateBatteryLevel();
     }
+    // Anything that couldn't wait for the next GPS wake, ie events that failed to send
+    if (!location.isPowered && !network.isRequestActive() && uploads.isFlushDue()) {
+      uploads.flush(network, &BLE, onUploadsFlushed);
+    }
+    // Steps the module down from sleep to airplane to off the longer it goes unused
+    if (!location.isPowered) network.updatePowerState(&BLE);
+  }
+}
+
+void loop() {
+#ifdef HUB_BENCHMARK
+  if (!isLoopBenchmarked) {
+    Benchmark::report("loop() without idling", Benchmark::measure(StepLoop, LOOP_BENCHMARK_PASSES));
+    isLoopBenchmarked = true;
   }
+#endif
+  StepLoop();
 
-  if (isScanning || advStartTime > 0 || pairButtonHoldStartTime || phone || peripheral) {
+  // GPS is polled while warming up so a fix ends it early, standby would sleep through it
+  if (isScanning || advStartTime > 0 || pairButtonHoldStartTime || phone || peripheral || network.isRequestActive() || location.isPowered) {
     if (Serial) Utilities::idle(20);
     else Utilities::idle(5);
   } else {
     if (Serial) Utilities::idle(200);
     else {
-      rtc.setAlarmEpoch(rtc.getEpoch() + 10);
-      rtc.enableAlarm(rtc.MATCH_SS);
-      rtc.standbyMode();
+      Hal::standby(10);
     }
   }
 }
@@ -0,0 +1,58 @@
+#ifndef HUB_HISTOGRAM_H
+#define HUB_HISTOGRAM_H
+
+#include <Arduino.h>
+
+/**
+ * Counts of durations (in ms) falling under each of N upper bounds, plus one for anything longer
+ * Bounds must be ascending and outlive the histogram, counts stop at UINT16_MAX instead of wrapping
+ */
+template<uint8_t N>
+class Histogram {
+private:
+  const uint16_t* bounds;
+  uint16_t counts[N + 1]{};
+
+public:
+  Histogram(const uint16_t (&bounds)[N]) : bounds(bounds) {}
+
+  void add(uint32_t value) {
+    uint8_t idx = 0;
+    while (idx < N && value >= bounds[idx]) idx++;
+    if (counts[idx] < UINT16_MAX) counts[idx]++;
+  }
+
+  /**
+   * Count for bucket idx, the last bucket (N) is everything at or above the highest bound
+   */
+  uint16_t count(uint8_t idx) const { return counts[idx]; }
+
+  uint16_t bound(uint8_t idx) const { return bounds[idx]; }
+
+  uint32_t total() const {
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i <= N; i++) sum += counts[i];
+    return sum;
+  }
+
+  void clear() { memset(counts, 0, sizeof counts); }
+
+  /**
+   * ie name <1000:3 <2000:1 >=2000:0
+   */
+  void print(Print& out, const char* name) const {
+    out.print(name);
+    for (uint8_t i = 0; i < N; i++) {
+      out.print(" <");
+      out.print(bounds[i]);
+      out.print(":");
+      out.print(counts[i]);
+    }
+    out.print(" >=");
+    out.print(bounds[N - 1]);
+    out.print(":");
+    out.println(counts[N]);
+  }
+};
+
+#endif
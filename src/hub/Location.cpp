@@ -1,5 +1,7 @@
 #include <./hub/Location.h>
 #include <./hub/Utilities.h>
+#include <./hub/Hal.h>
+#include <./hub/Log.h>
 #include <Arduino.h>
 
 double Location::getRadians(double degrees) {
@@ -7,16 +9,16 @@ double Location::getRadians(double degrees) {
 }
 
 void Location::printLocReading(LocReading reading) {
-  Serial.print("Latitude: ");
-  Serial.print(reading.lat, 5);
-  Serial.print(", Longitude: ");
-  Serial.print(reading.lng, 5);
-  Serial.print(", HDOP(m): ");
-  Serial.print(reading.hdop);
-  Serial.print(", Speed(kmph): ");
-  Serial.print(reading.kmph);
-  Serial.print(", Course(deg): ");
-  Serial.println(reading.deg);
+  LOG_INFO(LOG_GPS, "Latitude: ");
+  LOG_INFO(LOG_GPS, reading.lat, 5);
+  LOG_INFO(LOG_GPS, ", Longitude: ");
+  LOG_INFO(LOG_GPS, reading.lng, 5);
+  LOG_INFO(LOG_GPS, ", HDOP(m): ");
+  LOG_INFO(LOG_GPS, reading.hdop);
+  LOG_INFO(LOG_GPS, ", Speed(kmph): ");
+  LOG_INFO(LOG_GPS, reading.kmph);
+  LOG_INFO(LOG_GPS, ", Course(deg): ");
+  LOG_INFOLN(LOG_GPS, reading.deg);
 }
 
 double Location::distance(double lat1, double lng1, double lat2, double lng2) {
@@ -34,6 +36,35 @@ double Location::distance(double lat1, double lng1, double lat2, double lng2) {
   return dist *= 6371.0 * 1000.0;
 }
 
+void Location::schedule(const LocReading& reading) {
+  bool isMoving = false;
+  bool isTurning = false;
+  if (reading.hasFix && lastReading.hasFix) {
+    double moved = distance(lastReading.lat, lastReading.lng, reading.lat, reading.lng);
+    isMoving = moved > GPS_HDOP_METERS * (lastReading.hdop + reading.hdop);
+    double turned = fabs(reading.deg - lastReading.deg);
+    if (turned > 180) turned = 360 - turned;
+    // Course is only meaningful at speed
+    isTurning = lastReading.kmph >= GPS_MOVING_KMPH && reading.kmph >= GPS_MOVING_KMPH && turned >= GPS_TURN_DEGREES;
+  }
+  if (reading.hasFix && reading.kmph >= GPS_MOVING_KMPH) isMoving = true;
+
+  if (isTurning) {
+    gpsInterval = GPS_MIN_INTERVAL;
+  } else if (isMoving) {
+    double metersPerSecond = reading.kmph / 3.6;
+    double interval = metersPerSecond > 0 ? GPS_TRACK_SPACING / metersPerSecond * 1000 : GPS_MOVING_INTERVAL;
+    gpsInterval = constrain(interval, (double)GPS_MIN_INTERVAL, (double)GPS_MOVING_INTERVAL);
+  } else {
+    // Parked, or no fix which is usually indoors
+    gpsInterval = min(max(gpsInterval, GPS_MOVING_INTERVAL / 2) * 2, GPS_UPDATE_INTERVAL);
+  }
+  if (reading.hasFix) lastReading = reading;
+  LOG_INFO(LOG_GPS, isMoving ? "Moving" : "Parked");
+  LOG_INFO(LOG_GPS, ", next GPS check in (s): ");
+  LOG_INFOLN(LOG_GPS, gpsInterval / 1000);
+}
+
 LocReading Location::parseInf(char* infBuffer) {
   uint8_t paramNum = 0;
   uint8_t paramStart = 0;
@@ -70,11 +101,11 @@ LocReading Location::parseInf(char* infBuffer) {
 
 void Location::setGPSPower(bool turnOn) {
   isPowered = turnOn;
-  if (turnOn) Serial.println("\nGPS check scheduled, warming up GPS module");
-  else Serial.println("\nGPS module powering off");
-  Serial1.print("AT+CGNSPWR=");
-  Serial1.println(turnOn ? "1" : "0");
-  Serial1.flush();
+  if (turnOn) LOG_INFOLN(LOG_GPS, "\nGPS check scheduled, warming up GPS module");
+  else LOG_INFOLN(LOG_GPS, "\nGPS module powering off");
+  Hal::modem().print("AT+CGNSPWR=");
+  Hal::modem().println(turnOn ? "1" : "0");
+  Hal::modem().flush();
   char resp[10];
-  Utilities::readUntilResp("AT+CGNSPWR", resp, nullptr, 10);
+  Utilities::readUntilResp("", resp, sizeof resp, nullptr, 10);
 }
\ No newline at end of file
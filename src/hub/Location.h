@@ -1,6 +1,8 @@
 #ifndef HUB_LOCATION_H
 #define HUB_LOCATION_H
 
+#include <Arduino.h>
+
 struct LocReading {
   bool hasFix = false;
   double lat = 0;
@@ -10,11 +12,28 @@ struct LocReading {
   double hdop = 0;
 };
 
-// Interval is the amount of time between checks
+// Interval is the amount of time between checks, the most it backs off to while parked
 const unsigned long GPS_UPDATE_INTERVAL = 29.5 * 60 * 1000;
-// When a check is ready to occur, the module is 
-// powered on for this amount of time before reading
+// Between checks while moving slowly, and where the back-off starts once parked
+const unsigned long GPS_MOVING_INTERVAL = 2 * 60 * 1000;
+// Shortest time between checks, while turning or moving fast
+const unsigned long GPS_MIN_INTERVAL = 30 * 1000;
+// When a check is ready to occur, the module is powered on for at most
+// this amount of time, a fix with an HDOP of GPS_GOOD_HDOP or less ends it early
 const unsigned long GPS_BUFFER_TIME = 20000;
+const double GPS_GOOD_HDOP = 2;
+// Time between AT+CGNSINF polls while warming up
+const unsigned long GPS_POLL_INTERVAL = 2000;
+// Distance aimed for between fixes while moving (in m), so the faster it goes the more often it checks
+const double GPS_TRACK_SPACING = 500;
+// Below this speed (in km/h) the reported speed is mostly noise
+const double GPS_MOVING_KMPH = 5;
+// Course change between fixes that counts as a turn (in degrees)
+const double GPS_TURN_DEGREES = 30;
+// Rough error per unit of HDOP (in m), fixes further apart than their combined error moved
+const double GPS_HDOP_METERS = 5;
+// Locations closer than this (or their error) to the last one tracked aren't added to the track (in m)
+const double GPS_MIN_DISTANCE = 20;
 
 class Location
 {
@@ -25,11 +44,19 @@ private:
 public:
   // The last time (in millis) that location was queried
   unsigned long lastGPSTime = 0;
+  // Time (in millis) from lastGPSTime until the next check, see schedule
+  unsigned long gpsInterval = GPS_MOVING_INTERVAL;
+  // When the module was powered on for the current check and last polled (in millis)
+  unsigned long warmupStartTime = 0;
+  unsigned long lastPollTime = 0;
+  // The last fix, sent or not, to tell if it's moving
+  LocReading lastReading;
   // // The last latitude sent to the server
   // double lastSentLat = 0;
   // // The last longitude sent to the server
   // double lastSentLng = 0;
-  LocReading lastSentReading;
+  // The last fix added to the track
+  LocReading lastTrackedReading;
 
   // If the GPS module is powered on (should be off on init)
   bool isPowered = false;
@@ -43,12 +70,33 @@ public:
 
   /**
    * Returns the distance (in meters) between passed in point
-   * and lastSent point
+   * and the last tracked point
    */
   double distanceFromLastPoint(double lat, double lng) {
-    return distance(lat, lng, lastSentReading.lat, lastSentReading.lng);
+    return distance(lat, lng, lastTrackedReading.lat, lastTrackedReading.lng);
+  }
+
+  /**
+   * True if reading is precise enough to end the warm-up
+   */
+  static bool isGoodFix(const LocReading& reading) {
+    return reading.hasFix && reading.hdop > 0 && reading.hdop <= GPS_GOOD_HDOP;
+  }
+
+  /**
+   * True if reading is far enough from the last tracked location to be worth adding to the track
+   */
+  bool isNewLocation(const LocReading& reading) {
+    return distanceFromLastPoint(reading.lat, reading.lng) >= max(GPS_MIN_DISTANCE, GPS_HDOP_METERS * reading.hdop);
   }
 
+  /**
+   * Sets gpsInterval from the result of a check, which may not have a fix
+   * While moving it's the time to cover GPS_TRACK_SPACING, down to GPS_MIN_INTERVAL on a turn,
+   * otherwise it doubles from GPS_MOVING_INTERVAL up to GPS_UPDATE_INTERVAL
+   */
+  void schedule(const LocReading& reading);
+
   /**
    * Parse a line received from the AT+CGNSINF command
    * and return a LocReading struct
@@ -0,0 +1,84 @@
+#include <./hub/Log.h>
+
+namespace Log {
+  Sink sink;
+
+#ifdef HUB_LOG_RING_SIZE
+  uint8_t ring[HUB_LOG_RING_SIZE]{};
+  // Next index written, and how much of the ring is filled
+  uint16_t ringHead = 0;
+  uint16_t ringLen = 0;
+
+  void ringWrite(uint8_t c) {
+    ring[ringHead] = c;
+    ringHead = (ringHead + 1) % HUB_LOG_RING_SIZE;
+    if (ringLen < HUB_LOG_RING_SIZE) ringLen++;
+  }
+
+  // Byte i of the ring counting from the oldest
+  uint8_t ringAt(uint16_t i) {
+    return ring[(ringHead + HUB_LOG_RING_SIZE - ringLen + i) % HUB_LOG_RING_SIZE];
+  }
+
+  // Index of the oldest line's header, the line before it may have been partly overwritten
+  uint16_t ringStart() {
+    uint16_t i = 0;
+    while (i < ringLen && !(ringAt(i) & 0x80)) i++;
+    return i;
+  }
+
+  size_t readRing(uint8_t* out, size_t size) {
+    size_t len = 0;
+    for (uint16_t i = ringStart(); i < ringLen && len < size; i++) out[len++] = ringAt(i);
+    return len;
+  }
+
+  void printRing(Print& out) {
+    for (uint16_t i = ringStart(); i < ringLen;) {
+      uint8_t header = ringAt(i++);
+      uint32_t time = 0;
+      for (uint8_t j = 0; j < 5 && i < ringLen; j++) time |= (uint32_t)ringAt(i++) << (7 * j);
+      out.print("[");
+      out.print(time);
+      out.print(" ");
+      out.print((header >> 3) & 0x0F);
+      out.print(" ");
+      out.print(header & 0x07);
+      out.print("] ");
+      while (i < ringLen && !(ringAt(i) & 0x80)) out.write(ringAt(i++));
+    }
+  }
+#endif
+
+  Sink& Sink::begin(uint8_t level, uint8_t subsystem) {
+    this->level = level;
+    this->subsystem = subsystem;
+    return *this;
+  }
+
+  size_t Sink::write(uint8_t c) {
+#ifdef HUB_LOG_RING_SIZE
+    if (c != '\r') {
+      if (isLineStart) {
+        uint8_t idx = 0;
+        while (idx < 7 && !(subsystem & (1 << idx))) idx++;
+        ringWrite(0x80 | (level & 0x0F) << 3 | idx);
+        uint32_t time = millis();
+        for (uint8_t i = 0; i < 5; i++) ringWrite((time >> (7 * i)) & 0x7F);
+      }
+      ringWrite(c & 0x80 ? '?' : c);
+      isLineStart = c == '\n';
+    }
+#endif
+    return Serial.write(c);
+  }
+
+  size_t Sink::write(const uint8_t* buffer, size_t size) {
+#ifdef HUB_LOG_RING_SIZE
+    for (size_t i = 0; i < size; i++) write(buffer[i]);
+    return size;
+#else
+    return Serial.write(buffer, size);
+#endif
+  }
+}
@@ -0,0 +1,81 @@
+#ifndef HUB_LOG_H
+#define HUB_LOG_H
+
+#include <Arduino.h>
+
+// Levels for HUB_LOG_LEVEL, messages above it compile to nothing
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// Subsystems for HUB_LOG_SUBSYSTEMS, a mask of the ones compiled in
+#define LOG_NETWORK 0x01 // Requests and registration
+#define LOG_BLE 0x02     // Scanning, sensors and the phone
+#define LOG_GPS 0x04
+#define LOG_POWER 0x08   // Modem power states, battery and sleep
+#define LOG_OTA 0x10
+#define LOG_APP 0x20     // Everything else, ie setup and pairing
+
+// Production builds set these in build_flags, ie -D HUB_LOG_LEVEL=LOG_LEVEL_WARN
+#ifndef HUB_LOG_LEVEL
+#define HUB_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+#ifndef HUB_LOG_SUBSYSTEMS
+#define HUB_LOG_SUBSYSTEMS 0xFF
+#endif
+
+#define LOG_ENABLED(level, subsystem) ((level) <= HUB_LOG_LEVEL && ((subsystem) & HUB_LOG_SUBSYSTEMS))
+
+// Same arguments as Serial.print and println after the subsystem, the condition is constant so
+// disabled calls are removed along with their arguments
+#define HUB_LOG(level, subsystem, method, ...) \
+  do { if (LOG_ENABLED(level, subsystem)) Log::out(level, subsystem).method(__VA_ARGS__); } while (0)
+
+#define LOG_ERROR(subsystem, ...) HUB_LOG(LOG_LEVEL_ERROR, subsystem, print, __VA_ARGS__)
+#define LOG_ERRORLN(subsystem, ...) HUB_LOG(LOG_LEVEL_ERROR, subsystem, println, __VA_ARGS__)
+#define LOG_WARN(subsystem, ...) HUB_LOG(LOG_LEVEL_WARN, subsystem, print, __VA_ARGS__)
+#define LOG_WARNLN(subsystem, ...) HUB_LOG(LOG_LEVEL_WARN, subsystem, println, __VA_ARGS__)
+#define LOG_INFO(subsystem, ...) HUB_LOG(LOG_LEVEL_INFO, subsystem, print, __VA_ARGS__)
+#define LOG_INFOLN(subsystem, ...) HUB_LOG(LOG_LEVEL_INFO, subsystem, println, __VA_ARGS__)
+#define LOG_DEBUG(subsystem, ...) HUB_LOG(LOG_LEVEL_DEBUG, subsystem, print, __VA_ARGS__)
+#define LOG_DEBUGLN(subsystem, ...) HUB_LOG(LOG_LEVEL_DEBUG, subsystem, println, __VA_ARGS__)
+
+namespace Log {
+  /**
+   * Writes to Serial, and with HUB_LOG_RING_SIZE defined also to a ring buffer of recent lines
+   */
+  class Sink : public Print {
+  private:
+    uint8_t level = LOG_LEVEL_NONE;
+    uint8_t subsystem = 0;
+    bool isLineStart = true;
+
+  public:
+    Sink& begin(uint8_t level, uint8_t subsystem);
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t* buffer, size_t size) override;
+    using Print::write;
+  };
+
+  extern Sink sink;
+
+  inline Print& out(uint8_t level, uint8_t subsystem) { return sink.begin(level, subsystem); }
+
+#ifdef HUB_LOG_RING_SIZE
+  /**
+   * Copies the ring oldest first into out, starting at the oldest complete line, returns the length copied
+   * Each line starts with a header byte, 0x80 | level << 3 | subsystem bit index, then millis() in
+   * 5 bytes of 7 bits least significant first, then its text, which is ASCII so only headers have the top bit set
+   */
+  size_t readRing(uint8_t* out, size_t size);
+
+  /**
+   * Prints the ring as text, ie [12345 3 0] Registered, out can't be the sink itself
+   */
+  void printRing(Print& out);
+#endif
+}
+
+#endif
@@ -0,0 +1,282 @@
+#ifdef HUB_MODEM_EMULATOR
+
+#include <./hub/ModemEmulator.h>
+#include <./hub/Hal.h>
+
+ModemEmulator modemEmulator;
+
+const char* BOOT_MESSAGES = "\r\nRDY\r\n\r\n+CFUN: 1\r\n\r\n+CPIN: READY\r\n\r\nCall Ready\r\n\r\nSMS Ready\r\n";
+const char* CFUN_READY_MESSAGES = "\r\n+CPIN: READY\r\n\r\nCall Ready\r\n\r\nSMS Ready\r\n";
+const char* PERSISTED_QUERY_NOT_FOUND = "{\"errors\":[{\"message\":\"PersistedQueryNotFound\",\"extensions\":{\"code\":\"PERSISTED_QUERY_NOT_FOUND\"}}]}";
+
+void ModemEmulator::install() {
+  Hal::setModem(this);
+  Hal::setModemPowerListener([](bool on) { modemEmulator.setPower(on); });
+}
+
+void ModemEmulator::uninstall() {
+  Hal::setModem(nullptr);
+  Hal::setModemPowerListener(nullptr);
+}
+
+void ModemEmulator::setPower(bool on) {
+  outHead = 0;
+  outTail = 0;
+  segmentsLen = 0;
+  lineLen = 0;
+  skipLf = false;
+  downloadLeft = 0;
+  cregMode = 0;
+  sleepMode = 0;
+  isDroppingLine = false;
+  isPowered = on;
+  isRadioOn = on;
+  if (on) {
+    readyTime = millis() + config.bootTime;
+    regTime = readyTime + config.regTime;
+    isRegUrcSent = false;
+    queue(BOOT_MESSAGES, readyTime);
+  }
+}
+
+const ModemScript* ModemEmulator::findScript(const char* command) {
+  for (uint8_t i = 0; i < config.scriptsLen; i++) {
+    const char* scriptCommand = config.scripts[i].command;
+    if (strncmp(command, scriptCommand, strlen(scriptCommand)) == 0) return &config.scripts[i];
+  }
+  return nullptr;
+}
+
+void ModemEmulator::queue(const char* str, unsigned long readyAt) {
+  queue(str, strlen(str), readyAt);
+}
+
+void ModemEmulator::queue(const char* data, uint16_t len, unsigned long readyAt) {
+  if (!isPowered) return;
+  // Bytes can't overtake ones queued before them on a serial line
+  if (segmentsLen && readyAt < segments[segmentsLen - 1].readyAt) readyAt = segments[segmentsLen - 1].readyAt;
+  for (uint16_t i = 0; i < len; i++) {
+    bytesQueued++;
+    if (config.dropEvery && bytesQueued % config.dropEvery == 0) continue;
+    if (outTail < EMULATOR_OUT_SIZE) out[outTail++] = data[i];
+  }
+  if (segmentsLen == EMULATOR_MAX_SEGMENTS) {
+    segments[segmentsLen - 1].end = outTail;
+    segments[segmentsLen - 1].readyAt = readyAt;
+  } else {
+    segments[segmentsLen++] = { outTail, readyAt };
+  }
+}
+
+void ModemEmulator::reply(const char* str, uint16_t latency) {
+  unsigned long readyAt = millis() + latency;
+  queue("\r\n", readyAt);
+  queue(str, readyAt);
+  queue("\r\n", readyAt);
+}
+
+void ModemEmulator::handleCommand() {
+  // Nothing is listening until the module has booted
+  if (millis() < readyTime || lineLen == 0) return;
+  unsigned long now = millis();
+  queue(line, now);
+  queue("\r", now);
+
+  const ModemScript* script = findScript(line);
+  uint16_t latency = script && script->latency ? script->latency : config.commandLatency;
+  if (script && script->reply) {
+    reply(script->reply, latency);
+    return;
+  }
+
+  char resp[60]{};
+  unsigned long readyAt = now + latency;
+  if (strcmp(line, "AT+CREG?") == 0) {
+    uint8_t status = !isRadioOn ? 0 : now >= regTime ? 1 : 2;
+    if (cregMode == 2 && status == 1) sprintf(resp, "+CREG: 2,%d,\"1A2B\",\"3C4D\",0", status);
+    else sprintf(resp, "+CREG: %d,%d", cregMode, status);
+    reply(resp, latency);
+  } else if (strncmp(line, "AT+CREG=", 8) == 0) {
+    cregMode = line[8] - '0';
+    // Only changes are reported
+    isRegUrcSent = isRadioOn && now >= regTime;
+  } else if (strncmp(line, "AT+COPS=4,2,\"", 13) == 0) {
+    // Returns once registered, sooner on the operator it was registered on before
+    if (isRadioOn && strncmp(line + 13, config.operatorCode, strlen(config.operatorCode)) == 0 && regTime > now + config.cachedRegTime) {
+      regTime = now + config.cachedRegTime;
+    }
+    unsigned long regLatency = regTime > now ? regTime - now : 0;
+    reply("OK", regLatency > latency ? regLatency : latency);
+    return;
+  } else if (strcmp(line, "AT+COPS?") == 0) {
+    sprintf(resp, "+COPS: 0,2,\"%s\"", config.operatorCode);
+    reply(resp, latency);
+  } else if (strcmp(line, "AT+GSN") == 0) {
+    reply(config.imei, latency);
+  } else if (strcmp(line, "AT+CGNSINF") == 0) {
+    queue("\r\n+CGNSINF: ", readyAt);
+    queue(config.cgnsInf, readyAt);
+    queue("\r\n", readyAt);
+  } else if (strcmp(line, "AT+CFUN=1") == 0) {
+    reply("OK", latency);
+    queue(CFUN_READY_MESSAGES, readyAt);
+    if (!isRadioOn) {
+      regTime = readyAt + config.regTime;
+      isRegUrcSent = false;
+    }
+    isRadioOn = true;
+    return;
+  } else if (strcmp(line, "AT+CFUN=4") == 0) {
+    if (isRadioOn && cregMode == 1) queue("\r\n+CREG: 0\r\n", readyAt);
+    isRadioOn = false;
+  } else if (strncmp(line, "AT+CSCLK=", 9) == 0) {
+    sleepMode = line[9] - '0';
+  } else if (strncmp(line, "AT+HTTPDATA=", 12) == 0) {
+    downloadLeft = atoi(line + 12);
+    payloadLen = 0;
+    responseBody = config.httpBody;
+    reply("DOWNLOAD", latency);
+    if (downloadLeft > 0) return;
+  } else if (strncmp(line, "AT+HTTPPARA=\"USERDATA\"", 22) == 0) {
+    const char* range = strstr(line, "Range: bytes=");
+    hasRange = range != nullptr;
+    if (range) {
+      char* dash = nullptr;
+      rangeFirst = strtoul(range + 13, &dash, 10);
+      rangeLast = *dash == '-' ? strtoul(dash + 1, NULL, 10) : UINT32_MAX;
+    }
+  } else if (strcmp(line, "AT+HTTPACTION=0") == 0 && config.httpFile) {
+    handleGet(latency);
+    return;
+  } else if (strncmp(line, "AT+HTTPREAD=", 12) == 0) {
+    handleRead(readyAt);
+  } else if (strncmp(line, "AT+HTTPACTION", 13) == 0) {
+    const char* body = responseBody ? responseBody : config.httpBody;
+    reply("OK", latency);
+    sprintf(resp, "+HTTPACTION: 1,%d,%d", config.httpStatus, (int)strlen(body));
+    reply(resp, latency + config.actionLatency);
+    return;
+  } else if (strcmp(line, "AT+HTTPREAD") == 0) {
+    const char* body = responseBody ? responseBody : config.httpBody;
+    sprintf(resp, "\r\n+HTTPREAD: %d\r\n", (int)strlen(body));
+    queue(resp, readyAt);
+    queue(body, readyAt + config.readBodyDelay);
+    queue("\r\n", readyAt + config.readBodyDelay);
+  }
+  reply("OK", latency);
+}
+
+void ModemEmulator::handleGet(uint16_t latency) {
+  uint16_t status = 200;
+  fileBody = config.httpFile;
+  fileBodyLen = config.httpFileLen;
+  if (config.httpRanges && hasRange) {
+    status = rangeFirst < config.httpFileLen ? 206 : 416;
+    uint32_t last = min(rangeLast, config.httpFileLen - 1);
+    fileBody = config.httpFile + rangeFirst;
+    fileBodyLen = status == 206 ? last - rangeFirst + 1 : 0;
+  }
+  char resp[40]{};
+  reply("OK", latency);
+  sprintf(resp, "+HTTPACTION: 0,%d,%lu", status, (unsigned long)fileBodyLen);
+  reply(resp, latency + config.actionLatency);
+}
+
+void ModemEmulator::handleRead(unsigned long readyAt) {
+  char* comma = nullptr;
+  uint32_t start = strtoul(line + 12, &comma, 10);
+  uint32_t len = *comma == ',' ? strtoul(comma + 1, NULL, 10) : 0;
+  if (!fileBody || start >= fileBodyLen) return;
+  len = min(len, fileBodyLen - start);
+  char resp[30]{};
+  sprintf(resp, "\r\n+HTTPREAD: %lu\r\n", (unsigned long)len);
+  queue(resp, readyAt);
+  queue((const char*)fileBody + start, len, readyAt + config.readBodyDelay);
+  queue("\r\n", readyAt + config.readBodyDelay);
+}
+
+void ModemEmulator::handlePayload() {
+  payload[payloadLen] = '\0';
+  if (!config.persistedQueries) return;
+  const char* hash = strstr(payload, "\"sha256Hash\":\"");
+  if (!hash) return;
+  hash += 14;
+  if (strstr(payload, "\"query\":")) {
+    strncpy(storedHashes[nextStoredHash], hash, 64);
+    nextStoredHash = (nextStoredHash + 1) % EMULATOR_PERSISTED_QUERIES;
+    return;
+  }
+  for (uint8_t i = 0; i < EMULATOR_PERSISTED_QUERIES; i++) {
+    if (strncmp(storedHashes[i], hash, 64) == 0) return;
+  }
+  responseBody = PERSISTED_QUERY_NOT_FOUND;
+}
+
+void ModemEmulator::forgetPersistedQueries() {
+  memset(storedHashes, 0, sizeof storedHashes);
+  nextStoredHash = 0;
+}
+
+int ModemEmulator::available() {
+  unsigned long now = millis();
+  if (cregMode == 1 && isRadioOn && !isRegUrcSent && now >= regTime) {
+    isRegUrcSent = true;
+    queue("\r\n+CREG: 1\r\n", now);
+  }
+  uint16_t readyEnd = outHead;
+  for (uint8_t i = 0; i < segmentsLen && segments[i].readyAt <= now; i++) readyEnd = segments[i].end;
+  return readyEnd > outHead ? readyEnd - outHead : 0;
+}
+
+int ModemEmulator::read() {
+  if (available() < 1) return -1;
+  char c = out[outHead++];
+  if (outHead == outTail) {
+    outHead = 0;
+    outTail = 0;
+    segmentsLen = 0;
+  }
+  return (uint8_t)c;
+}
+
+int ModemEmulator::peek() {
+  if (available() < 1) return -1;
+  return (uint8_t)out[outHead];
+}
+
+size_t ModemEmulator::write(uint8_t c) {
+  if (!isPowered) return 1;
+  // println terminates commands with \r\n, the \n is dropped rather than treated as AT+HTTPDATA payload
+  if (skipLf) {
+    skipLf = false;
+    if (c == '\n') return 1;
+  }
+  if (downloadLeft > 0) {
+    // AT+HTTPDATA payload isn't echoed
+    bytesUploaded++;
+    if (payloadLen < sizeof payload - 1) payload[payloadLen++] = c;
+    if (--downloadLeft == 0) {
+      handlePayload();
+      reply("OK", config.commandLatency);
+    }
+    return 1;
+  }
+  unsigned long now = millis();
+  if (lineLen == 0 && sleepMode == 2 && now >= lastRxTime + config.sleepDelay) {
+    // Asleep, the line that wakes it is lost
+    isDroppingLine = true;
+  }
+  lastRxTime = now;
+  if (c == '\r' || c == '\n') {
+    line[lineLen] = '\0';
+    if (!isDroppingLine) handleCommand();
+    isDroppingLine = false;
+    lineLen = 0;
+    skipLf = c == '\r';
+  } else if (lineLen < sizeof line - 1) {
+    line[lineLen++] = c;
+  }
+  return 1;
+}
+
+#endif
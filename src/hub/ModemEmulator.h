@@ -0,0 +1,147 @@
+#ifndef HUB_MODEM_EMULATOR_H
+#define HUB_MODEM_EMULATOR_H
+
+#include <Arduino.h>
+
+// Stand-in for the SIM800 that answers AT commands with the same byte sequences,
+// only compiled when HUB_MODEM_EMULATOR is defined (nano33iot_emulated and nano33iot_bench)
+
+// Size of the queue of bytes waiting to be read by the hub
+const uint16_t EMULATOR_OUT_SIZE = 1024;
+const uint8_t EMULATOR_MAX_SEGMENTS = 8;
+// Largest AT+HTTPDATA payload kept for the stand-in server to look at
+const uint16_t EMULATOR_PAYLOAD_SIZE = 1200;
+const uint8_t EMULATOR_PERSISTED_QUERIES = 4;
+
+/**
+ * Overrides the built-in reply to every command starting with command
+ */
+struct ModemScript {
+  const char* command;
+  // Milliseconds between receiving the command and the reply being readable
+  uint16_t latency = 0;
+  // Replaces the built-in reply when set, ie "ERROR"
+  const char* reply = nullptr;
+};
+
+struct ModemEmulatorConfig {
+  // Time from power on until SMS Ready
+  uint16_t bootTime = 3000;
+  // Time after SMS Ready, or AT+CFUN=1 leaving airplane mode, until AT+CREG? reports registered
+  uint16_t regTime = 2000;
+  // Registration time instead of regTime after AT+COPS=4 with operatorCode, skipping the network scan
+  uint16_t cachedRegTime = 500;
+  // UART idle time before AT+CSCLK=2 lets the module sleep, the first line after that only wakes it
+  uint16_t sleepDelay = 5000;
+  // Latency for commands without a script entry
+  uint16_t commandLatency = 20;
+  // Time between AT+HTTPACTION responding OK and the +HTTPACTION URC
+  uint16_t actionLatency = 1500;
+  // Drops every nth byte sent to the hub, 0 to disable
+  uint16_t dropEvery = 0;
+  // Time between the +HTTPREAD line and the body it announces, so the hub has to wait on the body mid-parse
+  uint16_t readBodyDelay = 0;
+  uint16_t httpStatus = 200;
+  const char* httpBody = "{\"data\":{\"createEvent\":{\"id\":1}}}";
+  // Served to AT+HTTPACTION=0 instead of httpBody, only the range set with USERDATA unless httpRanges is false
+  const uint8_t* httpFile = nullptr;
+  uint32_t httpFileLen = 0;
+  bool httpRanges = true;
+  const char* imei = "869951031078911";
+  const char* operatorCode = "310260";
+  const char* cgnsInf = "1,1,20221012235342.000,40.71280,-74.00600,10.500,0.00,0.0,1,,1.1,1.4,0.9,,10,7,,,35,,";
+  const ModemScript* scripts = nullptr;
+  uint8_t scriptsLen = 0;
+  // Answers like a server with automatic persisted queries (HUB_PERSISTED_QUERIES), a request with
+  // only a hash it hasn't seen with its document gets PersistedQueryNotFound instead of httpBody
+  bool persistedQueries = true;
+};
+
+class ModemEmulator : public Stream {
+private:
+  struct Segment {
+    uint16_t end;
+    unsigned long readyAt;
+  };
+
+  char out[EMULATOR_OUT_SIZE]{};
+  uint16_t outHead = 0;
+  uint16_t outTail = 0;
+  Segment segments[EMULATOR_MAX_SEGMENTS]{};
+  uint8_t segmentsLen = 0;
+  uint32_t bytesQueued = 0;
+
+  char line[160]{};
+  uint8_t lineLen = 0;
+  bool skipLf = false;
+  // Remaining bytes of AT+HTTPDATA payload to swallow before replying OK
+  uint16_t downloadLeft = 0;
+  char payload[EMULATOR_PAYLOAD_SIZE]{};
+  uint16_t payloadLen = 0;
+  // Body for the next AT+HTTPREAD, httpBody unless the payload changed it
+  const char* responseBody = nullptr;
+  // Range: bytes=<first>-<last> from USERDATA, and the part of httpFile the last GET returned
+  bool hasRange = false;
+  uint32_t rangeFirst = 0;
+  uint32_t rangeLast = 0;
+  const uint8_t* fileBody = nullptr;
+  uint32_t fileBodyLen = 0;
+  // Hashes stored by the stand-in server, survive the module powering off
+  char storedHashes[EMULATOR_PERSISTED_QUERIES][65]{};
+  uint8_t nextStoredHash = 0;
+
+  bool isPowered = false;
+  unsigned long readyTime = 0;
+  // When registration completes after the radio came on, AT+CFUN=4 turns it off until AT+CFUN=1
+  unsigned long regTime = 0;
+  bool isRadioOn = false;
+  uint8_t cregMode = 0;
+  // If the +CREG URC for the current registration was sent, only with AT+CREG=1
+  bool isRegUrcSent = false;
+  // AT+CSCLK mode, and when the last byte came in to tell if the module has dozed off
+  uint8_t sleepMode = 0;
+  unsigned long lastRxTime = 0;
+  bool isDroppingLine = false;
+
+  const ModemScript* findScript(const char* command);
+  void queue(const char* str, unsigned long readyAt);
+  void queue(const char* data, uint16_t len, unsigned long readyAt);
+  void handleGet(uint16_t latency);
+  void handleRead(unsigned long readyAt);
+  void handleCommand();
+  void reply(const char* str, uint16_t latency);
+  void handlePayload();
+
+public:
+  ModemEmulatorConfig config;
+
+  // AT+HTTPDATA payload bytes received, what the request would cost over the air
+  uint32_t bytesUploaded = 0;
+
+  /**
+   * Stand-in server forgets every persisted query, ie after a restart
+   */
+  void forgetPersistedQueries();
+
+  /**
+   * Replaces Serial1 with this emulator until uninstall is called
+   */
+  void install();
+
+  void uninstall();
+
+  /**
+   * Mirrors the SIM_MOSFET, powering on starts the boot sequence and powering off drops all pending output
+   */
+  void setPower(bool on);
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t c) override;
+  using Print::write;
+};
+
+extern ModemEmulator modemEmulator;
+
+#endif
@@ -0,0 +1,15 @@
+#if defined(HUB_NATIVE) && !defined(PIO_UNIT_TESTING)
+
+#include <./hub/Benchmark.h>
+#include <./hub/Hal.h>
+
+/**
+ * Entry point of the native env, runs the benchmarks on the host instead of the sketch
+ */
+int main() {
+  Hal::beginClock();
+  Benchmark::runAll();
+  return 0;
+}
+
+#endif
@@ -1,23 +1,97 @@
-#include <FlashStorage.h>
 #include <./hub/Utilities.h>
+#include <./hub/Hal.h>
+#include <./hub/AtParser.h>
+#include <./hub/Timings.h>
+#include <./hub/Log.h>
 #include <./conf.cpp>
 #include <./hub/Network.h>
 
-FlashStorage(flashTokenData, TokenData);
+HUB_FLASH_STORAGE(flashTokenData, TokenData);
+HUB_FLASH_STORAGE(flashRegCache, RegCache);
 
-uint8_t AT_HTTPDATA_IDX = 6;
-uint8_t AT_HTTPACTION_IDX = 7;
-uint8_t AT_HTTPREAD_IDX = 8;
+/**
+ * Reads at most len bytes of an AT+HTTPREAD body from the modem, so it can be parsed as it arrives
+ */
+class HttpReadStream : public Stream {
+private:
+  uint16_t remaining;
+  BLELocalDevice* BLE;
+
+public:
+  HttpReadStream(uint16_t len, BLELocalDevice* BLE) : remaining(len), BLE(BLE) {}
+
+  uint16_t left() { return remaining; }
+
+  int available() override {
+    if (!remaining) return 0;
+    return min((uint16_t)Hal::modem().available(), remaining);
+  }
+
+  int read() override {
+    if (!remaining) return -1;
+    int c = Hal::modem().read();
+    // Stream::timedRead keeps calling until a byte arrives, only one that did counts against the body
+    if (c < 0) {
+      if (BLE) BLE->poll();
+    } else {
+      remaining--;
+    }
+    return c;
+  }
+
+  int peek() override {
+    if (!remaining) return -1;
+    return Hal::modem().peek();
+  }
+
+  size_t write(uint8_t) override { return 0; }
+};
+
+// Sent once per session to open the GPRS bearer and HTTP context, followed by the URL
+const char* const SESSION_OPEN_COMMANDS[] = {
+  // "AT+SAPBR=3,1,\"APN\",\"hologram\"",
+  // "AT+SAPBR=3,1,\"Contype\",\"GPRS\"",
+  "AT+SAPBR=1,1",
+  "AT+HTTPINIT",
+  "AT+HTTPPARA=\"CID\",1",
+  "AT+HTTPPARA=\"CONTENT\",\"application/json\"",
+};
+
+const char* const SESSION_CLOSE_COMMANDS[] = {
+  "AT+HTTPTERM",
+  "AT+SAPBR=0,1",
+};
+
+// Sent once after a cold boot, registration changes are reported as +CREG URCs and +COPS? is numeric
+const char* const REG_SETUP_COMMANDS[] = {
+  "AT+CREG=1",
+  "AT+COPS=3,2",
+};
+
+/**
+ * Status from the rest of a +CREG: line, either <n>,<stat>[,<lac>,<ci>] answering AT+CREG?
+ * or the URC's <stat>[,<lac>,<ci>], -1 if there's no status
+ */
+int8_t parseRegStatus(const char* fields) {
+  if (!isdigit(fields[0])) return -1;
+  const char* comma = strchr(fields, ',');
+  if (comma && isdigit(comma[1])) return atoi(comma + 1);
+  return atoi(fields);
+}
+
+bool isRegistered(int8_t status) {
+  return status == 1 || status == 5;
+}
 
 void Network::InitializeAccessToken() {
   tokenData = flashTokenData.read();
   if (tokenData.isValid) {
-    Serial.print("Found existing token: ");
-    Serial.println(tokenData.accessToken);
-    Serial.print("Token length: ");
-    Serial.println(strlen(tokenData.accessToken));
+    LOG_DEBUG(LOG_NETWORK, "Found existing token: ");
+    LOG_DEBUGLN(LOG_NETWORK, tokenData.accessToken);
+    LOG_DEBUG(LOG_NETWORK, "Token length: ");
+    LOG_DEBUGLN(LOG_NETWORK, strlen(tokenData.accessToken));
   } else {
-    Serial.println("No existing token found");
+    LOG_INFOLN(LOG_NETWORK, "No existing token found");
   }
 }
 
@@ -27,269 +101,804 @@ void Network::SetAccessToken(const char newAccessToken[100]) {
   flashTokenData.write(tokenData);
 }
 
-DynamicJsonDocument Network::SendRequest(char* query, BLELocalDevice* BLE) {
-  Utilities::analogWriteRGB(0, 0, 60);
-  Serial.println("Sending request");
-  Serial.println(query);
+bool Network::sendRequestCommand(const char* command, const char* query, BLELocalDevice* BLE) {
+  // Required so that services can be read for some reason
+  // FIXME - https://github.com/arduino-libraries/ArduinoBLE/issues/175
+  // https://github.com/arduino-libraries/ArduinoBLE/issues/236
+  BLE->poll();
+
+  Hal::modem().println(command);
+  Hal::modem().flush();
+  unsigned long startTime = millis();
+  AtEvent event;
+  if (strncmp(command, "AT+HTTPDATA", 11) == 0) { // send query to HTTPDATA command
+    unsigned long timeout = millis() + 1200;
+    while (atParser.waitNext(event, timeout, BLE)) {
+      LOG_DEBUGLN(LOG_NETWORK, event.line);
+      if (event.type == AT_PROMPT) break;
+    }
+    Utilities::bleDelay(900, BLE); // receive NO CARRIER response without waiting this amount
+    Hal::modem().write(query);
+    Hal::modem().flush();
+  }
+  unsigned long timeout = millis() + 5000;
+  while (atParser.waitNext(event, timeout, BLE)) {
+    LOG_DEBUGLN(LOG_NETWORK, event.line);
+    if (event.type == AT_ERROR) {
+      commandTimings.add(command, millis() - startTime);
+      return false;
+    }
+    if (event.type != AT_OK) continue;
+    if (strncmp(command, "AT+HTTPACTION", 13) != 0) {
+      commandTimings.add(command, millis() - startTime);
+      return true;
+    }
+    // special case for AT+HTTPACTION response responding OK before query resolve :/
+    while (atParser.waitNext(event, timeout, BLE)) {
+      LOG_DEBUGLN(LOG_NETWORK, event.line);
+      if (event.urc == URC_HTTPACTION) {
+        commandTimings.add(command, millis() - startTime);
+        return true;
+      }
+    }
+    break;
+  }
+  Utilities::analogWriteRGB(70, 5, 0);
+  LOG_WARNLN(LOG_NETWORK, ">>Network Request Timeout<<");
+  commandTimings.addTimeout(command);
+  return false;
+}
 
-  while (Serial1.available()) Serial.print(Serial1.read());
-  char authCommand[55 + strlen(tokenData.accessToken)]{};
+DeserializationError Network::readResponse(JsonDocument& doc, JsonDocument* filter, BLELocalDevice* BLE) {
+  BLE->poll();
+  Hal::modem().println("AT+HTTPREAD");
+  Hal::modem().flush();
+  unsigned long startTime = millis();
+
+  // The body follows the +HTTPREAD: <len> line, a result code first means there isn't one
+  int32_t bodyLen = -1;
+  bool hasResult = false;
+  AtEvent event;
+  unsigned long timeout = millis() + 5000;
+  while (bodyLen < 0 && !hasResult && atParser.waitNext(event, timeout, BLE)) {
+    LOG_DEBUGLN(LOG_NETWORK, event.line);
+    hasResult = event.type == AT_OK || event.type == AT_ERROR;
+    if (event.type == AT_LINE && strncmp(event.line, "+HTTPREAD: ", 11) == 0) bodyLen = atoi(event.line + 11);
+  }
+  if (bodyLen < 0) {
+    LOG_WARNLN(LOG_NETWORK, ">>No response body<<");
+    if (hasResult) commandTimings.add("AT+HTTPREAD", millis() - startTime);
+    else commandTimings.addTimeout("AT+HTTPREAD");
+    return DeserializationError::EmptyInput;
+  }
+
+  HttpReadStream body(bodyLen, BLE);
+  body.setTimeout(5000);
+  DeserializationError error = filter
+    ? deserializeJson(doc, body, DeserializationOption::Filter(*filter))
+    : deserializeJson(doc, body);
+
+  // Discard whatever the filter skipped past along with the trailing OK
+  timeout = millis() + 1000;
+  while (body.left() && millis() < timeout) body.read();
+  atParser.waitResult(timeout, BLE);
+  commandTimings.add("AT+HTTPREAD", millis() - startTime);
+  return error;
+}
+
+void Network::openSession(BLELocalDevice* BLE) {
+  LOG_INFOLN(LOG_NETWORK, "Opening HTTP session");
+  for (uint8_t i = 0; i < sizeof SESSION_OPEN_COMMANDS / sizeof * SESSION_OPEN_COMMANDS; i++) {
+    sendRequestCommand(SESSION_OPEN_COMMANDS[i], nullptr, BLE);
+  }
+  isSessionOpen = true;
+  isSessionAuthSet = false;
+  isSessionUrlSet = false;
+  setSessionUrl(BLE);
+}
+
+void Network::setSessionUrl(BLELocalDevice* BLE) {
+  if (isSessionUrlSet) return;
+  char urlCommand[30 + strlen(API_URL)]{};
+  sprintf(urlCommand, "AT+HTTPPARA=\"URL\",\"%s\"", API_URL);
+  isSessionUrlSet = sendRequestCommand(urlCommand, nullptr, BLE);
+}
+
+void Network::CloseSession(BLELocalDevice* BLE) {
+  if (!isSessionOpen) return;
+  LOG_INFOLN(LOG_NETWORK, "Closing HTTP session");
+  for (uint8_t i = 0; i < sizeof SESSION_CLOSE_COMMANDS / sizeof * SESSION_CLOSE_COMMANDS; i++) {
+    sendRequestCommand(SESSION_CLOSE_COMMANDS[i], nullptr, BLE);
+  }
+  isSessionOpen = false;
+  isSessionAuthSet = false;
+}
+
+void Network::setSessionAuth(BLELocalDevice* BLE) {
+  const char* token = tokenData.isValid ? tokenData.accessToken : "";
+  if (isSessionAuthSet && strcmp(sessionAuthToken, token) == 0) return;
+
+  char authCommand[55 + sizeof sessionAuthToken]{};
   if (tokenData.isValid) {
-    sprintf(authCommand, "AT+HTTPPARA=\"USERDATA\",\"Authorization:Bearer %s\"", tokenData.accessToken);
+    sprintf(authCommand, "AT+HTTPPARA=\"USERDATA\",\"Authorization:Bearer %s\"", token);
   } else {
     strcpy(authCommand, "AT+HTTPPARA=\"USERDATA\",\"\"");
   }
+  isSessionAuthSet = sendRequestCommand(authCommand, nullptr, BLE);
+  strcpy(sessionAuthToken, token);
+}
 
-  char urlCommand[30 + strlen(API_URL)]{};
-  sprintf(urlCommand, "AT+HTTPPARA=\"URL\",\"%s\"", API_URL);
+void Network::finishPendingRequest(BLELocalDevice* BLE) {
+  while (isRequestActive()) {
+    tick();
+    if (BLE) BLE->poll();
+  }
+}
+
+DynamicJsonDocument Network::SendRequest(char* query, BLELocalDevice* BLE, JsonDocument* filter, size_t capacity) {
+  finishPendingRequest(BLE);
+  Utilities::analogWriteRGB(0, 0, 60);
+  LOG_INFOLN(LOG_NETWORK, "Sending request");
+  LOG_DEBUGLN(LOG_NETWORK, query);
+
+  atParser.clear(true);
 
   char lenCommand[30]{};
-  sprintf(lenCommand, "AT+HTTPDATA=%d,%d", strlen(query), 5000);
-
-  const char* const commands[] = {
-    // "AT+SAPBR=3,1,\"APN\",\"hologram\"",
-    // "AT+SAPBR=3,1,\"Contype\",\"GPRS\"",
-    "AT+SAPBR=1,1",
-    "AT+HTTPINIT",
-    "AT+HTTPPARA=\"CID\",1",
-    authCommand,
-    urlCommand,
-    "AT+HTTPPARA=\"CONTENT\",\"application/json\"",
-    lenCommand,
-    "AT+HTTPACTION=1",
-    "AT+HTTPREAD",
-    "AT+HTTPTERM",
-    "AT+SAPBR=0,1",
-  };
-
-  char response[RESPONSE_SIZE]{};
-  int size;
-  unsigned int commandsLen = sizeof commands / sizeof * commands;
-  unsigned long timeout;
-  DynamicJsonDocument doc(RESPONSE_SIZE);
-  Serial.print("Commands to iterate through: ");
-  Serial.println(commandsLen);
+  sprintf(lenCommand, "AT+HTTPDATA=%d,%d", (int)strlen(query), 5000);
+  // Always needed to detect an expired token
+  if (filter) (*filter)["errors"][0]["extensions"]["code"] = true;
+
+  DynamicJsonDocument doc(capacity);
   for (uint8_t attempt = 0; attempt < 3; attempt++) {
-    for (uint8_t i = 0; i < commandsLen; i++) {
-      // Required so that services can be read for some reason
-      // FIXME - https://github.com/arduino-libraries/ArduinoBLE/issues/175
-      // https://github.com/arduino-libraries/ArduinoBLE/issues/236
-      BLE->poll();
-      memset(buffer, 0, RESPONSE_SIZE);
-      size = 0;
-
-      Serial1.println(commands[i]);
-      Serial1.flush();
-      timeout = millis() + 1200;
-      if (i == AT_HTTPDATA_IDX) { // send query to HTTPDATA command
-        char str[40]{};
-        uint8_t len = 0;
-        while (millis() < timeout) {
-          if (Serial1.available()) {
-            str[len++] = Serial1.read();
-            if (len >= 30) {
-              str[len] = '\0';
-              if (strcmp(str + (len - 10), "DOWNLOAD\r\n") == 0) break;
-            }
-          }
-        }
-        Serial.println(str);
-        Utilities::bleDelay(900, BLE); // receive NO CARRIER response without waiting this amount
-        Serial1.write(query);
-        Serial1.flush();
-      }
-      timeout = millis() + 5000;
-      while (millis() < timeout) {
-        if (Serial1.available()) {
-          BLE->poll();
-          buffer[size] = Serial1.read();
-          Serial.write(buffer[size]);
-          size++;
-          if (size >= 6
-            && buffer[size - 1] == 10
-            && buffer[size - 2] == 13
-            && buffer[size - 5] == 10 && buffer[size - 4] == 'O' && buffer[size - 3] == 'K' // OK
-            ) {
-            if (i == AT_HTTPACTION_IDX) { // special case for AT+HTTPACTION response responding OK before query resolve :/
-              while (Serial1.available() < 1 && millis() < timeout) { BLE->poll(); }
-              while (Serial1.available() > 0 && millis() < timeout) {
-                BLE->poll();
-                buffer[size] = Serial1.read();
-                Serial.write(buffer[size]);
-                size++;
-              }
-            }
-            buffer[size] = '\0';
-            if (i == AT_HTTPREAD_IDX) { // special case for AT+HTTPREAD to extract the response
-              int16_t responseIdxStart = -1;
-              for (int idx = 0; idx < size - 7; idx++) {
-                BLE->poll();
-                if (responseIdxStart == -1 && buffer[idx] == '{') responseIdxStart = idx;
-                if (responseIdxStart > -1) response[idx - responseIdxStart] = buffer[idx];
-                if (responseIdxStart > -1 && idx == size - 8) response[idx - responseIdxStart + 1] = '\0';
-              }
-            }
-            break;
-          }
-        }
-      }
-      if (millis() >= timeout) {
-        Utilities::analogWriteRGB(70, 5, 0);
-        Serial.println(">>Network Request Timeout<<");
-      }
-    }
-    Serial.print("Request complete\nResponse is: ");
-    Serial.println(response);
+    if (!isSessionOpen) openSession(BLE);
+    setSessionUrl(BLE);
+    setSessionAuth(BLE);
+    sendRequestCommand(lenCommand, query, BLE);
+    sendRequestCommand("AT+HTTPACTION=1", query, BLE);
+    DeserializationError error = readResponse(doc, filter, BLE);
+    LOG_DEBUG(LOG_NETWORK, "Request complete\nResponse is: ");
+    if (LOG_ENABLED(LOG_LEVEL_DEBUG, LOG_NETWORK)) serializeJson(doc, Log::out(LOG_LEVEL_DEBUG, LOG_NETWORK));
+    LOG_DEBUGLN(LOG_NETWORK);
 
-    DeserializationError error = deserializeJson(doc, (const char*)response);
     if (error) {
-      Serial.print("deserializeJson() failed: ");
-      Serial.println(error.f_str());
+      LOG_WARN(LOG_NETWORK, "deserializeJson() failed: ");
+      LOG_WARNLN(LOG_NETWORK, error.f_str());
+      // Start the next attempt from a fresh bearer in case it was dropped
+      CloseSession(BLE);
       if(attempt < 2) {
-        Serial.print("Retrying. Attempt ");
-        Serial.println(attempt + 2);
+        LOG_INFO(LOG_NETWORK, "Retrying. Attempt ");
+        LOG_INFOLN(LOG_NETWORK, attempt + 2);
       } else {
-        Serial.println("All attempts failed");
+        LOG_WARNLN(LOG_NETWORK, "All attempts failed");
       }
     } else {
       Utilities::analogWriteRGB(0, 25, 0);
-      if(doc["errors"] && doc["errors"][0]["extensions"]["code"]) {
-        // TODO clear knownSensorAddrs
-        if(strcmp(doc["errors"][0]["extensions"]["code"], "UNAUTHENTICATED") == 0) {
-          Serial.println("Unauthenticated: Clearing accessToken");
-          memset(tokenData.accessToken, 0, 100);
-          tokenData.isValid = false;
-          flashTokenData.write(tokenData);
-          Serial.println("accessToken cleared");
-        }
-      }
+      checkAuthErrors(doc);
       break;
     }
   }
   return doc;
 }
 
-void Network::setFunMode(bool fullFunctionality) {
-  memset(buffer, 0, RESPONSE_SIZE);
-  uint8_t size = 0;
-  Serial1.print("AT+CFUN=");
-  Serial1.println(fullFunctionality ? "1" : "4");
-  Serial1.flush();
-  unsigned long timeout = millis() + 2000;
-  while (timeout > millis()) {
-    if (Serial1.available()) {
-      buffer[size] = Serial1.read();
-      size++;
+void Network::checkAuthErrors(JsonDocument& doc) {
+  if(doc["errors"] && doc["errors"][0]["extensions"]["code"]) {
+    // TODO clear knownSensors
+    if(strcmp(doc["errors"][0]["extensions"]["code"], "UNAUTHENTICATED") == 0) {
+      LOG_WARNLN(LOG_NETWORK, "Unauthenticated: Clearing accessToken");
+      memset(tokenData.accessToken, 0, 100);
+      tokenData.isValid = false;
+      flashTokenData.write(tokenData);
+      LOG_INFOLN(LOG_NETWORK, "accessToken cleared");
     }
-    if (fullFunctionality && size > 12
-      && buffer[size - 1] == 10
-      && buffer[size - 2] == 13
-      && buffer[size - 7] == 'R' && buffer[size - 6] == 'e' && buffer[size - 5] == 'a' && buffer[size - 4] == 'd' && buffer[size - 3] == 'y') // SMS Ready
-    {
-      return;
-    } else if (!fullFunctionality && size >= 6
-      && buffer[size - 1] == 10
-      && buffer[size - 2] == 13
-      && buffer[size - 5] == 10 && buffer[size - 4] == 'O' && buffer[size - 3] == 'K')
-    {
-      return;
+  }
+}
+
+uint8_t Network::SendRequestAsync(char* query, RequestCallback onComplete, void* context, BLELocalDevice* BLE, JsonDocument* filter, size_t capacity) {
+  if (isRequestActive()) {
+    LOG_WARNLN(LOG_NETWORK, "Request already in flight");
+    return 0;
+  }
+  Utilities::analogWriteRGB(0, 0, 60);
+  LOG_INFOLN(LOG_NETWORK, "Sending async request");
+  LOG_DEBUGLN(LOG_NETWORK, query);
+
+  uint8_t id = beginRequest(onComplete, context, BLE, capacity);
+  request.query = query;
+  request.filter = filter;
+  sprintf(request.lenCommand, "AT+HTTPDATA=%d,%d", (int)strlen(query), 5000);
+  // Always needed to detect an expired token
+  if (filter) (*filter)["errors"][0]["extensions"]["code"] = true;
+  return id;
+}
+
+uint8_t Network::DownloadAsync(const char* url, uint32_t offset, uint32_t length, DownloadSink sink, RequestCallback onComplete, void* context, BLELocalDevice* BLE) {
+  if (isRequestActive()) {
+    LOG_WARNLN(LOG_NETWORK, "Request already in flight");
+    return 0;
+  }
+  Utilities::analogWriteRGB(0, 0, 60);
+  LOG_INFO(LOG_NETWORK, "Downloading from ");
+  LOG_INFOLN(LOG_NETWORK, offset);
+  LOG_DEBUGLN(LOG_NETWORK, url);
+
+  // Nothing is deserialized, it's only there for onComplete
+  uint8_t id = beginRequest(onComplete, context, BLE, 16);
+  request.url = url;
+  request.sink = sink;
+  request.rangeStart = offset;
+  request.rangeLen = min(length, DOWNLOAD_RANGE_SIZE);
+  return id;
+}
+
+uint8_t Network::beginRequest(RequestCallback onComplete, void* context, BLELocalDevice* BLE, size_t capacity) {
+  request = AsyncRequest();
+  // 0 is never a valid handle
+  if (++lastRequestId == 0) lastRequestId = 1;
+  request.id = lastRequestId;
+  request.doc = new DynamicJsonDocument(capacity);
+  request.onComplete = onComplete;
+  request.context = context;
+  request.BLE = BLE;
+  request.startTime = millis();
+
+  atParser.clear(true);
+  noteUse();
+  if (isSessionOpen && powerState == MODEM_ACTIVE) {
+    // Still registered from the last request
+    setRequestState(REQUEST_SENDING);
+  } else {
+    setPower(true);
+    setRequestState(REQUEST_POWERING);
+  }
+  return request.id;
+}
+
+RequestState Network::getRequestState(uint8_t handle) {
+  if (handle == 0 || handle != request.id) return REQUEST_IDLE;
+  return request.state;
+}
+
+void Network::setRequestState(RequestState state) {
+  request.state = state;
+  request.step = 0;
+  request.isWaiting = false;
+}
+
+Network::CommandStatus Network::runCommand(const char* command, uint16_t timeout) {
+  if (!request.isWaiting) {
+    Hal::modem().println(command);
+    Hal::modem().flush();
+    request.isWaiting = true;
+    request.isPrompted = false;
+    request.isQuerySent = false;
+    request.isActionDone = false;
+    request.commandTime = millis();
+    request.deadline = request.commandTime + timeout;
+  }
+
+  // Receive NO CARRIER response without waiting this long after DOWNLOAD
+  if (request.isPrompted && !request.isQuerySent && millis() >= request.resumeTime) {
+    Hal::modem().write(request.query);
+    Hal::modem().flush();
+    request.isQuerySent = true;
+  }
+
+  AtEvent event;
+  while (atParser.next(event)) {
+    LOG_DEBUGLN(LOG_NETWORK, event.line);
+    if (event.urc == URC_SMS_READY) request.isPoweredOn = true;
+    else if (event.urc == URC_CREG) request.regStatus = parseRegStatus(event.line + 7);
+    else if (event.type == AT_LINE && strncmp(event.line, "+COPS: ", 7) == 0) rememberOperator(event.line + 7);
+    else if (event.urc == URC_HTTPACTION) {
+      // +HTTPACTION: <method>,<status>,<len>
+      const char* status = strchr(event.line, ',');
+      request.httpStatus = status ? atoi(status + 1) : 0;
+      request.isActionDone = true;
+    } else if (event.type == AT_PROMPT && !request.isPrompted) {
+      request.isPrompted = true;
+      request.resumeTime = millis() + 900;
+    } else if (event.type == AT_LINE && strncmp(event.line, "+HTTPREAD: ", 11) == 0) {
+      // The body has to be read before anything else the modem sends
+      HttpReadStream body(atoi(event.line + 11), request.BLE);
+      body.setTimeout(5000);
+      if (request.sink) readDownload(body, body.left());
+      else request.error = request.filter
+        ? deserializeJson(*request.doc, body, DeserializationOption::Filter(*request.filter))
+        : deserializeJson(*request.doc, body);
+      unsigned long timeout = millis() + 1000;
+      while (body.left() && millis() < timeout) body.read();
+    } else if (event.type == AT_ERROR) {
+      request.isWaiting = false;
+      commandTimings.add(command, millis() - request.commandTime);
+      return COMMAND_ERROR;
+    } else if (event.type == AT_OK) {
+      // AT+HTTPACTION responds OK before the query resolves
+      request.isActionDone = request.isActionDone || strncmp(command, "AT+HTTPACTION", 13) != 0;
+      if (request.isActionDone) {
+        request.isWaiting = false;
+        commandTimings.add(command, millis() - request.commandTime);
+        return COMMAND_OK;
+      }
     }
   }
+  if (request.isActionDone && strncmp(command, "AT+HTTPACTION", 13) == 0) {
+    request.isWaiting = false;
+    commandTimings.add(command, millis() - request.commandTime);
+    return COMMAND_OK;
+  }
+  if (millis() >= request.deadline) {
+    LOG_WARN(LOG_NETWORK, ">>Command Timeout<< ");
+    LOG_WARNLN(LOG_NETWORK, command);
+    request.isWaiting = false;
+    commandTimings.addTimeout(command);
+    return COMMAND_TIMEOUT;
+  }
+  return COMMAND_PENDING;
 }
 
-bool Network::GetImei(char* imeiBuffer) {
-  memset(buffer, 0, RESPONSE_SIZE);
-  uint8_t size = 0;
-  char command[] = "AT+GSN\r";
-  while (Serial1.available()) Serial1.read();
-  Serial1.write(command);
-  Serial1.flush();
-  unsigned long timeout = millis() + 2000;
-  while (timeout > millis())
-  {
-    if (Serial1.available()) {
-      buffer[size] = Serial1.read();
-      size++;
+void Network::tick() {
+  if (!isRequestActive()) return;
+  if (millis() < request.resumeTime && !request.isWaiting) return;
+  CommandStatus status;
+  switch (request.state) {
+  case REQUEST_POWERING:
+    if (request.step == 0) {
+      // Quick check for a module that was already on, a sleeping one loses the first few characters
+      status = runCommand("AT", powerState == MODEM_SLEEP ? 150 : 100);
+      if (status == COMMAND_OK) request.step = 2;
+      else if (status != COMMAND_PENDING && (powerState != MODEM_SLEEP || ++request.wakeAttempts >= 3)) request.step = 1;
+    } else if (request.step == 2) {
+      // Awake, back to full functionality from whichever low power state it was in
+      if (powerState == MODEM_SLEEP) status = runCommand("AT+CSCLK=0", 1000);
+      else if (powerState == MODEM_AIRPLANE) status = runCommand("AT+CFUN=1", 2000);
+      else status = COMMAND_OK;
+      if (status == COMMAND_PENDING) break;
+      powerState = MODEM_ACTIVE;
+      setRequestState(REQUEST_REGISTERING);
+    } else {
+      AtEvent event;
+      while (!request.isPoweredOn && atParser.next(event)) {
+        LOG_DEBUGLN(LOG_NETWORK, event.line);
+        request.isPoweredOn = event.urc == URC_SMS_READY;
+      }
+      if (request.isPoweredOn) {
+        LOG_INFO(LOG_POWER, "Powered On! Time(ms): ");
+        LOG_INFOLN(LOG_POWER, millis() - request.startTime);
+        powerState = MODEM_ACTIVE;
+        setRequestState(REQUEST_REGISTERING);
+      } else if (millis() > request.startTime + 10000) {
+        LOG_WARNLN(LOG_POWER, "Timed out powering on");
+        finishRequest(false);
+      }
     }
-    if (size >= 6
-      && buffer[size - 1] == 10
-      && buffer[size - 2] == 13
-      && buffer[size - 5] == 10 && buffer[size - 4] == 'O' && buffer[size - 3] == 'K') // OK
-    {
-      buffer[size] = '\0';
-      uint8_t imeiLen = size - strlen(command) - 10;
-      strncpy(imeiBuffer, buffer + strlen(command) + 2, imeiLen);
-      imeiBuffer[imeiLen] = '\0';
-      return true;
+    break;
+
+  case REQUEST_REGISTERING: {
+    // Same steps as waitForReg: setup commands and the cached operator after a cold boot,
+    // AT+CREG? once, then the URC, then AT+COPS? to cache the operator
+    const uint8_t setupLen = sizeof REG_SETUP_COMMANDS / sizeof * REG_SETUP_COMMANDS;
+    if (request.step < setupLen) {
+      if (isRegConfigured) {
+        request.step = setupLen + 1;
+        break;
+      }
+      status = runCommand(REG_SETUP_COMMANDS[request.step], 1000);
+      if (status != COMMAND_PENDING) request.step++;
+    } else if (request.step == setupLen) {
+      RegCache cache = flashRegCache.read();
+      if (!cache.isValid) {
+        request.step++;
+        break;
+      }
+      sprintf(request.command, "AT+COPS=4,2,\"%s\"", cache.operatorCode);
+      status = runCommand(request.command, REG_TIMEOUT);
+      if (status == COMMAND_PENDING) break;
+      if (status != COMMAND_OK) forgetOperator();
+      request.step++;
+    } else if (request.step == setupLen + 1) {
+      status = runCommand("AT+CREG?", 1000);
+      if (status != COMMAND_PENDING) request.step++;
+    } else if (request.step == setupLen + 2) {
+      AtEvent event;
+      while (!isRegistered(request.regStatus) && atParser.next(event)) {
+        LOG_DEBUGLN(LOG_NETWORK, event.line);
+        if (event.urc == URC_CREG) request.regStatus = parseRegStatus(event.line + 7);
+      }
+      if (isRegistered(request.regStatus)) {
+        setRegStatus(request.regStatus);
+        request.step++;
+      } else if (millis() > request.startTime + REG_TIMEOUT) {
+        LOG_WARNLN(LOG_NETWORK, "Timed out registering");
+        regTimes.add(REG_TIMEOUT);
+        finishRequest(false);
+      }
+    } else {
+      if (!isRegConfigured) {
+        status = runCommand("AT+COPS?", 1000);
+        if (status == COMMAND_PENDING) break;
+        isRegConfigured = true;
+      }
+      LOG_INFO(LOG_NETWORK, "Registered! Total Boot up time(ms): ");
+      LOG_INFOLN(LOG_NETWORK, millis() - request.startTime);
+      regTimes.add(millis() - request.startTime);
+      if (LOG_ENABLED(LOG_LEVEL_DEBUG, LOG_NETWORK)) regTimes.print(Log::out(LOG_LEVEL_DEBUG, LOG_NETWORK), "Time to register(ms)");
+      // The bearer survives sleeping
+      setRequestState(isSessionOpen ? REQUEST_SENDING : REQUEST_BEARER);
     }
+    break;
+  }
+
+  case REQUEST_BEARER: {
+    // Failures here show up when reading the response, same as SendRequest
+    const uint8_t closeLen = request.isResettingSession ? sizeof SESSION_CLOSE_COMMANDS / sizeof * SESSION_CLOSE_COMMANDS : 0;
+    const uint8_t openLen = sizeof SESSION_OPEN_COMMANDS / sizeof * SESSION_OPEN_COMMANDS;
+    const char* command;
+    if (request.step < closeLen) command = SESSION_CLOSE_COMMANDS[request.step];
+    else if (request.step < closeLen + openLen) command = SESSION_OPEN_COMMANDS[request.step - closeLen];
+    else if (request.step == closeLen + openLen) {
+      sprintf(request.command, "AT+HTTPPARA=\"URL\",\"%s\"", API_URL);
+      command = request.command;
+    } else {
+      isSessionOpen = true;
+      isSessionAuthSet = false;
+      isSessionUrlSet = true;
+      setRequestState(REQUEST_SENDING);
+      break;
+    }
+    if (runCommand(command, 5000) != COMMAND_PENDING) request.step++;
+    break;
+  }
+
+  case REQUEST_SENDING:
+    if (request.url) {
+      tickDownload();
+    } else if (request.step == 0) {
+      // A download pointed the session elsewhere
+      if (isSessionUrlSet) {
+        request.step++;
+        break;
+      }
+      sprintf(request.command, "AT+HTTPPARA=\"URL\",\"%s\"", API_URL);
+      status = runCommand(request.command, 5000);
+      if (status == COMMAND_PENDING) break;
+      isSessionUrlSet = status == COMMAND_OK;
+      request.step++;
+    } else if (request.step == 1) {
+      const char* token = tokenData.isValid ? tokenData.accessToken : "";
+      if (isSessionAuthSet && strcmp(sessionAuthToken, token) == 0) {
+        request.step++;
+        break;
+      }
+      if (tokenData.isValid) {
+        sprintf(request.command, "AT+HTTPPARA=\"USERDATA\",\"Authorization:Bearer %s\"", token);
+      } else {
+        strcpy(request.command, "AT+HTTPPARA=\"USERDATA\",\"\"");
+      }
+      status = runCommand(request.command, 5000);
+      if (status == COMMAND_PENDING) break;
+      isSessionAuthSet = status == COMMAND_OK;
+      strcpy(sessionAuthToken, token);
+      request.step++;
+    } else if (request.step == 2) {
+      if (runCommand(request.lenCommand, 6200) != COMMAND_PENDING) request.step++;
+    } else if (runCommand("AT+HTTPACTION=1", 5000) != COMMAND_PENDING) {
+      setRequestState(REQUEST_READING);
+    }
+    break;
+
+  case REQUEST_READING:
+    if (request.url) {
+      tickDownload();
+      break;
+    }
+    if (request.step == 0) {
+      request.error = DeserializationError::EmptyInput;
+      request.step++;
+    }
+    status = runCommand("AT+HTTPREAD", 5000);
+    if (status == COMMAND_PENDING) break;
+    LOG_DEBUG(LOG_NETWORK, "Request complete\nResponse is: ");
+    if (LOG_ENABLED(LOG_LEVEL_DEBUG, LOG_NETWORK)) serializeJson(*request.doc, Log::out(LOG_LEVEL_DEBUG, LOG_NETWORK));
+    LOG_DEBUGLN(LOG_NETWORK);
+    if (request.error) {
+      LOG_WARN(LOG_NETWORK, "deserializeJson() failed: ");
+      LOG_WARNLN(LOG_NETWORK, request.error.f_str());
+      retryRequest();
+    } else {
+      Utilities::analogWriteRGB(0, 25, 0);
+      checkAuthErrors(*request.doc);
+      finishRequest(true);
+    }
+    break;
+
+  default:
+    break;
   }
-  return false;
+}
+
+void Network::readDownload(Stream& body, uint16_t len) {
+  request.readLen = 0;
+  // Exactly what tickDownload asked for and followed by \r\n, a body shifted by a lost byte swallows part of it
+  if (len != min(request.rangeLen - request.downloaded, (uint32_t)DOWNLOAD_READ_SIZE)) return;
+  uint8_t data[DOWNLOAD_READ_SIZE];
+  if (body.readBytes(data, len) < len) return;
+  unsigned long timeout = millis() + 100;
+  while (Hal::modem().peek() < 0 && millis() < timeout) {
+    if (request.BLE) request.BLE->poll();
+  }
+  if (Hal::modem().peek() != '\r') return;
+  if (!request.sink(data, len, request.context)) {
+    request.isSinkFailed = true;
+    return;
+  }
+  // Counted as soon as the sink has it, a retry after a lost OK must not hand it the same bytes again
+  request.readLen = len;
+  request.downloaded += len;
+  request.bodyPos += len;
+}
+
+void Network::tickDownload() {
+  CommandStatus status;
+  uint32_t offset = request.rangeStart + request.downloaded;
+  if (request.state == REQUEST_SENDING) {
+    if (request.step == 0) {
+      snprintf(request.command, sizeof request.command, "AT+HTTPPARA=\"URL\",\"%s\"", request.url);
+      if (runCommand(request.command, 5000) == COMMAND_PENDING) return;
+      isSessionUrlSet = false;
+      request.step++;
+    } else if (request.step == 1) {
+      // In place of the Authorization header, the next request sets it again
+      sprintf(request.command, "AT+HTTPPARA=\"USERDATA\",\"Range: bytes=%lu-%lu\"",
+        (unsigned long)offset, (unsigned long)(request.rangeStart + request.rangeLen - 1));
+      if (runCommand(request.command, 5000) == COMMAND_PENDING) return;
+      isSessionAuthSet = false;
+      request.step++;
+    } else {
+      if (!request.isWaiting) request.httpStatus = 0;
+      // The module fetches the whole range before the URC
+      if (runCommand("AT+HTTPACTION=0", 20000) != COMMAND_PENDING) setRequestState(REQUEST_READING);
+    }
+    return;
+  }
+
+  if (request.step == 0) {
+    // A server that doesn't support ranges sends the whole file
+    if (request.httpStatus == 206) {
+      request.bodyPos = 0;
+    } else if (request.httpStatus == 200) {
+      request.bodyPos = offset;
+    } else {
+      LOG_WARN(LOG_NETWORK, "Download failed with status ");
+      LOG_WARNLN(LOG_NETWORK, request.httpStatus);
+      retryRequest();
+      return;
+    }
+    request.step++;
+    return;
+  }
+  if (!request.isWaiting) {
+    request.readLen = 0;
+    sprintf(request.command, "AT+HTTPREAD=%lu,%u", (unsigned long)request.bodyPos,
+      (unsigned)min(request.rangeLen - request.downloaded, (uint32_t)DOWNLOAD_READ_SIZE));
+  }
+  status = runCommand(request.command, 5000);
+  if (status == COMMAND_PENDING) return;
+  if (request.isSinkFailed) {
+    LOG_WARNLN(LOG_NETWORK, "Download stopped by its sink");
+    finishRequest(false);
+    return;
+  }
+  if (request.downloaded < request.rangeLen) {
+    // Lost bytes are read again from a fresh bearer along with the rest of the range
+    if (status != COMMAND_OK || request.readLen == 0) retryRequest();
+    return;
+  }
+  LOG_INFO(LOG_NETWORK, "Downloaded ");
+  LOG_INFO(LOG_NETWORK, request.downloaded);
+  LOG_INFO(LOG_NETWORK, " bytes, Time(ms): ");
+  LOG_INFOLN(LOG_NETWORK, millis() - request.startTime);
+  Utilities::analogWriteRGB(0, 25, 0);
+  finishRequest(true);
+}
+
+void Network::retryRequest() {
+  if (++request.attempt >= 3) {
+    LOG_WARNLN(LOG_NETWORK, "All attempts failed");
+    finishRequest(false);
+    return;
+  }
+  LOG_INFO(LOG_NETWORK, "Retrying. Attempt ");
+  LOG_INFOLN(LOG_NETWORK, request.attempt + 1);
+  // Start the next attempt from a fresh bearer in case it was dropped
+  request.isResettingSession = isSessionOpen;
+  isSessionOpen = false;
+  isSessionAuthSet = false;
+  request.doc->clear();
+  setRequestState(REQUEST_BEARER);
+}
+
+void Network::finishRequest(bool success) {
+  if (!success) Utilities::analogWriteRGB(70, 5, 0);
+  request.state = success ? REQUEST_DONE : REQUEST_FAILED;
+  // Callback may start the next request, which replaces request
+  DynamicJsonDocument* doc = request.doc;
+  request.doc = nullptr;
+  if (request.onComplete) request.onComplete(success, *doc, request.context);
+  delete doc;
+}
+
+void Network::setFunMode(bool fullFunctionality) {
+  Hal::modem().print("AT+CFUN=");
+  Hal::modem().println(fullFunctionality ? "1" : "4");
+  Hal::modem().flush();
+  // SMS Ready comes once the SIM is back up, after the OK
+  unsigned long timeout = millis() + (fullFunctionality ? 10000 : 2000);
+  AtEvent event;
+  while (atParser.waitNext(event, timeout)) {
+    if (fullFunctionality && event.urc == URC_SMS_READY) return;
+    if (!fullFunctionality && event.type == AT_OK) return;
+  }
+}
+
+bool Network::GetImei(char* imeiBuffer) {
+  atParser.clear();
+  Hal::modem().write("AT+GSN\r");
+  Hal::modem().flush();
+  imeiBuffer[0] = '\0';
+  return atParser.waitResult(millis() + 2000, nullptr, "", imeiBuffer, IMEI_SIZE);
 }
 
 bool Network::waitForPowerOn(BLELocalDevice* BLE) {
   if (isPoweredOn()) {
-    Serial.println("Already powered on");
+    LOG_INFOLN(LOG_POWER, "Already powered on");
+    if (powerState == MODEM_BOOTING) powerState = MODEM_ACTIVE;
     return true;
   }
   unsigned long startTime = millis();
-  char resp[100]{};
-  unsigned long timeout = millis() + 10000;
-  uint8_t size = 0;
-  char msg[] = "SMS Ready\r\n";
-  while (millis() < timeout) {
-    while (Serial1.available()) {
-      resp[size++] = Serial1.read();
-      if (size > 12 && resp[size - 1] == '\n') {
-        resp[size] = '\0';
-        uint8_t msgStartIdx = strlen(resp) - strlen(msg);
-        if (strcmp(resp + msgStartIdx, msg) == 0) {
-          Serial.print("Powered On! Time(ms): ");
-          Serial.println(millis() - startTime);
-          return true;
-        }
-      }
+  AtEvent event;
+  while (atParser.waitNext(event, startTime + 10000, BLE)) {
+    if (event.urc == URC_SMS_READY) {
+      LOG_INFO(LOG_POWER, "Powered On! Time(ms): ");
+      LOG_INFOLN(LOG_POWER, millis() - startTime);
+      if (powerState == MODEM_BOOTING) powerState = MODEM_ACTIVE;
+      return true;
     }
-    if (BLE) Utilities::bleDelay(1, BLE);
-    else delay(1);
   }
   return false;
 }
 
+bool Network::pollBooted() {
+  if (powerState == MODEM_OFF) setPower(true);
+  if (powerState != MODEM_BOOTING) return true;
+  AtEvent event;
+  while (atParser.next(event)) {
+    if (event.urc != URC_SMS_READY) continue;
+    LOG_INFO(LOG_POWER, "Powered On! Time(ms): ");
+    LOG_INFOLN(LOG_POWER, millis() - bootStartTime);
+    powerState = MODEM_ACTIVE;
+    return true;
+  }
+  if (millis() < bootStartTime + 10000) return false;
+  // SMS Ready may have gone to someone else's read, the module answering is enough then
+  if (isPoweredOn()) {
+    powerState = MODEM_ACTIVE;
+    return true;
+  }
+  LOG_WARNLN(LOG_POWER, "Timed out powering on");
+  setPower(false);
+  return false;
+}
+
 int8_t Network::getRegStatus(BLELocalDevice* BLE) {
-  char resp[10]{};
-  while (Serial1.available()) Serial.write(Serial1.read());
-  Serial1.println("AT+CREG?");
-  Serial1.flush();
-  Utilities::readUntilResp("AT+CREG?\r\r\n+CREG: ", resp, BLE);
+  char resp[30]{};
+  atParser.clear(true);
+  Hal::modem().println("AT+CREG?");
+  Hal::modem().flush();
+  unsigned long startTime = millis();
+  if (Utilities::readUntilResp("+CREG: ", resp, sizeof resp, BLE)) commandTimings.add("AT+CREG?", millis() - startTime);
+  else commandTimings.addTimeout("AT+CREG?");
 
-  int8_t status = resp[2] - '0';
+  int8_t status = parseRegStatus(resp);
+  setRegStatus(status);
+  return status;
+}
+
+void Network::setRegStatus(int8_t status) {
   if (status != lastStatus) {
     // Only print status if it has changed
-    Serial.print("Registration Status: ");
-    if (status == 0) Serial.println("Not registered, not searching");
-    else if (status == 1) Serial.println("Registered, Home network");
-    else if (status == 2) Serial.println("Not registered, searching");
-    else if (status == 3) Serial.println("Registration denied");
-    else if (status == 4) Serial.println("Unknown, possibly out of range");
-    else if (status == 5) Serial.println("Registered, roaming");
-    else Serial.println("ERROR");
+    LOG_INFO(LOG_NETWORK, "Registration Status: ");
+    if (status == 0) LOG_INFOLN(LOG_NETWORK, "Not registered, not searching");
+    else if (status == 1) LOG_INFOLN(LOG_NETWORK, "Registered, Home network");
+    else if (status == 2) LOG_INFOLN(LOG_NETWORK, "Not registered, searching");
+    else if (status == 3) LOG_INFOLN(LOG_NETWORK, "Registration denied");
+    else if (status == 4) LOG_INFOLN(LOG_NETWORK, "Unknown, possibly out of range");
+    else if (status == 5) LOG_INFOLN(LOG_NETWORK, "Registered, roaming");
+    else LOG_INFOLN(LOG_NETWORK, "ERROR");
     lastStatus = status;
   }
-  return status;
+}
+
+void Network::configureReg(BLELocalDevice* BLE) {
+  char resp[10]{};
+  for (const char* command : REG_SETUP_COMMANDS) {
+    atParser.clear(true);
+    Hal::modem().println(command);
+    Hal::modem().flush();
+    Utilities::readUntilResp("", resp, sizeof resp, BLE);
+  }
+  RegCache cache = flashRegCache.read();
+  if (!cache.isValid) return;
+  char command[30]{};
+  // Manual with automatic fallback, so a stale cache only costs the time to give up on it
+  sprintf(command, "AT+COPS=4,2,\"%s\"", cache.operatorCode);
+  Hal::modem().println(command);
+  Hal::modem().flush();
+  if (!Utilities::readUntilResp("", resp, sizeof resp, BLE, REG_TIMEOUT)) forgetOperator();
+}
+
+bool Network::waitForReg(BLELocalDevice* BLE, unsigned long startTime) {
+  bool isColdBoot = !isRegConfigured;
+  if (isColdBoot) configureReg(BLE);
+  int8_t regStatus = getRegStatus(BLE);
+  AtEvent event;
+  while (!isRegistered(regStatus) && atParser.waitNext(event, startTime + REG_TIMEOUT, BLE)) {
+    LOG_DEBUGLN(LOG_NETWORK, event.line);
+    if (event.urc == URC_CREG) regStatus = parseRegStatus(event.line + 7);
+  }
+  setRegStatus(regStatus);
+  if (!isRegistered(regStatus)) {
+    regTimes.add(REG_TIMEOUT);
+    return false;
+  }
+  regTimes.add(millis() - startTime);
+  if (isColdBoot) {
+    char resp[30]{};
+    atParser.clear(true);
+    Hal::modem().println("AT+COPS?");
+    Hal::modem().flush();
+    if (Utilities::readUntilResp("+COPS: ", resp, sizeof resp, BLE)) rememberOperator(resp);
+    isRegConfigured = true;
+  }
+  return true;
+}
+
+void Network::rememberOperator(const char* info) {
+  // ie 0,2,"310260"
+  const char* start = strchr(info, '"');
+  if (!start) return;
+  start++;
+  const char* end = strchr(start, '"');
+  if (!end || end - start >= OPERATOR_CODE_SIZE) return;
+  RegCache cache = flashRegCache.read();
+  if (cache.isValid && strncmp(cache.operatorCode, start, end - start) == 0 && !cache.operatorCode[end - start]) return;
+  // Only written when it changes to spare the flash
+  memset(cache.operatorCode, 0, sizeof cache.operatorCode);
+  memcpy(cache.operatorCode, start, end - start);
+  cache.isValid = true;
+  flashRegCache.write(cache);
+  LOG_INFO(LOG_NETWORK, "Cached operator: ");
+  LOG_INFOLN(LOG_NETWORK, cache.operatorCode);
+}
+
+void Network::forgetOperator() {
+  RegCache cache = flashRegCache.read();
+  if (!cache.isValid) return;
+  LOG_WARNLN(LOG_NETWORK, "Cached operator failed, forgetting it");
+  cache.isValid = false;
+  flashRegCache.write(cache);
 }
 
 int8_t Network::getAccTech(BLELocalDevice* BLE) {
   if (lastStatus != 1 && lastStatus != 5) return -1;
   char resp[30]{};
-  while (Serial1.available()) Serial.write(Serial1.read());
-  Serial1.println("AT+CREG=2");
-  Serial1.flush();
-  Utilities::readUntilResp("AT+CREG=2", resp, BLE);
-  if (strlen(resp) < 1) return -1;
+  atParser.clear(true);
+  Hal::modem().println("AT+CREG=2");
+  Hal::modem().flush();
+  if (!Utilities::readUntilResp("", resp, sizeof resp, BLE)) return -1;
 
-  Serial1.println("AT+CREG?");
-  Serial1.flush();
-  Utilities::readUntilResp("AT+CREG?\r\r\n+CREG: ", resp, BLE);
+  Hal::modem().println("AT+CREG?");
+  Hal::modem().flush();
+  Utilities::readUntilResp("+CREG: ", resp, sizeof resp, BLE);
 
   int8_t status = resp[2] - '0';
   int8_t accTech = -1;
@@ -297,66 +906,197 @@ int8_t Network::getAccTech(BLELocalDevice* BLE) {
   if (status == 1 || status == 5) {
     // We're registered, print access technology
     accTech = resp[strlen(resp) - 1] - '0';
-    Serial.print("Registered on network: ");
-    if (accTech == 0) Serial.println("GSM");
-    else if (accTech == 2) Serial.println("UTRAN");
-    else if (accTech == 3) Serial.println("GSM w/EGPRS");
-    else if (accTech == 4) Serial.println("UTRAN w/HSDPA");
-    else if (accTech == 5) Serial.println("UTRAN w/HSUPA");
-    else if (accTech == 6) Serial.println("UTRAN w/HSDPA and w/HSUPA");
-    else if (accTech == 7) Serial.println("E-UTRAN");
-    else Serial.println("ERROR");
-  }
-
-  Serial1.println("AT+CREG=0");
-  Serial1.flush();
-  Utilities::readUntilResp("AT+CREG=0", resp, BLE);
+    LOG_INFO(LOG_NETWORK, "Registered on network: ");
+    if (accTech == 0) LOG_INFOLN(LOG_NETWORK, "GSM");
+    else if (accTech == 2) LOG_INFOLN(LOG_NETWORK, "UTRAN");
+    else if (accTech == 3) LOG_INFOLN(LOG_NETWORK, "GSM w/EGPRS");
+    else if (accTech == 4) LOG_INFOLN(LOG_NETWORK, "UTRAN w/HSDPA");
+    else if (accTech == 5) LOG_INFOLN(LOG_NETWORK, "UTRAN w/HSUPA");
+    else if (accTech == 6) LOG_INFOLN(LOG_NETWORK, "UTRAN w/HSDPA and w/HSUPA");
+    else if (accTech == 7) LOG_INFOLN(LOG_NETWORK, "E-UTRAN");
+    else LOG_INFOLN(LOG_NETWORK, "ERROR");
+  }
+
+  // Back to the URCs waitForReg listens for
+  Hal::modem().println("AT+CREG=1");
+  Hal::modem().flush();
+  Utilities::readUntilResp("", resp, sizeof resp, BLE);
   return accTech;
 }
 
 void Network::setPower(bool on) {
-  digitalWrite(SIM_MOSFET, on ? HIGH : LOW);
+  if (on && powerState != MODEM_OFF) return;
+  Hal::setModemPower(on);
   if (on) {
-    Serial.println("Powering on SIM module...");
+    LOG_INFOLN(LOG_POWER, "Powering on SIM module...");
+    powerState = MODEM_BOOTING;
+    bootStartTime = millis();
     lastStatus = -1;
+    isRegConfigured = false;
   } else {
-    Serial.println("Powering off SIM module...");
+    powerState = MODEM_OFF;
+    LOG_INFOLN(LOG_POWER, "Powering off SIM module...");
+    if (isRequestActive()) {
+      LOG_INFOLN(LOG_POWER, "Request in flight cancelled");
+      finishRequest(false);
+    }
+    // The bearer and HTTP context don't survive losing power
+    isSessionOpen = false;
+    isSessionAuthSet = false;
   }
 }
 
-bool Network::isPoweredOn() {
+void Network::noteUse() {
+  uint32_t now = Hal::getEpoch();
+  if (lastUsesLen && now < lastUses[lastUsesLen - 1] + MODEM_USE_COALESCE) {
+    lastUses[lastUsesLen - 1] = now;
+    return;
+  }
+  if (lastUsesLen == MODEM_USE_HISTORY) {
+    memmove(lastUses, lastUses + 1, sizeof lastUses - sizeof * lastUses);
+    lastUsesLen--;
+  }
+  lastUses[lastUsesLen++] = now;
+}
+
+uint32_t Network::getUseInterval() {
+  if (lastUsesLen < 2) return UINT32_MAX;
+  return (lastUses[lastUsesLen - 1] - lastUses[0]) / (lastUsesLen - 1);
+}
+
+ModemPowerState Network::getIdleState() {
+  if (batteryLevel < MODEM_STANDBY_MIN_BATTERY) return MODEM_OFF;
+  uint32_t idleTime = lastUsesLen ? Hal::getEpoch() - lastUses[lastUsesLen - 1] : 0;
+  if (batteryLevel >= MODEM_SLEEP_MIN_BATTERY && getUseInterval() <= MODEM_SLEEP_USE_INTERVAL && idleTime < MODEM_SLEEP_TIMEOUT) {
+    return MODEM_SLEEP;
+  }
+  if (idleTime < MODEM_AIRPLANE_TIMEOUT) return MODEM_AIRPLANE;
+  return MODEM_OFF;
+}
+
+bool Network::wakeUart() {
   char resp[10]{};
-  while (Serial1.available()) Serial1.read();
-  Serial1.println("AT");
-  Serial1.flush();
-  return Utilities::readUntilResp("", resp, nullptr, 3);
+  for (uint8_t i = 0; i < 3; i++) {
+    atParser.clear();
+    Hal::modem().println("AT");
+    Hal::modem().flush();
+    if (!Utilities::readUntilResp("", resp, sizeof resp, nullptr, 150)) continue;
+    Hal::modem().println("AT+CSCLK=0");
+    Hal::modem().flush();
+    Utilities::readUntilResp("", resp, sizeof resp);
+    return true;
+  }
+  return false;
 }
 
-bool Network::setPowerOnAndWaitForReg(BLELocalDevice* BLE) {
-  unsigned long startTime = millis();
-  if (BLE) BLE->poll();
-  setPower(true);
-  if (!waitForPowerOn(BLE)) {
+void Network::setPowerState(ModemPowerState state, BLELocalDevice* BLE) {
+  if (state == powerState) return;
+  finishPendingRequest(BLE);
+  LOG_INFO(LOG_POWER, "Modem power state ");
+  LOG_INFO(LOG_POWER, powerState);
+  LOG_INFO(LOG_POWER, " -> ");
+  LOG_INFOLN(LOG_POWER, state);
+  if (state == MODEM_OFF) {
     setPower(false);
-    return false;
+    return;
+  }
+  if (powerState == MODEM_OFF) {
+    setPower(true);
+    if (state == MODEM_ACTIVE) return;
   }
-  int8_t regStatus = -1;
-  while (millis() < startTime + 30000) {
-    regStatus = getRegStatus(BLE);
-    if (regStatus == 5 || regStatus == 1) break;
-    if (BLE) Utilities::bleDelay(50, BLE);
-    else delay(50);
+  if (powerState == MODEM_BOOTING) {
+    if (!waitForPowerOn(BLE)) {
+      setPower(false);
+      return;
+    }
+  }
+  if (powerState == MODEM_SLEEP) {
+    if (!wakeUart()) {
+      LOG_WARNLN(LOG_POWER, "Module didn't wake, powering off");
+      setPower(false);
+      return;
+    }
+    powerState = MODEM_ACTIVE;
   }
-  if (regStatus != 5 && regStatus != 1) {
+
+  char resp[10]{};
+  if (state == MODEM_AIRPLANE) {
+    setFunMode(false);
+    // The bearer doesn't survive the radio turning off
+    isSessionOpen = false;
+    isSessionAuthSet = false;
+    lastStatus = -1;
+  } else {
+    if (powerState == MODEM_AIRPLANE) setFunMode(true);
+    if (state == MODEM_SLEEP) {
+      // Sleeps whenever the UART has been idle for a while, any character wakes it
+      Hal::modem().println("AT+CSCLK=2");
+      Hal::modem().flush();
+      Utilities::readUntilResp("", resp, sizeof resp);
+    }
+  }
+  powerState = state;
+}
+
+bool Network::wake(BLELocalDevice* BLE, bool needsRadio) {
+  if (powerState == MODEM_OFF || powerState == MODEM_BOOTING) {
+    setPower(true);
+    if (waitForPowerOn(BLE)) return true;
     setPower(false);
     return false;
   }
-  if (getAccTech(BLE) == -1) {
+  if (powerState == MODEM_SLEEP) {
+    if (!wakeUart()) {
+      LOG_WARNLN(LOG_POWER, "Module didn't wake, power cycling");
+      setPower(false);
+      return wake(BLE, needsRadio);
+    }
+    powerState = MODEM_ACTIVE;
+  }
+  if (powerState == MODEM_AIRPLANE && needsRadio) {
+    setFunMode(true);
+    powerState = MODEM_ACTIVE;
+  }
+  return true;
+}
+
+void Network::release(BLELocalDevice* BLE) {
+  if (isRequestActive()) return;
+  ModemPowerState state = getIdleState();
+  if (state < powerState) setPowerState(state, BLE);
+}
+
+void Network::updatePowerState(BLELocalDevice* BLE) {
+  // Only steps down from states release picked, active means something is still using it
+  if (powerState == MODEM_ACTIVE || powerState <= MODEM_BOOTING || isRequestActive()) return;
+  ModemPowerState state = getIdleState();
+  if (state < powerState) setPowerState(state, BLE);
+}
+
+bool Network::isPoweredOn() {
+  char resp[10]{};
+  atParser.clear();
+  Hal::modem().println("AT");
+  Hal::modem().flush();
+  return Utilities::readUntilResp("", resp, sizeof resp, nullptr, 3);
+}
+
+bool Network::setPowerOnAndWaitForReg(BLELocalDevice* BLE) {
+  finishPendingRequest(BLE);
+  unsigned long startTime = millis();
+  if (BLE) BLE->poll();
+  noteUse();
+  if (!wake(BLE)) return false;
+  if (!waitForReg(BLE, startTime)) {
     setPower(false);
     return false;
   }
-  Serial.print("Registered! Total Boot up time(ms): ");
-  Serial.println(millis() - startTime);
+#ifdef HUB_MODEM_DIAGNOSTICS
+  getAccTech(BLE);
+#endif
+  LOG_INFO(LOG_NETWORK, "Registered! Total Boot up time(ms): ");
+  LOG_INFOLN(LOG_NETWORK, millis() - startTime);
+  if (LOG_ENABLED(LOG_LEVEL_DEBUG, LOG_NETWORK)) regTimes.print(Log::out(LOG_LEVEL_DEBUG, LOG_NETWORK), "Time to register(ms)");
   if (BLE) BLE->poll();
   return true;
 }
@@ -1,29 +1,294 @@
 #ifndef HUB_NETWORK_H
 #define HUB_NETWORK_H
 
-#include <ArduinoBLE.h>
+#include <./hub/Hal.h>
 #include <ArduinoJson.h>
+#include <./hub/Histogram.h>
 
-// Needs to be large enough for error messages
+// Default capacity of the document returned by SendRequest, needs to be large enough for error messages
 const uint16_t RESPONSE_SIZE = 2000;
+// IMEI is 15 digits
+const uint8_t IMEI_SIZE = 16;
+
+// Between uses the module is kept registered but asleep until it's been idle this long (in seconds)
+const uint32_t MODEM_SLEEP_TIMEOUT = 10 * 60;
+// Then in airplane mode until it's been idle this long, and powered off after (in seconds)
+const uint32_t MODEM_AIRPLANE_TIMEOUT = 2 * 60 * 60;
+// Only worth staying registered if uses are at most this far apart on average (in seconds)
+const uint32_t MODEM_SLEEP_USE_INTERVAL = 15 * 60;
+// Battery percent needed to stay registered, and to stay powered at all between uses
+const uint8_t MODEM_SLEEP_MIN_BATTERY = 40;
+const uint8_t MODEM_STANDBY_MIN_BATTERY = 15;
+// Number of recent uses kept to work out how often the module is needed
+const uint8_t MODEM_USE_HISTORY = 4;
+// Uses closer together than this count as one, ie logging in then getting the hub id (in seconds)
+const uint32_t MODEM_USE_COALESCE = 60;
+
+/**
+ * Power states of the module from lowest current to highest, and slowest to fastest to send a request from
+ */
+enum ModemPowerState : uint8_t {
+  MODEM_OFF,      // SIM_MOSFET off, a request needs a full boot and registration
+  MODEM_BOOTING,  // SIM_MOSFET on but SMS Ready hasn't come yet, nothing but AT answers
+  MODEM_AIRPLANE, // AT+CFUN=4, booted but the radio is off so it needs to register
+  MODEM_SLEEP,    // AT+CSCLK=2, registered with the bearer open, the UART sleeps until it gets a character
+  MODEM_ACTIVE,   // Full functionality and awake
+};
+
+// Longest wait for the module to register after it's awake (in ms)
+const uint16_t REG_TIMEOUT = 30000;
+// Buckets of Network::regTimes (in ms), failures to register land in the last one
+const uint8_t REG_TIME_BUCKETS = 6;
+const uint16_t REG_TIME_BOUNDS[REG_TIME_BUCKETS] = { 1000, 2000, 5000, 10000, 20000, REG_TIMEOUT };
+// Numeric operator code, ie 310260, MCC plus a 2 or 3 digit MNC
+const uint8_t OPERATOR_CODE_SIZE = 7;
+
+// Largest range fetched by a single DownloadAsync, the module keeps the whole response in its RAM
+const uint32_t DOWNLOAD_RANGE_SIZE = 16384;
+// Bytes asked for with each AT+HTTPREAD=<offset>,<len> while downloading
+const uint16_t DOWNLOAD_READ_SIZE = 512;
+
+// Enough for a filter selecting a few fields, ie data.createEvent.id, plus the errors code added by SendRequest
+typedef StaticJsonDocument<192> ResponseFilter;
+
+/**
+ * Progress of a SendRequestAsync request, advanced by Network::tick
+ */
+enum RequestState : uint8_t {
+  REQUEST_IDLE,
+  REQUEST_POWERING,     // Waiting for the module to boot
+  REQUEST_REGISTERING,  // Waiting for the +CREG URC saying it's registered
+  REQUEST_BEARER,       // Opening the GPRS bearer and HTTP context
+  REQUEST_SENDING,      // Setting auth, writing the query and waiting for AT+HTTPACTION, or setting the URL and range of a download
+  REQUEST_READING,      // Reading and deserializing the body, or passing a download's body to its sink a window at a time
+  REQUEST_DONE,
+  REQUEST_FAILED,
+};
+
+/**
+ * Called once a SendRequestAsync request is done or failed, doc is only valid during the call
+ */
+typedef void (*RequestCallback)(bool success, JsonDocument& doc, void* context);
+
+/**
+ * Takes the next bytes of a DownloadAsync body in order, returning false stops the download
+ */
+typedef bool (*DownloadSink)(const uint8_t* data, size_t len, void* context);
+
+/**
+ * State of the request in flight, a single one at a time since they all share the module
+ */
+struct AsyncRequest {
+  uint8_t id = 0;
+  RequestState state = REQUEST_IDLE;
+  char* query = nullptr;
+  JsonDocument* filter = nullptr;
+  DynamicJsonDocument* doc = nullptr;
+  RequestCallback onComplete = nullptr;
+  void* context = nullptr;
+  BLELocalDevice* BLE = nullptr;
+  // Set for DownloadAsync, which fetches rangeLen bytes of url from rangeStart instead of sending query
+  const char* url = nullptr;
+  DownloadSink sink = nullptr;
+  uint32_t rangeStart = 0;
+  uint32_t rangeLen = 0;
+  // Bytes passed to sink, kept across attempts so a retry only fetches the rest
+  uint32_t downloaded = 0;
+  // Offset within the response of the next AT+HTTPREAD, past 0 if the server ignored the range
+  uint32_t bodyPos = 0;
+  uint16_t readLen = 0;
+  bool isSinkFailed = false;
+  // From the +HTTPACTION URC
+  uint16_t httpStatus = 0;
+  uint8_t attempt = 0;
+  // Index of the command being sent within the current state
+  uint8_t step = 0;
+  // If the command for step was sent and its result is pending
+  bool isWaiting = false;
+  bool isPoweredOn = false;
+  uint8_t wakeAttempts = 0;
+  bool isPrompted = false;
+  bool isQuerySent = false;
+  bool isActionDone = false;
+  bool isResettingSession = false;
+  int8_t regStatus = -1;
+  DeserializationError error = DeserializationError::EmptyInput;
+  unsigned long startTime = 0;
+  // When the command for step was sent
+  unsigned long commandTime = 0;
+  unsigned long deadline = 0;
+  // Next command isn't sent before this time
+  unsigned long resumeTime = 0;
+  char command[160]{};
+  char lenCommand[30]{};
+};
 
 typedef struct {
   char accessToken[100]{};
   boolean isValid = false;
 } TokenData;
 
+/**
+ * Operator the module last registered on after a cold boot, kept in flash to register on it directly next time
+ */
+typedef struct {
+  char operatorCode[OPERATOR_CODE_SIZE]{};
+  boolean isValid = false;
+} RegCache;
+
 class Network {
 private:
-  /**
-   * Static memory used for reading network response, might need to increase size if expecting larger responses
-  **/
-  char buffer[RESPONSE_SIZE]{};
-
   /**
    * Network registration status
    */
   int8_t lastStatus = -1;
 
+  /**
+   * Records status, printing it if it changed
+   */
+  void setRegStatus(int8_t status);
+
+  /**
+   * If +CREG URCs and the operator format are set up, they're lost when the module powers off
+   */
+  bool isRegConfigured = false;
+
+  /**
+   * Turns on +CREG URCs and asks for the cached operator, which returns once registered on it or any other
+   */
+  void configureReg(BLELocalDevice* BLE);
+
+  /**
+   * Waits for the module to register, returns false if it doesn't by startTime + REG_TIMEOUT
+   * Configures registration first after a cold boot, then caches the operator it registered on
+   */
+  bool waitForReg(BLELocalDevice* BLE, unsigned long startTime);
+
+  /**
+   * Caches the operator in info, the rest of a +COPS: line, in flash if it changed
+   */
+  void rememberOperator(const char* info);
+
+  void forgetOperator();
+
+  ModemPowerState powerState = MODEM_OFF;
+  // millis() when SIM_MOSFET was last turned on
+  unsigned long bootStartTime = 0;
+  // Percent, assumed full until setBatteryLevel is called
+  uint8_t batteryLevel = 100;
+
+  /**
+   * Epoch (in seconds) of the most recent uses, oldest first
+   */
+  uint32_t lastUses[MODEM_USE_HISTORY]{};
+  uint8_t lastUsesLen = 0;
+
+  void noteUse();
+
+  /**
+   * Average time between the recent uses (in seconds), UINT32_MAX if there haven't been 2 yet
+   */
+  uint32_t getUseInterval();
+
+  /**
+   * Sends AT until the UART wakes from AT+CSCLK=2 and turns it off, returns false if it never answers
+   */
+  bool wakeUart();
+
+  /**
+   * If the GPRS bearer and HTTP context are open, stays open for every request until the module is powered off
+   */
+  bool isSessionOpen = false;
+
+  /**
+   * If USERDATA was set on the open session, and the token it was set with
+   */
+  bool isSessionAuthSet = false;
+  char sessionAuthToken[100]{};
+
+  /**
+   * If the session's URL is API_URL, downloads point it elsewhere
+   */
+  bool isSessionUrlSet = false;
+
+  /**
+   * Sends a single command of a request and waits for OK or ERROR, returns true if OK
+   * AT+HTTPDATA writes query once DOWNLOAD is received
+   */
+  bool sendRequestCommand(const char* command, const char* query, BLELocalDevice* BLE);
+
+  /**
+   * Sends AT+HTTPREAD and deserializes the body straight from the modem into doc, keeping only what filter selects
+   */
+  DeserializationError readResponse(JsonDocument& doc, JsonDocument* filter, BLELocalDevice* BLE);
+
+  /**
+   * Opens the bearer and HTTP context and sets the parameters that don't change between requests
+   */
+  void openSession(BLELocalDevice* BLE);
+
+  /**
+   * Sets the Authorization header on the session, only if the token changed since it was last set
+   */
+  void setSessionAuth(BLELocalDevice* BLE);
+
+  /**
+   * Points the session back at API_URL, only if a download pointed it elsewhere
+   */
+  void setSessionUrl(BLELocalDevice* BLE);
+
+  /**
+   * Clears the access token if the response says it expired
+   */
+  void checkAuthErrors(JsonDocument& doc);
+
+  AsyncRequest request;
+  uint8_t lastRequestId = 0;
+
+  /**
+   * Replaces request with a new one and starts powering or sending it, returns its handle
+   */
+  uint8_t beginRequest(RequestCallback onComplete, void* context, BLELocalDevice* BLE, size_t capacity);
+
+  /**
+   * Passes an AT+HTTPREAD body to the download's sink, at most DOWNLOAD_READ_SIZE bytes
+   * The download moves past it once the sink takes it, whether or not the OK after it arrives
+   */
+  void readDownload(Stream& body, uint16_t len);
+
+  /**
+   * Steps of REQUEST_SENDING and REQUEST_READING for a DownloadAsync
+   */
+  void tickDownload();
+
+  enum CommandStatus : uint8_t {
+    COMMAND_PENDING,
+    COMMAND_OK,
+    COMMAND_ERROR,
+    COMMAND_TIMEOUT,
+  };
+
+  /**
+   * Sends command on the first call, then consumes whatever the module sent without waiting for more
+   * Returns COMMAND_PENDING until the result arrives or timeout (in ms) passes
+   * The URCs, prompts and body a request waits on are recorded in request along the way
+   */
+  CommandStatus runCommand(const char* command, uint16_t timeout);
+
+  void setRequestState(RequestState state);
+
+  /**
+   * Starts the next attempt from a fresh bearer, or fails the request once out of attempts
+   */
+  void retryRequest();
+
+  void finishRequest(bool success);
+
+  /**
+   * Runs the request in flight to completion, so a blocking call doesn't interleave its commands with it
+   */
+  void finishPendingRequest(BLELocalDevice* BLE);
+
 public:
   /**
    * Struct with mutatable token to access API_URL as Hub, set once registration is successful
@@ -37,8 +302,45 @@ public:
   /**
    * Sends a request containing query to API_URL, returns a json document with
    * response in the "data" field if no errors, otherwise errors will be in "errors"
+   * The HTTP session is opened on the first request and reused until CloseSession or setPower(false)
+   * If filter is provided only the fields it selects are kept, so capacity can be much smaller than RESPONSE_SIZE
+   * errors[].extensions.code is added to filter so an expired token is still detected
+  **/
+  DynamicJsonDocument SendRequest(char* query, BLELocalDevice* BLE, JsonDocument* filter = nullptr, size_t capacity = RESPONSE_SIZE);
+
+  /**
+   * Same as SendRequest, but returns right away and the request is advanced by calling tick from loop
+   * Powers on and registers the module if needed, onComplete is called with the response once done
+   * query and filter must stay valid until then
+   * Returns a handle for getRequestState, or 0 if another request is still in flight
+  **/
+  uint8_t SendRequestAsync(char* query, RequestCallback onComplete, void* context, BLELocalDevice* BLE, JsonDocument* filter = nullptr, size_t capacity = RESPONSE_SIZE);
+
+  /**
+   * Fetches length bytes of url starting at offset with a ranged GET, at most DOWNLOAD_RANGE_SIZE
+   * The body is passed to sink as it's read and onComplete is called once all of it was, doc is always empty
+   * Powers on and registers the module like SendRequestAsync, url must stay valid until onComplete
+   * Returns a handle for getRequestState, or 0 if another request is still in flight
   **/
-  DynamicJsonDocument SendRequest(char* query, BLELocalDevice* BLE);
+  uint8_t DownloadAsync(const char* url, uint32_t offset, uint32_t length, DownloadSink sink, RequestCallback onComplete, void* context, BLELocalDevice* BLE);
+
+  /**
+   * Advances the request in flight, only handles what the module already sent so it returns in a few ms
+   * Reading the body is the exception, it's parsed as it arrives so waits for the rest of it
+   */
+  void tick();
+
+  /**
+   * State of the request with handle, REQUEST_IDLE if it's unknown
+   */
+  RequestState getRequestState(uint8_t handle);
+
+  bool isRequestActive() { return request.state > REQUEST_IDLE && request.state < REQUEST_DONE; }
+
+  /**
+   * Terminates the HTTP context and closes the bearer if a session is open
+   */
+  void CloseSession(BLELocalDevice* BLE);
 
   /**
    * Utility function to set AT+CFUN=1 or 4 (1 = full, 4 = airplane mode)
@@ -46,7 +348,7 @@ public:
   void setFunMode(bool fullFunctionality);
 
   /**
-   * Gets IMEI string from the SIM module and stores it into provided buffer
+   * Gets IMEI string from the SIM module and stores it into provided buffer of at least IMEI_SIZE
    * returns false if timed out
   **/
   bool GetImei(char* imeiBuffer);
@@ -70,6 +372,7 @@ public:
 
   /**
    * Can be called after getRegStatus returns 1 or 5 to read the access tech
+   * Costs 3 commands, so it's only called on registering with HUB_MODEM_DIAGNOSTICS
    * 0 - GSM
    * 2 - UTRAN
    * 3 - GSM w/EGPRS
@@ -86,16 +389,62 @@ public:
 
   /**
    * Wait until receiving the power on messages from the sim module
-   * Returns true if powered on, false if timed out
+   * Returns true if powered on, false if timed out, a booting module is active after it
    * If BLE is provided, it will poll as it waits
    */
   bool waitForPowerOn(BLELocalDevice* BLE = nullptr);
 
   /**
    * Set the power on or off for the SIMCOM module
+   * Powering on does nothing if it's already powered in a lower power state, see wake for that
+   * Powering off fails the request in flight
    */
   void setPower(bool on);
 
+  ModemPowerState getPowerState() { return powerState; }
+
+  /**
+   * Powers the module on if it's off and checks whether it's done booting, without waiting for it
+   * Meant to be called every loop until it returns true, powers it back off if it never finishes
+   */
+  bool pollBooted();
+
+  /**
+   * Moves the module to state, waking it first if needed
+   * MODEM_ACTIVE from MODEM_OFF is the same as setPower(true) and leaves it booting, the other states wait for it to boot first
+   */
+  void setPowerState(ModemPowerState state, BLELocalDevice* BLE = nullptr);
+
+  /**
+   * Brings the module to MODEM_ACTIVE from whichever state it's in, waiting for it to boot if it was off
+   * If needsRadio is false, airplane mode is kept since only the UART is needed, ie for GPS
+   * Returns false if it never answered
+   */
+  bool wake(BLELocalDevice* BLE = nullptr, bool needsRadio = true);
+
+  /**
+   * Done with the module for now, moves it to the state getIdleState picks instead of powering it off
+   */
+  void release(BLELocalDevice* BLE = nullptr);
+
+  /**
+   * Lowest latency state that's worth its current given how often the module has been used recently,
+   * how long it's been idle, and the battery level
+   */
+  ModemPowerState getIdleState();
+
+  /**
+   * Steps an idle module down to getIdleState as time passes, call from loop
+   */
+  void updatePowerState(BLELocalDevice* BLE = nullptr);
+
+  void setBatteryLevel(uint8_t percent) { batteryLevel = percent; }
+
+  /**
+   * Time from waking the module until it registered, for every wake since boot
+   */
+  Histogram<REG_TIME_BUCKETS> regTimes{REG_TIME_BOUNDS};
+
   /**
    * We can't cache the power state of the module since it can change state separately
    * So this does a quick <100ms query to see if the module is attached and powered
@@ -103,7 +452,7 @@ public:
   bool isPoweredOn();
 
   /**
-   * Shorthand for calling setPower(true), waitForPowerOn, and getRegStatus until registered
+   * Shorthand for calling wake, and getRegStatus until registered
    * If BLE is provided, it will poll as it waits
    */
   bool setPowerOnAndWaitForReg(BLELocalDevice* BLE = nullptr);
@@ -0,0 +1,119 @@
+#include <./hub/Ota.h>
+
+uint16_t OtaTransfer::expectedLength(uint16_t seq) const {
+  uint32_t offset = sessionStart + (uint32_t)seq * chunkSize;
+  if (offset >= length) return 0;
+  return min((uint32_t)chunkSize, length - offset);
+}
+
+void OtaTransfer::drain() {
+  while (received & 1) {
+    uint8_t slot = nextSeq % OTA_WINDOW_SIZE;
+    if (!sink(window[slot], windowLens[slot])) return;
+    written += windowLens[slot];
+    nextSeq++;
+    unacked++;
+    received >>= 1;
+  }
+}
+
+uint32_t OtaTransfer::start(uint32_t length, uint16_t chunkSize, bool (*sink)(const uint8_t* data, size_t len)) {
+  if (!canResume(length)) {
+    this->length = length;
+    written = 0;
+  }
+  this->sink = sink;
+  this->chunkSize = constrain(chunkSize, 1, OTA_MAX_CHUNK);
+  sessionStart = written;
+  nextSeq = 0;
+  received = 0;
+  unacked = 0;
+  isAckForced = false;
+  lastReceiveTime = lastAckTime = millis();
+  isOpen = true;
+  return written;
+}
+
+bool OtaTransfer::receive(const uint8_t* packet, size_t len, unsigned long now) {
+  if (!isOpen || len <= OTA_HEADER_SIZE) return false;
+  lastReceiveTime = now;
+  uint16_t seq = packet[0] | packet[1] << 8;
+  const uint8_t* data = packet + OTA_HEADER_SIZE;
+  uint16_t dataLen = len - OTA_HEADER_SIZE;
+  uint16_t ahead = seq - nextSeq;
+  // Already taken, or too far ahead, either way the phone is missing an ack
+  if (ahead >= OTA_WINDOW_SIZE || dataLen != expectedLength(seq)) {
+    isAckForced = true;
+    return false;
+  }
+  // A gap just opened
+  if (ahead > 0 && !(received >> 1)) isAckForced = true;
+  uint8_t slot = seq % OTA_WINDOW_SIZE;
+  memcpy(window[slot], data, dataLen);
+  windowLens[slot] = dataLen;
+  received |= 1 << ahead;
+  drain();
+  return true;
+}
+
+bool OtaTransfer::isAckDue(unsigned long now) const {
+  if (!isOpen) return false;
+  if (unacked >= OTA_ACK_EVERY || isAckForced) return true;
+  // The last chunk doesn't wait for the rest of an ACK_EVERY batch
+  if (written == length) return unacked > 0;
+  // Repeated while nothing arrives, so the phone hears about chunks lost at the end of what it sent
+  return now - lastReceiveTime >= OTA_ACK_DELAY && now - lastAckTime >= OTA_ACK_DELAY;
+}
+
+void OtaTransfer::writeAck(uint8_t* out, unsigned long now) {
+  out[0] = nextSeq & 0xFF;
+  out[1] = nextSeq >> 8;
+  // Bit 0 is nextSeq itself, the phone doesn't resend it if it's only waiting for the sink
+  out[2] = received >> 1;
+  unacked = 0;
+  isAckForced = false;
+  lastAckTime = now;
+}
+
+void OtaWriter::commitRow(uint16_t len) {
+  for (uint16_t i = 0; i < len; i++) storage.write(rows[commitPos + i]);
+  commitPos = (commitPos + OTA_ROW_SIZE) % sizeof rows;
+  buffered -= len;
+}
+
+bool OtaWriter::open(uint32_t length, uint32_t expectedCrc) {
+  fillPos = commitPos = buffered = 0;
+  crc = Crc32::INITIAL;
+  this->expectedCrc = expectedCrc;
+  return storage.open(length);
+}
+
+bool OtaWriter::write(const uint8_t* data, size_t len) {
+  if (sizeof rows - buffered < len) return false;
+  crc = Crc32::update(crc, data, len);
+  // May wrap around to the first row
+  size_t firstLen = min(len, sizeof rows - fillPos);
+  memcpy(rows + fillPos, data, firstLen);
+  memcpy(rows, data + firstLen, len - firstLen);
+  fillPos = (fillPos + len) % sizeof rows;
+  buffered += len;
+  return true;
+}
+
+bool OtaWriter::commit() {
+  if (buffered < OTA_ROW_SIZE) return false;
+  commitRow(OTA_ROW_SIZE);
+  return true;
+}
+
+bool OtaWriter::close() {
+  while (commit());
+  if (buffered > 0) commitRow(buffered);
+  storage.close();
+  return getCrc() == expectedCrc;
+}
+
+void OtaWriter::abort() {
+  fillPos = commitPos = buffered = 0;
+  storage.close();
+}
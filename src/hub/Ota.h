@@ -0,0 +1,155 @@
+#ifndef HUB_OTA_H
+#define HUB_OTA_H
+
+#include <Arduino.h>
+#include <ArduinoOTA.h>
+#include <./hub/Crc32.h>
+
+// Each chunk the phone writes is a seq (LE) followed by the data, the whole thing fits in transferChar
+const uint8_t OTA_HEADER_SIZE = 2;
+const uint16_t OTA_MAX_CHUNK = 248;
+// Chunks the phone may have in flight past the next expected one, each takes OTA_MAX_CHUNK of RAM to hold out of order
+const uint8_t OTA_WINDOW_SIZE = 8;
+// An ack is sent once this many chunks were written since the last one
+const uint8_t OTA_ACK_EVERY = OTA_WINDOW_SIZE / 2;
+// And every this long while nothing arrives before the transfer is complete (ms)
+const uint16_t OTA_ACK_DELAY = 100;
+// Next expected seq (LE), then a bit for each of the OTA_WINDOW_SIZE - 1 seqs after it that already arrived
+const uint8_t OTA_ACK_SIZE = 3;
+// Flash row on the SAMD21, storage is erased by the row and programmed a page (64 bytes) at a time
+const uint16_t OTA_ROW_SIZE = 256;
+const uint8_t OTA_PAGE_SIZE = 64;
+// Where the running sketch starts in flash, past the 8KB bootloader, InternalStorage.apply copies updates there
+const uint32_t SKETCH_START = 0x2000;
+// One row is committed while the next fills, together they hold at least a whole chunk
+const uint8_t OTA_ROW_BUFFERS = 2;
+
+static_assert(OTA_ROW_SIZE * (OTA_ROW_BUFFERS - 1) >= OTA_MAX_CHUNK, "A chunk has to fit while a row waits to be committed");
+
+/**
+ * Buffers the update into whole rows so storage is written a row at a time from loop, outside the BLE callbacks,
+ * and keeps a CRC32 of everything written so a corrupt image is never applied
+ */
+class OtaWriter {
+private:
+  OTAStorage& storage;
+  uint8_t rows[OTA_ROW_BUFFERS * OTA_ROW_SIZE];
+  // Ring over rows, commits always start on a row boundary
+  uint16_t fillPos = 0;
+  uint16_t commitPos = 0;
+  uint16_t buffered = 0;
+  uint32_t crc = Crc32::INITIAL;
+  uint32_t expectedCrc = 0;
+
+  void commitRow(uint16_t len);
+
+public:
+  OtaWriter(OTAStorage& storage) : storage(storage) {}
+
+  /**
+   * Opens storage for length bytes, the image has to match expectedCrc to be applied
+   */
+  bool open(uint32_t length, uint32_t expectedCrc);
+
+  /**
+   * Copies data in unless there isn't room for all of it, returns false then so it can be offered again after commit
+   */
+  bool write(const uint8_t* data, size_t len);
+
+  /**
+   * Writes a full row to storage if there is one, returns true if it did
+   */
+  bool commit();
+
+  /**
+   * Writes whatever is left and closes storage, returns true if the image matches the expected CRC
+   */
+  bool close();
+
+  /**
+   * Drops anything buffered and closes storage, for a transfer that won't be resumed
+   */
+  void abort();
+
+  /**
+   * Bytes write can take right now
+   */
+  size_t room() const { return sizeof rows - buffered; }
+
+  uint32_t getCrc() const { return Crc32::finish(crc); }
+
+  uint32_t getExpectedCrc() const { return expectedCrc; }
+};
+
+/**
+ * Receiving end of the windowed firmware transfer over transferChar
+ * The phone writes chunks without response, up to OTA_WINDOW_SIZE past the last cumulative ack,
+ * and resends the ones an ack's bitmap shows missing. Chunks wait in the window until the sink takes them in order,
+ * so a sink that's full holds back the cumulative ack and with it the phone
+ * A transfer interrupted by a disconnect resumes from the bytes the sink already took
+ */
+class OtaTransfer {
+private:
+  bool (*sink)(const uint8_t* data, size_t len) = nullptr;
+  uint32_t length = 0;
+  // Bytes the sink took so far, seq 0 of the current session starts here
+  uint32_t written = 0;
+  uint32_t sessionStart = 0;
+  uint16_t chunkSize = 0;
+  uint16_t nextSeq = 0;
+  uint8_t window[OTA_WINDOW_SIZE][OTA_MAX_CHUNK];
+  uint16_t windowLens[OTA_WINDOW_SIZE]{};
+  // Bit i is set if seq nextSeq + i is in the window
+  uint8_t received = 0;
+  uint8_t unacked = 0;
+  // A gap just opened, so the phone should hear about it right away
+  bool isAckForced = false;
+  unsigned long lastReceiveTime = 0;
+  unsigned long lastAckTime = 0;
+  bool isOpen = false;
+
+  /**
+   * Length chunk seq has to be, only the last chunk of the file is shorter
+   */
+  uint16_t expectedLength(uint16_t seq) const;
+
+
+public:
+  /**
+   * True if a transfer of length was interrupted, so start picks up where it left off
+   */
+  bool canResume(uint32_t length) const { return isOpen && this->length == length && written < length; }
+
+  /**
+   * Starts a transfer of length bytes in chunks of chunkSize, or resumes an interrupted one (see canResume)
+   * Returns the offset the phone should send from, which seq 0 refers to
+   */
+  uint32_t start(uint32_t length, uint16_t chunkSize, bool (*sink)(const uint8_t* data, size_t len));
+
+  /**
+   * Handles a chunk written by the phone, returns false if it doesn't belong in the window
+   */
+  bool receive(const uint8_t* packet, size_t len, unsigned long now);
+
+  /**
+   * Passes the chunks that are next to the sink until it's out of room, also done by receive
+   */
+  void drain();
+
+  bool isAckDue(unsigned long now) const;
+
+  /**
+   * Writes OTA_ACK_SIZE bytes to notify the phone with
+   */
+  void writeAck(uint8_t* out, unsigned long now);
+
+  bool isActive() const { return isOpen; }
+
+  bool isComplete() const { return isOpen && written == length; }
+
+  uint32_t getWritten() const { return written; }
+
+  void end() { isOpen = false; }
+};
+
+#endif
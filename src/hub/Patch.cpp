@@ -0,0 +1,138 @@
+#include <./hub/Patch.h>
+#include <./hub/Log.h>
+
+void PatchDecoder::fail(const char* reason) {
+  LOG_ERROR(LOG_OTA, "Patch failed: ");
+  LOG_ERRORLN(LOG_OTA, reason);
+  state = STATE_FAILED;
+  inputPos = inputLen = 0;
+}
+
+bool PatchDecoder::readHeader() {
+  uint32_t fields[4];
+  memcpy(fields, header, sizeof fields);
+  if (fields[0] != PATCH_MAGIC) {
+    fail("not a patch");
+    return false;
+  }
+  oldSize = fields[1];
+  newSize = fields[3];
+  if (newSize != expectedNewSize) {
+    fail("wrong size");
+    return false;
+  }
+  // Past the first storage row the running image isn't the one it was built from
+  if (oldSize > maxOldSize) {
+    fail("old image reaches into storage");
+    return false;
+  }
+  // Made against another build, applying it would produce garbage
+  if (Crc32::finish(Crc32::update(Crc32::INITIAL, oldImage, oldSize)) != fields[2]) {
+    fail("running image doesn't match");
+    return false;
+  }
+  return true;
+}
+
+void PatchDecoder::startOp() {
+  if (op == PATCH_SEEK) {
+    int32_t offset = (int32_t)(varint >> 1) ^ -(int32_t)(varint & 1);
+    if ((offset < 0 && (uint32_t)-offset > oldPos) || oldPos + offset > oldSize) {
+      fail("seek out of range");
+      return;
+    }
+    oldPos += offset;
+    state = STATE_OP;
+    return;
+  }
+  if (varint > newSize - produced || (op != PATCH_INSERT && varint > oldSize - oldPos)) {
+    fail("op out of range");
+    return;
+  }
+  remaining = varint;
+  state = remaining > 0 ? STATE_DATA : STATE_OP;
+}
+
+bool PatchDecoder::writeData() {
+  size_t len = min((size_t)remaining, writer.room());
+  // ADD and INSERT bytes come from the chunk held
+  if (op != PATCH_COPY) len = min(len, (size_t)(inputLen - inputPos));
+  if (len == 0) return false;
+  if (op == PATCH_INSERT) {
+    writer.write(input + inputPos, len);
+  } else {
+    uint8_t out[OTA_MAX_CHUNK];
+    len = min(len, sizeof out);
+    for (size_t i = 0; i < len; i++) {
+      out[i] = oldImage[oldPos + i];
+      if (op == PATCH_ADD) out[i] += input[inputPos + i];
+    }
+    writer.write(out, len);
+    oldPos += len;
+  }
+  if (op != PATCH_COPY) inputPos += len;
+  produced += len;
+  remaining -= len;
+  if (remaining == 0) state = STATE_OP;
+  return true;
+}
+
+void PatchDecoder::begin(uint32_t newSize, uint32_t maxOldSize) {
+  expectedNewSize = newSize;
+  this->maxOldSize = maxOldSize;
+  state = STATE_HEADER;
+  headerLen = 0;
+  inputPos = inputLen = 0;
+  oldPos = produced = 0;
+}
+
+bool PatchDecoder::write(const uint8_t* data, size_t len) {
+  if (state == STATE_FAILED) return true;
+  if (inputPos < inputLen || len > sizeof input) return false;
+  memcpy(input, data, len);
+  inputLen = len;
+  inputPos = 0;
+  pump();
+  return true;
+}
+
+void PatchDecoder::pump() {
+  while (state != STATE_FAILED) {
+    if (state == STATE_DATA) {
+      if (!writeData()) return;
+      continue;
+    }
+    if (state == STATE_OP && produced == newSize) state = STATE_DONE;
+    if (inputPos == inputLen) return;
+    uint8_t byte = input[inputPos++];
+    switch (state) {
+      case STATE_HEADER:
+        header[headerLen++] = byte;
+        if (headerLen == PATCH_HEADER_SIZE && readHeader()) state = STATE_OP;
+        break;
+      case STATE_OP:
+        if (byte > PATCH_SEEK) {
+          fail("unknown op");
+          break;
+        }
+        op = (PatchOp)byte;
+        varint = 0;
+        varintShift = 0;
+        state = STATE_VARINT;
+        break;
+      case STATE_VARINT:
+        if (varintShift > 28) {
+          fail("varint too long");
+          break;
+        }
+        varint |= (uint32_t)(byte & 0x7F) << varintShift;
+        varintShift += 7;
+        if (!(byte & 0x80)) startOp();
+        break;
+      default:
+        // Anything past the end of the new image
+        fail("trailing bytes");
+        break;
+    }
+  }
+}
@@ -0,0 +1,109 @@
+#ifndef HUB_PATCH_H
+#define HUB_PATCH_H
+
+#include <Arduino.h>
+#include <./hub/Ota.h>
+
+/**
+ * Patch format, little endian:
+ * header: "HDP1", size of the old image, CRC32 of the old image, size of the new image (uint32 each)
+ * then ops until the new image is complete, each a byte followed by a varint (7 bits a byte, low first):
+ *   COPY len        copies len bytes of the old image from the old position, which moves past them
+ *   ADD len, bytes  like COPY but adds each byte to the old one, bsdiff's diff block
+ *   INSERT len, bytes  writes the bytes as is, bsdiff's extra block
+ *   SEEK offset     moves the old position by offset, zigzag encoded so it can go back
+ * So a bsdiff control triple becomes ADD, INSERT, SEEK, and unchanged stretches become a single COPY
+ * The old image only runs up to its first HUB_FLASH_STORAGE row (the lowest of their symbols in the build's map),
+ * since the rows change as the hub runs, so the CRC32 and COPY/ADD never cover them and the rest is INSERTed
+ */
+const uint8_t PATCH_HEADER_SIZE = 16;
+// HDP1 read as a little endian uint32
+const uint32_t PATCH_MAGIC = 0x31504448;
+
+enum PatchOp : uint8_t {
+  PATCH_COPY,
+  PATCH_ADD,
+  PATCH_INSERT,
+  PATCH_SEEK,
+};
+
+/**
+ * Applies a patch to the running image as it streams in, writing the new image to an OtaWriter
+ * Holds one chunk of the patch at a time, so RAM use doesn't depend on the size of either image
+ */
+class PatchDecoder {
+private:
+  enum State : uint8_t {
+    STATE_HEADER,
+    STATE_OP,
+    STATE_VARINT,
+    STATE_DATA,
+    STATE_DONE,
+    STATE_FAILED,
+  };
+
+  OtaWriter& writer;
+  // The running image, memory mapped flash
+  const uint8_t* oldImage;
+  uint32_t maxOldSize = 0;
+
+  uint8_t input[OTA_MAX_CHUNK];
+  uint16_t inputLen = 0;
+  uint16_t inputPos = 0;
+
+  State state = STATE_HEADER;
+  uint8_t header[PATCH_HEADER_SIZE];
+  uint8_t headerLen = 0;
+  PatchOp op = PATCH_COPY;
+  uint32_t varint = 0;
+  uint8_t varintShift = 0;
+  // Bytes left in the current COPY, ADD or INSERT
+  uint32_t remaining = 0;
+
+  uint32_t oldSize = 0;
+  uint32_t oldPos = 0;
+  uint32_t newSize = 0;
+  uint32_t expectedNewSize = 0;
+  uint32_t produced = 0;
+
+  void fail(const char* reason);
+
+  bool readHeader();
+
+  void startOp();
+
+  /**
+   * Writes as much of the current op as the writer has room for, returns false once it's out of room
+   */
+  bool writeData();
+
+public:
+  PatchDecoder(OtaWriter& writer, const uint8_t* oldImage) : writer(writer), oldImage(oldImage) {}
+
+  /**
+   * Starts a patch that has to produce an image of newSize from an old one of at most maxOldSize,
+   * which has to end before the first storage row of the running image
+   */
+  void begin(uint32_t newSize, uint32_t maxOldSize);
+
+  /**
+   * Takes the next chunk of the patch, false while the last one is still being applied
+   */
+  bool write(const uint8_t* data, size_t len);
+
+  /**
+   * Applies what it holds until it runs out or the writer is full, call from loop after OtaWriter::commit
+   */
+  void pump();
+
+  bool isDone() const { return state == STATE_DONE; }
+
+  bool isFailed() const { return state == STATE_FAILED; }
+
+  /**
+   * Nothing left to apply of what it was given
+   */
+  bool isIdle() const { return inputPos == inputLen && (state != STATE_DATA || op != PATCH_COPY); }
+};
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef HUB_QUERIES_H
+#define HUB_QUERIES_H
+
+#include <./hub/GraphQL.h>
+#include <./hub/Uploads.h>
+
+// BLE address, ie 12:34:56:78:9a:bc
+typedef GraphQL::String<17> SerialVar;
+
+constexpr GraphQL::Template<GraphQL::Int, SerialVar, GraphQL::String<IMEI_SIZE - 1>> LOGIN_AS_HUB(
+  "{\"query\":\"mutation loginAsHub{loginAsHub(userId:$, serial:$, imei:$)}\",\"variables\":{}}");
+
+constexpr GraphQL::Template<SerialVar> CREATE_SENSOR(
+  "{\"query\":\"mutation createSensor{createSensor(doorColumn: 0, doorRow: 0, isOpen: false, isConnected: true, serial:$){id}}\",\"variables\":{}}");
+
+/**
+ * Fields for the upload queue, it wraps them in the mutation and passes the values as variables
+ */
+constexpr GraphQL::Template<SerialVar> CREATE_EVENT("createEvent(serial:$){ id }");
+
+// volts (the raw ADC average, ~725-845, see getBatteryLevel), percent
+constexpr GraphQL::Template<GraphQL::Float<4, 2>, GraphQL::Float<3, 2>> UPDATE_HUB_BATTERY_LEVEL(
+  "updateHubBatteryLevel(volts:$,percent:$){ id }");
+
+/**
+ * Start of the command timings request, followed by CommandTimings::writeJson and }}
+ */
+const char* const UPDATE_HUB_COMMAND_TIMINGS =
+  "{\"query\":\"mutation updateHubCommandTimings($timings:[[Int!]!]!){updateHubCommandTimings(timings:$timings){ id }}\",\"variables\":{\"timings\":";
+
+/**
+ * Start of the location track request, followed by Track::writeJson and }}
+ */
+const char* const CREATE_LOCATION_TRACK =
+  "{\"query\":\"mutation createLocationTrack($track:String!){createLocationTrack(track:$track){ count }}\",\"variables\":{\"track\":";
+
+static_assert(CREATE_EVENT.maxReferencesLength(UPLOAD_ALIAS_LEN) < UPLOAD_FIELDS_SIZE, "createEvent doesn't fit in an upload");
+static_assert(UPDATE_HUB_BATTERY_LEVEL.maxReferencesLength(UPLOAD_ALIAS_LEN) < UPLOAD_FIELDS_SIZE, "updateHubBatteryLevel doesn't fit in an upload");
+
+#endif
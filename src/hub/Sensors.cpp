@@ -0,0 +1,108 @@
+#include <./hub/Sensors.h>
+#include <./hub/Hal.h>
+
+HUB_FLASH_STORAGE(flashSensorRoster, SensorRoster);
+
+uint8_t KnownSensors::lowerBound(const uint8_t mac[MAC_SIZE]) const {
+  uint8_t low = 0;
+  uint8_t high = sensorsLen;
+  while (low < high) {
+    uint8_t mid = (low + high) / 2;
+    if (memcmp(sensors[mid].mac, mac, MAC_SIZE) < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+bool KnownSensors::parseMac(const char* str, uint8_t mac[MAC_SIZE]) {
+  if (!str || strlen(str) != MAC_STR_LEN) return false;
+  for (uint8_t i = 0; i < MAC_SIZE; i++) {
+    const char* pos = str + i * 3;
+    if (!isxdigit(pos[0]) || !isxdigit(pos[1])) return false;
+    if (i < MAC_SIZE - 1 && pos[2] != ':') return false;
+    char hex[3] = {pos[0], pos[1], '\0'};
+    mac[i] = strtoul(hex, NULL, 16);
+  }
+  return true;
+}
+
+void KnownSensors::formatMac(const uint8_t mac[MAC_SIZE], char* out) {
+  sprintf(out, "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+KnownSensor* KnownSensors::find(const uint8_t mac[MAC_SIZE]) {
+  uint8_t idx = lowerBound(mac);
+  if (idx == sensorsLen || memcmp(sensors[idx].mac, mac, MAC_SIZE) != 0) return nullptr;
+  return &sensors[idx];
+}
+
+KnownSensor* KnownSensors::find(const char* address) {
+  uint8_t mac[MAC_SIZE];
+  if (!parseMac(address, mac)) return nullptr;
+  return find(mac);
+}
+
+KnownSensor* KnownSensors::add(const uint8_t mac[MAC_SIZE]) {
+  uint8_t idx = lowerBound(mac);
+  if (idx < sensorsLen && memcmp(sensors[idx].mac, mac, MAC_SIZE) == 0) return &sensors[idx];
+  if (sensorsLen == KNOWN_SENSORS_SIZE) return nullptr;
+  memmove(&sensors[idx + 1], &sensors[idx], (sensorsLen - idx) * sizeof(KnownSensor));
+  sensorsLen++;
+  KnownSensor& sensor = sensors[idx];
+  memcpy(sensor.mac, mac, MAC_SIZE);
+  sensor.eventCount = 0;
+  sensor.ringEventCount = 0;
+  sensor.hasEventCount = false;
+  return &sensor;
+}
+
+KnownSensor* KnownSensors::add(const char* address) {
+  uint8_t mac[MAC_SIZE];
+  if (!parseMac(address, mac)) return nullptr;
+  return add(mac);
+}
+
+bool KnownSensors::load() {
+  SensorRoster roster = flashSensorRoster.read();
+  if (!roster.isValid) return false;
+  sensorsLen = 0;
+  for (uint8_t i = 0; i < roster.macsLen && i < KNOWN_SENSORS_SIZE; i++) add(roster.macs[i]);
+  return true;
+}
+
+void KnownSensors::save() {
+  SensorRoster roster = flashSensorRoster.read();
+  bool isSame = roster.isValid && roster.macsLen == sensorsLen;
+  for (uint8_t i = 0; isSame && i < sensorsLen; i++) {
+    isSame = memcmp(roster.macs[i], sensors[i].mac, MAC_SIZE) == 0;
+  }
+  if (isSame) return;
+  memset(roster.macs, 0, sizeof roster.macs);
+  for (uint8_t i = 0; i < sensorsLen; i++) memcpy(roster.macs[i], sensors[i].mac, MAC_SIZE);
+  roster.macsLen = sensorsLen;
+  roster.isValid = true;
+  flashSensorRoster.write(roster);
+}
+
+bool KnownSensors::sync(const uint8_t macs[][MAC_SIZE], uint8_t macsLen) {
+  uint8_t keptLen = 0;
+  for (uint8_t i = 0; i < sensorsLen; i++) {
+    bool isListed = false;
+    for (uint8_t j = 0; j < macsLen && !isListed; j++) {
+      isListed = memcmp(sensors[i].mac, macs[j], MAC_SIZE) == 0;
+    }
+    // Still sorted after removing some
+    if (isListed) sensors[keptLen++] = sensors[i];
+  }
+  bool isChanged = keptLen != sensorsLen;
+  sensorsLen = keptLen;
+  for (uint8_t i = 0; i < macsLen; i++) {
+    uint8_t lenBefore = sensorsLen;
+    add(macs[i]);
+    isChanged |= sensorsLen != lenBefore;
+  }
+  return isChanged;
+}
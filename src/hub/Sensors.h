@@ -0,0 +1,89 @@
+#ifndef HUB_SENSORS_H
+#define HUB_SENSORS_H
+
+#include <Arduino.h>
+
+const uint8_t MAC_SIZE = 6;
+// Length of a MAC as text, ie 12:34:56:78:9a:bc
+const uint8_t MAC_STR_LEN = 17;
+const uint8_t KNOWN_SENSORS_SIZE = 64;
+
+/**
+ * MACs of the known sensors, kept in flash so they're known at boot without the network
+ */
+typedef struct {
+  uint8_t macs[KNOWN_SENSORS_SIZE][MAC_SIZE]{};
+  uint8_t macsLen = 0;
+  boolean isValid = false;
+} SensorRoster;
+
+struct KnownSensor {
+  uint8_t mac[MAC_SIZE];
+  // Presses the hub has queued an event for, counted like the sensor's, only valid once it's been seen since boot
+  uint16_t eventCount;
+  // eventCount when its ring was last read and acknowledged
+  uint16_t ringEventCount;
+  bool hasEventCount;
+};
+
+/**
+ * Sensors paired to this hub, kept sorted by MAC so lookups are a binary search
+ * Fixed size with no heap use, at 12 bytes a sensor
+ */
+class KnownSensors {
+private:
+  KnownSensor sensors[KNOWN_SENSORS_SIZE];
+  uint8_t sensorsLen = 0;
+
+  /**
+   * Index of the first sensor with a MAC not less than mac, sensorsLen if there isn't one
+   */
+  uint8_t lowerBound(const uint8_t mac[MAC_SIZE]) const;
+
+public:
+  /**
+   * Parses a MAC like 12:34:56:78:9a:bc in either case, returns false if it isn't one
+   */
+  static bool parseMac(const char* str, uint8_t mac[MAC_SIZE]);
+
+  /**
+   * Writes mac as lowercase text like BLEDevice::address, out needs room for MAC_STR_LEN + 1
+   */
+  static void formatMac(const uint8_t mac[MAC_SIZE], char* out);
+
+  /**
+   * nullptr if it isn't known
+   */
+  KnownSensor* find(const uint8_t mac[MAC_SIZE]);
+  KnownSensor* find(const char* address);
+
+  /**
+   * Adds mac if it isn't known yet, returns the sensor or nullptr if the table is full
+   */
+  KnownSensor* add(const uint8_t mac[MAC_SIZE]);
+  KnownSensor* add(const char* address);
+
+  uint8_t length() const { return sensorsLen; }
+
+  const KnownSensor& operator[](uint8_t idx) const { return sensors[idx]; }
+
+  void clear() { sensorsLen = 0; }
+
+  /**
+   * Replaces the table with the roster saved in flash, returns false if there isn't one yet
+   */
+  bool load();
+
+  /**
+   * Saves the table to flash, only written if it's different to spare the flash
+   */
+  void save();
+
+  /**
+   * Makes the table match macs from the server, keeping the state of sensors already known
+   * Returns true if anything was added or removed
+   */
+  bool sync(const uint8_t macs[][MAC_SIZE], uint8_t macsLen);
+};
+
+#endif
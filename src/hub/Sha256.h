@@ -0,0 +1,25 @@
+#ifndef HUB_SHA256_H
+#define HUB_SHA256_H
+
+#include <Arduino.h>
+
+const uint8_t SHA256_SIZE = 32;
+
+namespace Sha256 {
+  /**
+   * Hashes len bytes of data into digest
+   */
+  void hash(const uint8_t* data, size_t len, uint8_t digest[SHA256_SIZE]);
+
+  /**
+   * Writes digest as 64 lowercase hex characters plus a null terminator
+   */
+  void toHex(const uint8_t digest[SHA256_SIZE], char* out);
+
+  /**
+   * Reads 64 hex characters into digest, returns false if hex isn't that
+   */
+  bool fromHex(const char* hex, uint8_t digest[SHA256_SIZE]);
+}
+
+#endif
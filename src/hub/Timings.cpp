@@ -0,0 +1,69 @@
+#include <./hub/Timings.h>
+
+CommandTimings commandTimings;
+
+const char* const TIMED_PREFIXES[TIMED_OTHER] = {
+  "AT+SAPBR",
+  "AT+HTTPINIT",
+  "AT+HTTPPARA",
+  "AT+HTTPDATA",
+  "AT+HTTPACTION",
+  "AT+HTTPREAD",
+  "AT+HTTPTERM",
+  "AT+CREG",
+  "AT+CGNSINF",
+};
+
+const char* const TIMED_NAMES[TIMED_COMMANDS] = {
+  "SAPBR", "HTTPINIT", "HTTPPARA", "HTTPDATA", "HTTPACTION", "HTTPREAD", "HTTPTERM", "CREG", "CGNSINF", "Other",
+};
+
+TimedCommand CommandTimings::classify(const char* command) {
+  for (uint8_t i = 0; i < TIMED_OTHER; i++) {
+    if (strncmp(command, TIMED_PREFIXES[i], strlen(TIMED_PREFIXES[i])) == 0) return (TimedCommand)i;
+  }
+  return TIMED_OTHER;
+}
+
+void CommandTimings::addTimeout(const char* command) {
+  uint16_t& count = timeouts[classify(command)];
+  if (count < UINT16_MAX) count++;
+}
+
+void CommandTimings::write(uint8_t* out) const {
+  for (uint8_t i = 0; i < TIMED_COMMANDS; i++) {
+    for (uint8_t j = 0; j < TIMING_VALUES; j++) {
+      uint16_t count = j <= TIMING_BUCKETS ? histograms[i].count(j) : timeouts[i];
+      *out++ = count & 0xFF;
+      *out++ = count >> 8;
+    }
+  }
+}
+
+size_t CommandTimings::writeJson(char* out) const {
+  size_t len = 0;
+  out[len++] = '[';
+  for (uint8_t i = 0; i < TIMED_COMMANDS; i++) {
+    if (i) out[len++] = ',';
+    out[len++] = '[';
+    for (uint8_t j = 0; j <= TIMING_BUCKETS; j++) len += sprintf(out + len, "%u,", histograms[i].count(j));
+    len += sprintf(out + len, "%u]", timeouts[i]);
+  }
+  out[len++] = ']';
+  out[len] = '\0';
+  return len;
+}
+
+void CommandTimings::print(Print& out) const {
+  for (uint8_t i = 0; i < TIMED_COMMANDS; i++) {
+    if (!histograms[i].total() && !timeouts[i]) continue;
+    histograms[i].print(out, TIMED_NAMES[i]);
+    out.print("  timeouts: ");
+    out.println(timeouts[i]);
+  }
+}
+
+void CommandTimings::clear() {
+  for (uint8_t i = 0; i < TIMED_COMMANDS; i++) histograms[i].clear();
+  memset(timeouts, 0, sizeof timeouts);
+}
@@ -0,0 +1,74 @@
+#ifndef HUB_TIMINGS_H
+#define HUB_TIMINGS_H
+
+#include <Arduino.h>
+#include <./hub/Histogram.h>
+
+// Buckets of each command's histogram (in ms), anything slower lands in one more
+const uint8_t TIMING_BUCKETS = 8;
+const uint16_t TIMING_BOUNDS[TIMING_BUCKETS] = { 100, 250, 500, 1000, 2500, 5000, 10000, 20000 };
+
+/**
+ * Commands timed separately, everything else is counted under TIMED_OTHER
+ */
+enum TimedCommand : uint8_t {
+  TIMED_SAPBR,
+  TIMED_HTTPINIT,
+  TIMED_HTTPPARA,     // Includes USERDATA and URL
+  TIMED_HTTPDATA,     // Includes the wait after DOWNLOAD before writing the query
+  TIMED_HTTPACTION,   // Until the +HTTPACTION URC
+  TIMED_HTTPREAD,     // Until the body is parsed
+  TIMED_HTTPTERM,
+  TIMED_CREG,
+  TIMED_CGNSINF,
+  TIMED_OTHER,
+  TIMED_COMMANDS,
+};
+
+// Counts per command, each bucket then the timeouts
+const uint8_t TIMING_VALUES = TIMING_BUCKETS + 2;
+// Size of CommandTimings::write, little endian uint16 counts for each TimedCommand in order
+const uint16_t TIMINGS_BINARY_SIZE = TIMED_COMMANDS * TIMING_VALUES * 2;
+// Longest CommandTimings::writeJson, including the null terminator
+const uint16_t TIMINGS_JSON_SIZE = TIMED_COMMANDS * (TIMING_VALUES * 6 + 2) + 2;
+
+/**
+ * Latency of every AT command the hub sends, kept in RAM until uploaded
+ */
+class CommandTimings {
+private:
+  Histogram<TIMING_BUCKETS> histograms[TIMED_COMMANDS]{
+    TIMING_BOUNDS, TIMING_BOUNDS, TIMING_BOUNDS, TIMING_BOUNDS, TIMING_BOUNDS,
+    TIMING_BOUNDS, TIMING_BOUNDS, TIMING_BOUNDS, TIMING_BOUNDS, TIMING_BOUNDS,
+  };
+  uint16_t timeouts[TIMED_COMMANDS]{};
+
+public:
+  static TimedCommand classify(const char* command);
+
+  /**
+   * Records how long command took (in ms) to get its result, ERROR included
+   */
+  void add(const char* command, uint32_t ms) { histograms[classify(command)].add(ms); }
+
+  void addTimeout(const char* command);
+
+  /**
+   * Writes TIMINGS_BINARY_SIZE bytes into out, for the diagnostics characteristic
+   */
+  void write(uint8_t* out) const;
+
+  /**
+   * Writes an array per TimedCommand of each bucket's count then the timeouts, ie [[0,3,1,0,0,0,0,0,0,0],...]
+   * out needs room for TIMINGS_JSON_SIZE
+   */
+  size_t writeJson(char* out) const;
+
+  void print(Print& out) const;
+
+  void clear();
+};
+
+extern CommandTimings commandTimings;
+
+#endif
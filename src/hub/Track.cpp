@@ -0,0 +1,113 @@
+#include <./hub/Track.h>
+
+// Length of 1e-5 degrees of latitude (in m)
+const double TRACK_UNIT_METERS = 1.1119;
+
+size_t Track::writeValue(char* out, int32_t value) {
+  uint32_t bits = value < 0 ? ~((uint32_t)value << 1) : (uint32_t)value << 1;
+  size_t len = 0;
+  do {
+    char c = (bits >= 0x20 ? 0x20 | (bits & 0x1F) : bits) + 63;
+    if (c == '\\') out[len++] = '\\';
+    out[len++] = c;
+    bits >>= 5;
+  } while (bits);
+  return len;
+}
+
+double Track::offTrack(const TrackPoint& p, const TrackPoint& a, const TrackPoint& b) {
+  // Flat around a, plenty for the few km between fixes
+  double lngScale = TRACK_UNIT_METERS * cos(a.lat * 1e-5 * PI / 180);
+  double bx = (b.lng - a.lng) * lngScale;
+  double by = (b.lat - a.lat) * TRACK_UNIT_METERS;
+  double px = (p.lng - a.lng) * lngScale;
+  double py = (p.lat - a.lat) * TRACK_UNIT_METERS;
+  double lenSq = bx * bx + by * by;
+  double t = lenSq > 0 ? constrain((px * bx + py * by) / lenSq, 0.0, 1.0) : 0;
+  return sqrt(pow(px - t * bx, 2) + pow(py - t * by, 2));
+}
+
+void Track::add(const LocReading& reading, uint32_t time) {
+  if (len == TRACK_SIZE) simplify(TRACK_TOLERANCE);
+  if (len == TRACK_SIZE) remove(1);
+  TrackPoint& point = points[len++];
+  point.time = time;
+  point.lat = lround(reading.lat * 1e5);
+  point.lng = lround(reading.lng * 1e5);
+  point.kmph = constrain(lround(reading.kmph * 10), 0L, (long)UINT16_MAX);
+  point.deg = lround(reading.deg) % 360;
+  point.hdop = constrain(lround(reading.hdop * 10), 0L, (long)UINT8_MAX);
+}
+
+void Track::simplify(double tolerance) {
+  if (len < 3) return;
+  bool isKept[TRACK_SIZE]{};
+  isKept[0] = isKept[len - 1] = true;
+  // Segments still to check, each has at least one point between its ends so there are never more than len / 2
+  uint8_t firsts[TRACK_SIZE / 2];
+  uint8_t lasts[TRACK_SIZE / 2];
+  uint8_t pending = 0;
+  firsts[pending] = 0;
+  lasts[pending++] = len - 1;
+  while (pending) {
+    pending--;
+    uint8_t first = firsts[pending];
+    uint8_t last = lasts[pending];
+    uint8_t furthestIdx = 0;
+    double furthest = 0;
+    for (uint8_t i = first + 1; i < last; i++) {
+      double dist = offTrack(points[i], points[first], points[last]);
+      if (dist > furthest) {
+        furthest = dist;
+        furthestIdx = i;
+      }
+    }
+    if (furthest <= tolerance) continue;
+    isKept[furthestIdx] = true;
+    if (furthestIdx - first > 1) {
+      firsts[pending] = first;
+      lasts[pending++] = furthestIdx;
+    }
+    if (last - furthestIdx > 1) {
+      firsts[pending] = furthestIdx;
+      lasts[pending++] = last;
+    }
+  }
+  uint8_t keptLen = 0;
+  for (uint8_t i = 0; i < len; i++) {
+    if (isKept[i]) points[keptLen++] = points[i];
+  }
+  len = keptLen;
+}
+
+size_t Track::writeJson(char* out, size_t size, uint32_t now, uint8_t& count) const {
+  size_t outLen = 0;
+  out[outLen++] = '"';
+  count = 0;
+  while (count < len && outLen + TRACK_POINT_JSON_SIZE + 2 <= size) {
+    const TrackPoint& point = points[count];
+    if (count) {
+      const TrackPoint& prev = points[count - 1];
+      outLen += writeValue(out + outLen, point.time - prev.time);
+      outLen += writeValue(out + outLen, point.lat - prev.lat);
+      outLen += writeValue(out + outLen, point.lng - prev.lng);
+    } else {
+      outLen += writeValue(out + outLen, now - point.time);
+      outLen += writeValue(out + outLen, point.lat);
+      outLen += writeValue(out + outLen, point.lng);
+    }
+    outLen += writeValue(out + outLen, point.kmph);
+    outLen += writeValue(out + outLen, point.deg);
+    outLen += writeValue(out + outLen, point.hdop);
+    count++;
+  }
+  out[outLen++] = '"';
+  out[outLen] = '\0';
+  return outLen;
+}
+
+void Track::remove(uint8_t count) {
+  if (count > len) count = len;
+  memmove(points, points + count, (len - count) * sizeof(TrackPoint));
+  len -= count;
+}
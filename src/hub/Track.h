@@ -0,0 +1,99 @@
+#ifndef HUB_TRACK_H
+#define HUB_TRACK_H
+
+#include <Arduino.h>
+#include <./hub/Location.h>
+
+// Fixes kept in RAM until uploaded, once full it's simplified and then the oldest is dropped
+const uint8_t TRACK_SIZE = 64;
+// Points closer than this to the track through the points around them are dropped (in m)
+const double TRACK_TOLERANCE = 15;
+// Uploaded on its own once this many are waiting, otherwise with the next radio wake
+const uint8_t TRACK_UPLOAD_SIZE = 16;
+// Longest a fix waits for another radio wake before forcing its own (in seconds)
+const uint32_t TRACK_MAX_DELAY = 30 * 60;
+// Time to wait after a failed upload before isUploadDue will retry it (in seconds)
+const uint32_t TRACK_RETRY_DELAY = 60;
+// Values written per point by Track::writeJson
+const uint8_t TRACK_POINT_VALUES = 6;
+// Longest a point can be, a 32 bit value takes 7 characters which may each be escaped
+const uint8_t TRACK_POINT_JSON_SIZE = TRACK_POINT_VALUES * 7 * 2;
+// Room for the encoded track in a request, points that don't fit wait for the next one
+const uint16_t TRACK_JSON_SIZE = 1024;
+
+/**
+ * A fix in fixed point, 20 bytes instead of LocReading's 48
+ */
+struct TrackPoint {
+  // Hal::getEpoch when it was added
+  uint32_t time = 0;
+  // In 1e-5 degrees, about a meter
+  int32_t lat = 0;
+  int32_t lng = 0;
+  // In 0.1 km/h
+  uint16_t kmph = 0;
+  // Course in degrees
+  uint16_t deg = 0;
+  // In 0.1, 255 for 25.5 or worse
+  uint8_t hdop = 0;
+};
+
+/**
+ * Accepted fixes waiting to be uploaded together as one encoded string
+ * Kept until the server has them, so a failed request only delays them
+ */
+class Track {
+private:
+  TrackPoint points[TRACK_SIZE];
+  uint8_t len = 0;
+  uint32_t retryTime = 0;
+
+  /**
+   * Distance (in m) from p to the segment between a and b
+   */
+  static double offTrack(const TrackPoint& p, const TrackPoint& a, const TrackPoint& b);
+
+  /**
+   * Writes value like a Google polyline, backslashes are escaped for JSON
+   */
+  static size_t writeValue(char* out, int32_t value);
+
+public:
+  void add(const LocReading& reading, uint32_t time);
+
+  /**
+   * Drops points within tolerance (in m) of the track without them (Douglas-Peucker), the first and last are kept
+   */
+  void simplify(double tolerance);
+
+  /**
+   * Writes the oldest points as a quoted JSON string, as many as fit in size (including the null terminator)
+   * Each point is TRACK_POINT_VALUES values encoded like a Google polyline (zigzag, 5 bits per character plus 63):
+   * seconds (before now for the first point, then since the previous one), lat and lng (the first absolute,
+   * then from the previous one), speed, course and HDOP, see TrackPoint for the units
+   * Sets count to the number of points written and returns the length
+   */
+  size_t writeJson(char* out, size_t size, uint32_t now, uint8_t& count) const;
+
+  /**
+   * Forgets the oldest count points once the server has them
+   */
+  void remove(uint8_t count);
+
+  /**
+   * Holds off isUploadDue for TRACK_RETRY_DELAY
+   */
+  void uploadFailed(uint32_t now) { retryTime = now + TRACK_RETRY_DELAY; }
+
+  /**
+   * True if enough points are waiting, or the oldest has waited long enough, to wake the radio just for them
+   */
+  bool isUploadDue(uint32_t now) const {
+    if (!len || now < retryTime) return false;
+    return len >= TRACK_UPLOAD_SIZE || now >= points[0].time + TRACK_MAX_DELAY;
+  }
+
+  uint8_t length() const { return len; }
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include <./hub/Uploads.h>
+#include <./hub/Hal.h>
+#include <./hub/Log.h>
+
+Upload* UploadQueue::reserve(UploadType type) {
+  uint8_t idx = uploadsLen;
+  if (type != UPLOAD_EVENT) {
+    // One that's already being sent can't be replaced anymore
+    for (uint8_t i = flushingLen; i < uploadsLen; i++) {
+      if (uploads[i].type == type) {
+        idx = i;
+        break;
+      }
+    }
+  }
+  if (idx == UPLOAD_QUEUE_SIZE) {
+    LOG_INFOLN(LOG_NETWORK, "Upload queue is full");
+    return nullptr;
+  }
+  if (idx == uploadsLen) {
+    uploads[idx].queuedAt = Hal::getEpoch();
+    uploadsLen++;
+  }
+  uploads[idx].type = type;
+  return &uploads[idx];
+}
+
+bool UploadQueue::isFlushDue() {
+  if (uploadsLen == 0 || flushingLen > 0) return false;
+  if (lastFailedFlush > 0 && Hal::getEpoch() < lastFailedFlush + UPLOAD_RETRY_DELAY) return false;
+  if (uploadsLen == UPLOAD_QUEUE_SIZE) return true;
+  for (uint8_t i = 0; i < uploadsLen; i++) {
+    if (uploads[i].type == UPLOAD_EVENT) return true;
+    if (Hal::getEpoch() >= uploads[i].queuedAt + UPLOAD_MAX_DELAY) return true;
+  }
+  return false;
+}
+
+void UploadQueue::writeDocument() {
+  char alias[4]{};
+  bool hasVariables = false;
+  uint16_t len = sprintf(document, "mutation Uploads(");
+  for (uint8_t i = 0; i < flushingLen; i++) {
+    if (!uploads[i].types[0]) continue;
+    if (hasVariables) document[len++] = ',';
+    sprintf(alias, "m%d", i);
+    len += GraphQL::writeDefinitions(document + len, uploads[i].types, alias);
+    hasVariables = true;
+  }
+  // No parentheses at all without variables
+  if (hasVariables) document[len++] = ')';
+  else len--;
+  document[len++] = '{';
+  for (uint8_t i = 0; i < flushingLen; i++) {
+    sprintf(alias, "m%d", i);
+    len += sprintf(document + len, "%s%s:", i ? " " : "", alias);
+    len += GraphQL::writeReferences(document + len, uploads[i].fields, alias);
+  }
+  document[len++] = '}';
+  document[len] = '\0';
+  documentLen = len;
+}
+
+void UploadQueue::writeQuery() {
+  char alias[4]{};
+  uint16_t len = sprintf(query, "{");
+  bool hasDocument = true;
+#ifdef HUB_PERSISTED_QUERIES
+  hasDocument = !isHashOnly;
+#endif
+  // Neither the fields nor the variable names have anything to escape
+  if (hasDocument) len += sprintf(query + len, "\"query\":\"%s\",", document);
+  len += sprintf(query + len, "\"variables\":{");
+  bool hasVariables = false;
+  for (uint8_t i = 0; i < flushingLen; i++) {
+    if (!uploads[i].types[0]) continue;
+    if (hasVariables) query[len++] = ',';
+    sprintf(alias, "m%d", i);
+    len += GraphQL::writeVariables(query + len, uploads[i].types, uploads[i].values, alias);
+    hasVariables = true;
+  }
+  query[len++] = '}';
+#ifdef HUB_PERSISTED_QUERIES
+  if (isPersisted) {
+    char hash[SHA256_SIZE * 2 + 1]{};
+    Sha256::toHex(documentHash, hash);
+    len += sprintf(query + len, ",\"extensions\":{\"persistedQuery\":{\"version\":1,\"sha256Hash\":\"%s\"}}", hash);
+  }
+#endif
+  query[len++] = '}';
+  query[len] = '\0';
+}
+
+bool UploadQueue::flush(Network& network, BLELocalDevice* BLE, void (*onFlushed)(bool success)) {
+  if (uploadsLen == 0 || flushingLen > 0) return false;
+  if (!network.tokenData.isValid) return false;
+
+  flushingLen = uploadsLen;
+  writeDocument();
+  char alias[4]{};
+  filter.clear();
+  for (uint8_t i = 0; i < flushingLen; i++) {
+    sprintf(alias, "m%d", i);
+    filter["data"][alias]["id"] = true;
+  }
+#ifdef HUB_PERSISTED_QUERIES
+  filter["errors"][0]["message"] = true;
+  isPersisted = documentLen >= PERSISTED_QUERY_MIN_LENGTH;
+  if (isPersisted) Sha256::hash((const uint8_t*)document, documentLen, documentHash);
+  isHashOnly = isPersisted && persistedQueries.isKnown(documentHash);
+#endif
+  writeQuery();
+  LOG_INFO(LOG_NETWORK, "Flushing uploads: ");
+  LOG_INFOLN(LOG_NETWORK, flushingLen);
+
+  if (!network.SendRequestAsync(query, onRequestComplete, this, BLE, &filter, 256)) {
+    flushingLen = 0;
+    return false;
+  }
+  this->network = &network;
+  this->BLE = BLE;
+  this->onFlushed = onFlushed;
+  return true;
+}
+
+void UploadQueue::onRequestComplete(bool success, JsonDocument& doc, void* context) {
+  UploadQueue* queue = (UploadQueue*)context;
+#ifdef HUB_PERSISTED_QUERIES
+  if (queue->isPersisted) {
+    const char* code = doc["errors"][0]["extensions"]["code"];
+    const char* message = doc["errors"][0]["message"];
+    bool isNotFound = (code && strcmp(code, "PERSISTED_QUERY_NOT_FOUND") == 0)
+      || (message && strcmp(message, "PersistedQueryNotFound") == 0);
+    if (isNotFound) {
+      queue->persistedQueries.forget(queue->documentHash);
+      if (queue->isHashOnly) {
+        // Server lost it, send it again in full which also stores it
+        LOG_INFOLN(LOG_NETWORK, "Persisted query not found, sending full document");
+        queue->isHashOnly = false;
+        queue->writeQuery();
+        if (queue->network->SendRequestAsync(queue->query, onRequestComplete, queue, queue->BLE, &queue->filter, 256)) return;
+      }
+      success = false;
+    } else if (success) {
+      queue->persistedQueries.remember(queue->documentHash);
+    }
+  }
+#endif
+  if (!doc["data"]) {
+    // Keep the uploads if the request never made it, or the token needs to be refreshed first
+    const char* code = doc["errors"][0]["extensions"]["code"];
+    if (!success || !doc["errors"] || (code && strcmp(code, "UNAUTHENTICATED") == 0)) {
+      LOG_WARNLN(LOG_NETWORK, "Uploads failed, keeping for next flush");
+      queue->lastFailedFlush = Hal::getEpoch();
+      queue->flushingLen = 0;
+      if (queue->onFlushed) queue->onFlushed(false);
+      return;
+    }
+    LOG_WARNLN(LOG_NETWORK, "Uploads rejected, dropping");
+  } else {
+    char alias[4]{};
+    for (uint8_t i = 0; i < queue->flushingLen; i++) {
+      sprintf(alias, "m%d", i);
+      JsonVariant result = doc["data"][alias];
+      if (!result) {
+        LOG_WARN(LOG_NETWORK, "Upload rejected: ");
+        LOG_WARNLN(LOG_NETWORK, queue->uploads[i].fields);
+      } else if (queue->uploads[i].onResult) {
+        queue->uploads[i].onResult(result);
+      }
+    }
+    queue->lastFailedFlush = 0;
+  }
+  queue->removeFlushed();
+  if (queue->onFlushed) queue->onFlushed(true);
+}
+
+void UploadQueue::removeFlushed() {
+  for (uint8_t i = flushingLen; i < uploadsLen; i++) {
+    uploads[i - flushingLen] = uploads[i];
+  }
+  uploadsLen -= flushingLen;
+  flushingLen = 0;
+}
@@ -0,0 +1,142 @@
+#ifndef HUB_UPLOADS_H
+#define HUB_UPLOADS_H
+
+#include <./hub/Hal.h>
+#include <ArduinoJson.h>
+#include <./hub/Network.h>
+#include <./hub/GraphQL.h>
+#include <./hub/Log.h>
+
+const uint8_t UPLOAD_QUEUE_SIZE = 4;
+// Most an upload adds to the combined mutation, its field plus its variable definitions
+const uint8_t UPLOAD_FIELDS_SIZE = 150;
+// Most JSON for the variables of a single upload, ie updateHubBatteryLevel's 2 numbers
+const uint8_t UPLOAD_VALUES_SIZE = 64;
+// Length of each upload's alias in the combined mutation, which also prefixes its variables, ie m0
+const uint8_t UPLOAD_ALIAS_LEN = 2;
+// Longest an upload waits for another radio wake before forcing its own (in seconds)
+const uint32_t UPLOAD_MAX_DELAY = 30 * 60;
+// Time to wait after a failed flush before isFlushDue will retry it (in seconds)
+const uint32_t UPLOAD_RETRY_DELAY = 60;
+#ifdef HUB_PERSISTED_QUERIES
+// Shorter documents are always sent in full, the hash and extensions alone are over 100 bytes
+const uint16_t PERSISTED_QUERY_MIN_LENGTH = 160;
+#endif
+
+enum UploadType : uint8_t {
+  UPLOAD_EVENT,
+  UPLOAD_BATTERY,
+};
+
+struct Upload {
+  UploadType type = UPLOAD_EVENT;
+  // Mutation field from a template in Queries.h, with a $ for each variable
+  const char* fields = nullptr;
+  // Type of each variable, see GraphQL::Template::types
+  const char* types = nullptr;
+  // JSON of each variable's value, see GraphQL::Template::writeValues
+  char values[UPLOAD_VALUES_SIZE]{};
+  // Called with this upload's field from the response data when sent successfully
+  void (*onResult)(JsonVariant result) = nullptr;
+  uint32_t queuedAt = 0;
+};
+
+class UploadQueue {
+private:
+  Upload uploads[UPLOAD_QUEUE_SIZE];
+  uint8_t uploadsLen = 0;
+  uint32_t lastFailedFlush = 0;
+
+  /**
+   * Number of uploads at the front of the queue that are in the request in flight
+   */
+  uint8_t flushingLen = 0;
+  void (*onFlushed)(bool success) = nullptr;
+  Network* network = nullptr;
+  BLELocalDevice* BLE = nullptr;
+
+  /**
+   * The combined mutation with every value passed as a variable, so it's the same text for the same kinds of uploads
+   */
+  char document[UPLOAD_QUEUE_SIZE * UPLOAD_FIELDS_SIZE + 24]{};
+  uint16_t documentLen = 0;
+
+  /**
+   * Static memory for the request body, the document plus the variables and extensions objects
+   */
+  char query[sizeof document + UPLOAD_QUEUE_SIZE * (UPLOAD_VALUES_SIZE + 40) + 130]{};
+
+  /**
+   * Every upload only selects its id, so that's all that needs to be kept from the response
+   * Larger than ResponseFilter since it has a field per upload
+   */
+  StaticJsonDocument<384> filter;
+
+#ifdef HUB_PERSISTED_QUERIES
+  GraphQL::PersistedQueries persistedQueries;
+  uint8_t documentHash[SHA256_SIZE]{};
+  // If the hash is sent along with the request
+  bool isPersisted = false;
+  // If the document is left out since the server should already have it
+  bool isHashOnly = false;
+#endif
+
+  /**
+   * Returns the upload to fill for type, a pending battery upload is reused
+   * nullptr if the queue is full
+   */
+  Upload* reserve(UploadType type);
+
+  void writeDocument();
+
+  void writeQuery();
+
+  static void onRequestComplete(bool success, JsonDocument& doc, void* context);
+
+  /**
+   * Drops the uploads that were in the request, keeping any added since
+   */
+  void removeFlushed();
+
+public:
+  /**
+   * Queues a mutation field to be sent with the next flush, values are copied so they don't need to outlive the call
+   * A pending battery upload is replaced since only the latest one matters
+   * Returns false if the queue is full
+   */
+  template<typename... Vars>
+  bool add(UploadType type, const GraphQL::Template<Vars...>& fields, void (*onResult)(JsonVariant result), typename Vars::Value... values) {
+    static_assert(GraphQL::Template<Vars...>::maxValuesLength() <= UPLOAD_VALUES_SIZE, "Upload values don't fit in UPLOAD_VALUES_SIZE");
+    Upload* upload = reserve(type);
+    if (!upload) return false;
+    upload->fields = fields.getText();
+    upload->types = fields.types;
+    fields.writeValues(upload->values, values...);
+    upload->onResult = onResult;
+    LOG_DEBUG(LOG_NETWORK, "Queued upload: ");
+    LOG_DEBUGLN(LOG_NETWORK, upload->fields);
+    return true;
+  }
+
+  bool isEmpty() { return uploadsLen == 0; }
+
+  bool isFlushing() { return flushingLen > 0; }
+
+  /**
+   * True if an event is waiting, the queue is full, or the oldest upload has waited UPLOAD_MAX_DELAY
+   * Always false while flushing and for UPLOAD_RETRY_DELAY after a failed flush
+   */
+  bool isFlushDue();
+
+  /**
+   * Starts sending every pending upload as a single aliased mutation, network.tick advances it from loop
+   * The module is powered on if needed and left powered, onFlushed is called once done so it can be turned off
+   * With HUB_PERSISTED_QUERIES, long documents are sent as a hash once the server has them
+   * and again in full if it answers PersistedQueryNotFound
+   * Uploads that failed are kept for the next flush
+   * Returns false if the request couldn't be started
+   */
+  bool flush(Network& network, BLELocalDevice* BLE, void (*onFlushed)(bool success) = nullptr);
+};
+
+#endif
@@ -1,7 +1,8 @@
 #include <Arduino.h>
-#include <ArduinoLowPower.h>
-#include <utility/HCI.h>
 #include <./hub/Utilities.h>
+#include <./hub/Hal.h>
+#include <./hub/AtParser.h>
+#include <./hub/Log.h>
 
 namespace Utilities {
   void setupPins() {
@@ -18,12 +19,12 @@ namespace Utilities {
 
   void analogWriteRGB(uint8_t r, uint8_t g, uint8_t b, bool print) {
     if (print) {
-      Serial.print("Writing rgb value: ");
-      Serial.print(r);
-      Serial.print(", ");
-      Serial.print(g);
-      Serial.print(", ");
-      Serial.println(b);
+      LOG_DEBUG(LOG_APP, "Writing rgb value: ");
+      LOG_DEBUG(LOG_APP, r);
+      LOG_DEBUG(LOG_APP, ", ");
+      LOG_DEBUG(LOG_APP, g);
+      LOG_DEBUG(LOG_APP, ", ");
+      LOG_DEBUGLN(LOG_APP, b);
     }
     int divisor = 5;
     analogWrite(RGB_R, r / divisor);
@@ -53,7 +54,7 @@ namespace Utilities {
   }
 
   Command parseRawCommand(char* rawCmd) {
-    Serial.println("in parseRawCmd");
+    LOG_DEBUGLN(LOG_APP, "in parseRawCmd");
     Command res;
     int8_t valueStartIdx = -1;
     for (uint8_t i = 0; i < strlen(rawCmd); i++) {
@@ -65,8 +66,8 @@ namespace Utilities {
         res.type[i] = rawCmd[i];
       }
     }
-    if (!strlen(res.type)) Serial.println("Error: Couldn't parse type");
-    if (!strlen(res.value)) Serial.println("Error: Couldn't parse value");
+    if (!strlen(res.type)) LOG_WARNLN(LOG_APP, "Error: Couldn't parse type");
+    if (!strlen(res.value)) LOG_WARNLN(LOG_APP, "Error: Couldn't parse value");
     return res;
   }
 
@@ -78,6 +79,10 @@ namespace Utilities {
 #endif  // __arm__
 
   int freeMemory() {
+#ifdef HUB_NATIVE
+    // The host has no fixed split between heap and stack
+    return INT_MAX;
+#else
     char top;
 #ifdef __arm__
     return &top - reinterpret_cast<char*>(sbrk(0));
@@ -86,6 +91,7 @@ namespace Utilities {
 #else  // __arm__
     return __brkval ? &top - __brkval : &top - __malloc_heap_start;
 #endif  // __arm__
+#endif
   }
 
   void bleDelay(uint16_t milliseconds, BLELocalDevice* BLE) {
@@ -99,84 +105,31 @@ namespace Utilities {
   void idle(unsigned long delay) {
     unsigned long endTime = millis() + delay;
     while (millis() < endTime) {
-      LowPower.idle(delay);
+      Hal::idle(delay);
     }
   }
 
-  bool readUntilResp(const char* head, char* buffer, BLELocalDevice* BLE, uint16_t timeout) {
-    bool didReadHead = strlen(head) == 0;
-    uint16_t size = 0;
-    uint16_t idx = 0;
-    char c;
-    unsigned long dropDeadTime = millis() + timeout;
-    while (millis() < dropDeadTime)
-    {
-      while (Serial1.available()) {
-        c = Serial1.read();
-        if (!didReadHead) {
-          if (c != head[idx]) {
-            Serial.println("Head doesn't match");
-            while (Serial1.available()) Serial1.read();
-            return false;
-          }
-          if (idx == strlen(head) - 1) didReadHead = true;
-        } else {
-          buffer[size] = c;
-          size++;
-        }
-        idx++;
-
-        if (size >= 6
-          && buffer[size - 1] == 10
-          && buffer[size - 2] == 13
-          && buffer[size - 5] == 10 && buffer[size - 4] == 'O' && buffer[size - 3] == 'K'
-          ) {
-          // OK response
-          buffer[size - 8] = '\0';
-          return true;
-        }
-        if (size >= 8
-          && buffer[size - 1] == 10
-          && buffer[size - 2] == 13
-          && buffer[size - 8] == 10 && buffer[size - 7] == 'E' && buffer[size - 6] == 'R' && buffer[size - 5] == 'R' && buffer[size - 4] == 'O' && buffer[size - 3] == 'R'
-          ) {
-          // ERROR response
-          buffer[size - 9] = '\0';
-          Serial.println("ERROR received");
-          return false;
-        }
-      }
-      if (BLE) Utilities::bleDelay(1, BLE);
-    }
-    Serial.println(">>READ TIMEOUT<<");
-    return false;
+  bool readUntilResp(const char* head, char* buffer, uint8_t bufferSize, BLELocalDevice* BLE, uint16_t timeout) {
+    buffer[0] = '\0';
+    return atParser.waitResult(millis() + timeout, BLE, strlen(head) ? head : nullptr, buffer, bufferSize);
   }
 
   void printBytes(char* buffer) {
-    Serial.println("\n===== Printing Bytes =======");
+    LOG_DEBUGLN(LOG_APP, "\n===== Printing Bytes =======");
     for (uint16_t idx = 0; idx < strlen(buffer); idx++) {
-      if ((uint8_t)buffer[idx] < 100) Serial.print("0");
-      Serial.print((uint8_t)buffer[idx]);
-      if (buffer[idx] == '\n') Serial.println("");
-      else Serial.print(" ");
+      if ((uint8_t)buffer[idx] < 100) LOG_DEBUG(LOG_APP, "0");
+      LOG_DEBUG(LOG_APP, (uint8_t)buffer[idx]);
+      if (buffer[idx] == '\n') LOG_DEBUGLN(LOG_APP, "");
+      else LOG_DEBUG(LOG_APP, " ");
     }
-    Serial.println("\n===== End Bytes =======");
+    LOG_DEBUGLN(LOG_APP, "\n===== End Bytes =======");
   }
 
   bool setBlePower(bool on) {
-    if (on) {
-      Serial.print("BLE trying to power up...");
-      digitalWrite(NINA_RESETN, HIGH);
-      Utilities::idle(750);
-      if (!HCI.begin()) return false;
-      if (HCI.reset() != 0) return false;
-      if (HCI.setEventMask(0x3FFFFFFFFFFFFFFF) != 0) return false;
-      if (HCI.setLeEventMask(0x00000000000003FF) != 0) return false;
-      Serial.println("BLE On!");
-    } else {
-      digitalWrite(NINA_RESETN, LOW);
-      Serial.println("BLE powered down");
-    }
+    if (on) LOG_INFO(LOG_BLE, "BLE trying to power up...");
+    if (!Hal::setBlePower(on)) return false;
+    if (on) LOG_INFOLN(LOG_BLE, "BLE On!");
+    else LOG_INFOLN(LOG_BLE, "BLE powered down");
     return true;
   }
 }
\ No newline at end of file
@@ -2,7 +2,7 @@
 #define HUB_UTILITIES_H
 
 #include <Arduino.h>
-#include <ArduinoBLE.h>
+#include <./hub/Hal.h>
 
 // All pins for the project should be declared here and set in setupPins
 
@@ -50,15 +50,16 @@ namespace Utilities {
   void bleDelay(uint16_t milliseconds, BLELocalDevice* BLE);
 
   /**
-   * Workaround for LowPower.idle() not working correctly
+   * Idles for the whole delay, Hal::idle can return early
    */
   void idle(unsigned long delay);
 
   /**
-   * Reads n bytes into buffer (ignoring head) from Serial1
+   * Waits for the result of the last command sent to Serial1, copying the rest of
+   * the response line starting with head (ie "+CREG: ") into buffer, head can be empty
    * Returns true if OK received, false otherwise
   **/
-  bool readUntilResp(const char* head, char* buffer, BLELocalDevice* BLE = nullptr, uint16_t timeout = 1000);
+  bool readUntilResp(const char* head, char* buffer, uint8_t bufferSize, BLELocalDevice* BLE = nullptr, uint16_t timeout = 1000);
 
   /**
    * Prints a char array as bytes up to the termination character
@@ -0,0 +1,76 @@
+#include <./sensor/ForceDetector.h>
+
+ForceLevel ForceDetector::levelFor(uint16_t millivolts) const {
+  uint16_t openAt = level == FORCE_OPEN ? thresholds.openOff : thresholds.openOn;
+  uint16_t touchAt = level != FORCE_IDLE ? thresholds.touchOff : thresholds.touchOn;
+  if (millivolts >= openAt) return FORCE_OPEN;
+  if (millivolts >= touchAt) return FORCE_TOUCH;
+  return FORCE_IDLE;
+}
+
+void ForceDetector::addEvent(ForceLevel previousLevel, uint32_t now) {
+  if (eventsLen == FORCE_EVENTS_SIZE) {
+    eventsStart = (eventsStart + 1) % FORCE_EVENTS_SIZE;
+    eventsLen--;
+  }
+  ForceEvent& event = events[(eventsStart + eventsLen) % FORCE_EVENTS_SIZE];
+  event.time = now;
+  event.seq = nextSeq++;
+  event.millivolts = getMillivolts();
+  event.level = level;
+  event.previousLevel = previousLevel;
+  eventsLen++;
+  if (previousLevel == FORCE_IDLE) eventCount++;
+}
+
+bool ForceDetector::add(uint16_t millivolts, uint32_t now) {
+  int32_t sample = (int32_t)millivolts << FILTER_FRACTION_BITS;
+  if (!hasSample) {
+    filtered = sample;
+    hasSample = true;
+  } else {
+    filtered += (sample - filtered) >> thresholds.filterShift;
+  }
+
+  ForceLevel next = levelFor(getMillivolts());
+  if (next == level) {
+    pendingLevel = level;
+    return false;
+  }
+  if (next != pendingLevel) {
+    pendingLevel = next;
+    pendingSince = now;
+  }
+  if (now - pendingSince < thresholds.debounce) return false;
+
+  ForceLevel previousLevel = level;
+  level = next;
+  addEvent(previousLevel, now);
+  return true;
+}
+
+size_t ForceDetector::writeEvents(uint8_t* out, size_t size, uint32_t now) const {
+  if (size < sizeof(ForceEventsHeader)) return 0;
+  ForceEventsHeader header;
+  header.time = now;
+  header.count = min((size_t)eventsLen, (size - sizeof header) / sizeof(ForceEvent));
+  header.firstEventCount = eventCount;
+  for (uint8_t i = 0; i < eventsLen; i++) {
+    if (events[(eventsStart + i) % FORCE_EVENTS_SIZE].previousLevel == FORCE_IDLE) header.firstEventCount--;
+  }
+  memcpy(out, &header, sizeof header);
+  size_t len = sizeof header;
+  for (uint8_t i = 0; i < header.count; i++) {
+    memcpy(out + len, &events[(eventsStart + i) % FORCE_EVENTS_SIZE], sizeof(ForceEvent));
+    len += sizeof(ForceEvent);
+  }
+  return len;
+}
+
+void ForceDetector::ack(uint16_t seq) {
+  // Compared as a difference so it still works once seq wraps around
+  while (eventsLen > 0 && (int16_t)(seq - events[eventsStart].seq) >= 0) {
+    eventsStart = (eventsStart + 1) % FORCE_EVENTS_SIZE;
+    eventsLen--;
+  }
+}
@@ -0,0 +1,115 @@
+#ifndef SENSOR_FORCE_DETECTOR_H
+#define SENSOR_FORCE_DETECTOR_H
+
+#include <Arduino.h>
+
+enum ForceLevel : uint8_t {
+  FORCE_IDLE,
+  FORCE_TOUCH,
+  FORCE_OPEN,
+};
+
+struct ForceThresholds {
+  // Millivolts to enter each level and to fall back out of it, the gap between them is the hysteresis
+  uint16_t touchOn;
+  uint16_t touchOff;
+  uint16_t openOn;
+  uint16_t openOff;
+  // How long a new level has to hold before it counts (ms)
+  uint16_t debounce;
+  // Each sample moves the filtered value 1 / 2^filterShift of the way, 0 to not filter
+  uint8_t filterShift;
+};
+
+/**
+ * A level change, sent to the hub as is so it's the same layout on both (little endian, packed)
+ */
+struct __attribute__((packed)) ForceEvent {
+  // millis() on the sensor when the level changed
+  uint32_t time;
+  // Increases by one for each event, wrapping around
+  uint16_t seq;
+  uint16_t millivolts;
+  uint8_t level;
+  uint8_t previousLevel;
+};
+
+/**
+ * Start of ForceDetector::writeEvents, followed by count events oldest first
+ */
+struct __attribute__((packed)) ForceEventsHeader {
+  // millis() on the sensor when written, so the hub can tell how long ago each event was
+  uint32_t time;
+  // Presses counted before the first event below, so the hub can tell which it already had from advertising
+  uint16_t firstEventCount;
+  uint8_t count;
+};
+
+const uint8_t FORCE_EVENTS_SIZE = 32;
+// Largest writeEvents result read in one go, the header plus 24 events
+const uint8_t FORCE_EVENTS_VALUE_SIZE = sizeof(ForceEventsHeader) + 24 * sizeof(ForceEvent);
+
+/**
+ * Turns force readings into level changes, filtered in fixed point, with hysteresis and debouncing
+ * Changes are kept in a ring until the hub acknowledges them so they outlast disconnects,
+ * the oldest is dropped once it's full
+ */
+class ForceDetector {
+private:
+  ForceThresholds thresholds;
+  // Millivolts with FILTER_FRACTION_BITS of fraction
+  int32_t filtered = 0;
+  bool hasSample = false;
+  ForceLevel level = FORCE_IDLE;
+  // Level the filtered value has been at since pendingSince, waiting out the debounce
+  ForceLevel pendingLevel = FORCE_IDLE;
+  uint32_t pendingSince = 0;
+
+  ForceEvent events[FORCE_EVENTS_SIZE];
+  uint8_t eventsStart = 0;
+  uint8_t eventsLen = 0;
+  uint16_t nextSeq = 0;
+  // Idle to touch or open changes, wrapping around
+  uint16_t eventCount = 0;
+
+  static const uint8_t FILTER_FRACTION_BITS = 4;
+
+  /**
+   * Level for the filtered value, using the off threshold of the levels already entered
+   */
+  ForceLevel levelFor(uint16_t millivolts) const;
+
+  void addEvent(ForceLevel previousLevel, uint32_t now);
+
+public:
+  ForceDetector(const ForceThresholds& thresholds) : thresholds(thresholds) {}
+
+  /**
+   * Adds a reading taken at now (ms), returns true if it changed the level
+   */
+  bool add(uint16_t millivolts, uint32_t now);
+
+  ForceLevel getLevel() const { return level; }
+
+  uint16_t getMillivolts() const { return filtered >> FILTER_FRACTION_BITS; }
+
+  uint8_t eventsLength() const { return eventsLen; }
+
+  /**
+   * Presses so far, the count advertised for the hub to upload an event for each increase
+   */
+  uint16_t getEventCount() const { return eventCount; }
+
+  /**
+   * Writes a ForceEventsHeader and as many of the oldest events as fit in size
+   * Returns the length written
+   */
+  size_t writeEvents(uint8_t* out, size_t size, uint32_t now) const;
+
+  /**
+   * Drops events up to and including seq, once the hub has them
+   */
+  void ack(uint16_t seq);
+};
+
+#endif
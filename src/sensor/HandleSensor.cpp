@@ -1,15 +1,125 @@
 #include <ArduinoBLE.h>
+#include <nrf.h>
+#include <./sensor/ForceDetector.h>
 // Device name
 const char* nameOfPeripheral = "HandleIt Client";
 const char* uuidOfService = "0000181a-0000-1000-8000-00805f9b34fb";
 // const char* uuidOfRxChar = "00002A3D-0000-1000-8000-00805f9b34fb";
 const char* uuidOfVolts = "00002A58-0000-1000-8000-00805f9b34fb";
+const char* uuidOfEvents = "00002A59-0000-1000-8000-00805f9b34fb";
+const char* uuidOfEventsAck = "00002A5A-0000-1000-8000-00805f9b34fb";
 BLEService forceService(uuidOfService);
 // Rx/Tx Characteristics
 // BLECharacteristic rxChar(uuidOfRxChar, BLEWriteWithoutResponse | BLEWrite, 256, false);
 BLEIntCharacteristic volts(uuidOfVolts, BLERead | BLEWrite | BLEWriteWithoutResponse | BLEIndicate | BLEBroadcast);
+// Events the hub hasn't acknowledged yet, see ForceDetector::writeEvents
+BLECharacteristic eventsChar(uuidOfEvents, BLERead, FORCE_EVENTS_VALUE_SIZE);
+// The hub writes the seq of the last event it has
+BLEUnsignedShortCharacteristic eventsAck(uuidOfEventsAck, BLEWrite);
 
 unsigned long lastReset = 0;
+// Touch and open levels in millivolts, entered at the first and left below the second
+// a 100ms debounce and light filtering keep a hand resting on the handle from flickering between them
+const ForceThresholds thresholds = {1000, 800, 2500, 2200, 100, 1};
+ForceDetector detector(thresholds);
+
+// Manufacturer data lets paired hubs read the state from advertising without connecting
+// company id (0xFFFF, none assigned), format version, force level (volts * 10), event count (LE), battery %
+const uint16_t advCompanyId = 0xFFFF;
+const uint8_t advFormatVersion = 1;
+const uint8_t advDataSize = 7;
+// Battery level when it can't be measured, the board has no divider wired to a pin yet
+const uint8_t batteryUnknown = 0xFF;
+// Force level is refreshed at most this often, events update it right away
+const unsigned long advUpdateInterval = 5000;
+uint8_t advForceLevel = 0;
+unsigned long lastAdvUpdate = 0;
+
+// Time asleep between samples (ms), shorter while pressed so releases and quick presses aren't missed
+const unsigned long sampleInterval = 200;
+const unsigned long pressedSampleInterval = 50;
+// A0 is P0.04, the SAADC's analog input 2
+const uint32_t forceInput = SAADC_CH_PSELP_PSELP_AnalogInput2;
+// Full scale of the internal 0.6V reference with 1/6 gain, over 12 bits
+const uint32_t saadcFullScaleMillivolts = 3600;
+// Written by the SAADC's EasyDMA, one averaged reading
+volatile int16_t saadcResult = 0;
+
+/**
+ * Sets up the SAADC to average 16 samples in hardware for each reading, then calibrates it
+ * It's left disabled between readings since it draws current while enabled
+ */
+void setupSaadc() {
+  NRF_SAADC->RESOLUTION = SAADC_RESOLUTION_VAL_12bit;
+  NRF_SAADC->OVERSAMPLE = SAADC_OVERSAMPLE_OVERSAMPLE_Over16x;
+  // Burst takes every oversample on one SAMPLE task, so a reading needs a single wake
+  NRF_SAADC->CH[0].CONFIG = (SAADC_CH_CONFIG_GAIN_Gain1_6 << SAADC_CH_CONFIG_GAIN_Pos)
+    | (SAADC_CH_CONFIG_REFSEL_Internal << SAADC_CH_CONFIG_REFSEL_Pos)
+    | (SAADC_CH_CONFIG_TACQ_10us << SAADC_CH_CONFIG_TACQ_Pos)
+    | (SAADC_CH_CONFIG_BURST_Enabled << SAADC_CH_CONFIG_BURST_Pos);
+  NRF_SAADC->CH[0].PSELP = forceInput;
+  NRF_SAADC->CH[0].PSELN = SAADC_CH_PSELN_PSELN_NC;
+  NRF_SAADC->RESULT.PTR = (uint32_t)(uintptr_t)&saadcResult;
+  NRF_SAADC->RESULT.MAXCNT = 1;
+
+  NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Enabled;
+  NRF_SAADC->EVENTS_CALIBRATEDONE = 0;
+  NRF_SAADC->TASKS_CALIBRATEOFFSET = 1;
+  while(!NRF_SAADC->EVENTS_CALIBRATEDONE);
+  NRF_SAADC->EVENTS_CALIBRATEDONE = 0;
+  NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Disabled;
+}
+
+/**
+ * One oversampled reading of the force sensor in millivolts
+ */
+uint16_t readForceMillivolts() {
+  NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Enabled;
+  NRF_SAADC->EVENTS_STARTED = 0;
+  NRF_SAADC->TASKS_START = 1;
+  while(!NRF_SAADC->EVENTS_STARTED);
+  NRF_SAADC->EVENTS_END = 0;
+  NRF_SAADC->TASKS_SAMPLE = 1;
+  while(!NRF_SAADC->EVENTS_END);
+  NRF_SAADC->EVENTS_STOPPED = 0;
+  NRF_SAADC->TASKS_STOP = 1;
+  while(!NRF_SAADC->EVENTS_STOPPED);
+  NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Disabled;
+  // Slightly negative readings are possible near 0V once calibrated
+  return max((int16_t)saadcResult, (int16_t)0) * saadcFullScaleMillivolts >> 12;
+}
+
+void setLeds(ForceLevel level) {
+  digitalWrite(D6, level >= FORCE_TOUCH ? HIGH : LOW);
+  digitalWrite(D4, level >= FORCE_OPEN ? HIGH : LOW);
+}
+
+void updateEventsChar() {
+  uint8_t value[FORCE_EVENTS_VALUE_SIZE];
+  size_t len = detector.writeEvents(value, sizeof value, millis());
+  eventsChar.writeValue(value, len);
+}
+
+/**
+ * Puts the current state in the manufacturer data, restarting advertising so it's sent
+ * Advertising is stopped while a central is connected, it picks up the new data once it disconnects
+ */
+void updateAdvData(uint8_t forceLevel) {
+  uint8_t data[advDataSize] = {
+    (uint8_t)(advCompanyId & 0xFF), (uint8_t)(advCompanyId >> 8),
+    advFormatVersion,
+    forceLevel,
+    (uint8_t)(detector.getEventCount() & 0xFF), (uint8_t)(detector.getEventCount() >> 8),
+    batteryUnknown,
+  };
+  BLE.setManufacturerData(data, advDataSize);
+  if(!BLE.connected()) {
+    BLE.stopAdvertise();
+    BLE.advertise();
+  }
+  advForceLevel = forceLevel;
+  lastAdvUpdate = millis();
+}
 
 void onBLEConnected(BLEDevice d) {
   Serial.println(">>> BLEConnected");
@@ -32,6 +142,7 @@ void setup() {
   pinMode(A1, INPUT_PULLUP);
   pinMode(D6, OUTPUT);
   pinMode(D4, OUTPUT);
+  setupSaadc();
 
   // begin BLE initialization
   if (!BLE.begin()) {
@@ -45,15 +156,19 @@ void setup() {
   BLE.setAdvertisedService(forceService);
   // forceService.addCharacteristic(rxChar);
   forceService.addCharacteristic(volts);
+  forceService.addCharacteristic(eventsChar);
+  forceService.addCharacteristic(eventsAck);
   BLE.addService(forceService);
   volts.writeValue(30);
+  updateEventsChar();
 
   // Bluetooth LE connection handlers
   BLE.setEventHandler(BLEConnected, onBLEConnected);
   BLE.setEventHandler(BLEDisconnected, onBLEDisconnected);
 
   // rxChar.setEventHandler(BLEWritten, onRxCharValueUpdate);
-  BLE.advertise();
+  // Also starts advertising
+  updateAdvData(0);
   lastReset = millis();
 
   //  // Print out full UUID and MAC address.
@@ -83,29 +198,33 @@ void loop() {
 
 
   // ***** force algorithm******
-  digitalWrite(D6, LOW);
-  digitalWrite(D4, LOW);
-  // read the input on analog pin 0:
-  int sensorValue = analogRead(A0);
-  // Convert the analog reading (which goes from 0 - 1023) to a voltage (0 - 5V):
-  float voltage = sensorValue * (3.3 / 1023.0);
-  // print out the value you read:
-  // Serial.println(voltage);
-  if(voltage > 1.0) {
-    digitalWrite(D6, HIGH);
-  }
-  if(voltage >= 2.5) {
-    digitalWrite(D4, HIGH);
+  uint16_t millivolts = readForceMillivolts();
+  // Serial.println(millivolts);
+  uint8_t forceLevel = detector.getMillivolts() / 100;
+  if(detector.add(millivolts, millis())) {
+    ForceLevel level = detector.getLevel();
+    forceLevel = detector.getMillivolts() / 100;
+    setLeds(level);
+    // Each write indicates to a subscribed hub, which then reads the events
+    Serial.print("Level ");
+    Serial.print(level);
+    Serial.print(", writing voltage of ");
+    Serial.println(forceLevel);
+    volts.writeValue(forceLevel);
+    updateAdvData(forceLevel);
+  } else if(forceLevel != advForceLevel && millis() - lastAdvUpdate > advUpdateInterval) {
+    updateAdvData(forceLevel);
   }
 
-
-  BLEDevice central = BLE.central();
-  if(central) {
-    int32_t intVoltage = static_cast<int32_t>(voltage * 10);
-    Serial.print("Writing voltage of ");
-    Serial.println(intVoltage);
-    volts.writeValue(intVoltage);
-    // volts.setValue(intVoltage);
+  if(eventsAck.written()) {
+    detector.ack(eventsAck.value());
+  }
+  // Kept current while connected so the header's time is close to when the hub reads it
+  if(BLE.connected()) {
+    updateEventsChar();
   }
+  BLE.poll();
 
+  // The mbed core sleeps until the next sample, the SAADC is off and the BLE stack only wakes for its own events
+  delay(detector.getLevel() != FORCE_IDLE ? pressedSampleInterval : sampleInterval);
 }
@@ -0,0 +1,64 @@
+#include <unity.h>
+#include <./hub/Hal.h>
+#include <./hub/Network.h>
+#include <./hub/ModemEmulator.h>
+
+Network network;
+char query[] = "{\"query\":\"mutation CreateEvent{createEvent(serial:\\\"a4:c1:38:12:34:56\\\"){ id }}\",\"variables\":{}}";
+bool isDone = false;
+bool isSuccess = false;
+int eventId = 0;
+
+void onComplete(bool success, JsonDocument& doc, void* context) {
+  isDone = true;
+  isSuccess = success;
+  eventId = doc["data"]["createEvent"]["id"] | 0;
+}
+
+void setUp() {
+  Hal::beginClock();
+  strcpy(network.tokenData.accessToken, "test");
+  network.tokenData.isValid = true;
+  modemEmulator.config = ModemEmulatorConfig();
+  modemEmulator.config.bootTime = 100;
+  modemEmulator.config.regTime = 100;
+  modemEmulator.config.actionLatency = 100;
+  modemEmulator.install();
+  isDone = isSuccess = false;
+  eventId = 0;
+}
+
+void tearDown() {
+  network.setPower(false);
+  modemEmulator.uninstall();
+}
+
+/**
+ * Sends query without BLE to poll and runs the request to completion
+ */
+void sendWithoutBle() {
+  TEST_ASSERT_NOT_EQUAL(0, network.SendRequestAsync(query, onComplete, nullptr, nullptr));
+  unsigned long timeout = millis() + 60000;
+  while (!isDone && millis() < timeout) network.tick();
+}
+
+void test_parses_body_without_ble() {
+  sendWithoutBle();
+  TEST_ASSERT_TRUE(isSuccess);
+  TEST_ASSERT_EQUAL(1, eventId);
+}
+
+void test_parses_delayed_body_without_ble() {
+  // Every read while it waits on the body comes back empty, none of them may count as a byte of it
+  modemEmulator.config.readBodyDelay = 200;
+  sendWithoutBle();
+  TEST_ASSERT_TRUE(isSuccess);
+  TEST_ASSERT_EQUAL(1, eventId);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_parses_body_without_ble);
+  RUN_TEST(test_parses_delayed_body_without_ble);
+  return UNITY_END();
+}
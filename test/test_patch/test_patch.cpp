@@ -0,0 +1,131 @@
+#include <unity.h>
+#include <./hub/Hal.h>
+#include <./hub/Patch.h>
+
+// Code of the old image, followed by a storage row the running hub writes to
+const uint32_t OLD_CODE_SIZE = 1000;
+const uint32_t NEW_SIZE = 1100;
+
+HUB_FLASH_STORAGE(testStorage, uint32_t);
+
+/**
+ * Storage that keeps the new image in RAM
+ */
+class RamStorage : public OTAStorage {
+public:
+  uint8_t data[2048];
+  size_t len = 0;
+
+  int open(int length) override {
+    len = 0;
+    return length <= (int)sizeof data;
+  }
+  size_t write(uint8_t b) override {
+    if (len == sizeof data) return 0;
+    data[len++] = b;
+    return 1;
+  }
+  void close() override {}
+  void clear() override {}
+  void apply() override {}
+  long maxSize() override { return sizeof data; }
+};
+
+uint8_t oldImage[OLD_CODE_SIZE + OTA_ROW_SIZE];
+uint8_t newImage[NEW_SIZE];
+uint8_t patch[2 * NEW_SIZE];
+size_t patchLen = 0;
+RamStorage storage;
+OtaWriter writer(storage);
+PatchDecoder decoder(writer, oldImage);
+
+void writeUint32(uint32_t value) {
+  memcpy(patch + patchLen, &value, sizeof value);
+  patchLen += sizeof value;
+}
+
+void writeOp(PatchOp op, uint32_t len) {
+  patch[patchLen++] = op;
+  do {
+    patch[patchLen++] = (len & 0x7F) | (len > 0x7F ? 0x80 : 0);
+    len >>= 7;
+  } while (len);
+}
+
+/**
+ * Patch that ADDs the new image's changes over the old code, then INSERTs the rest of it
+ */
+void buildPatch(uint32_t oldSize) {
+  patchLen = 0;
+  writeUint32(PATCH_MAGIC);
+  writeUint32(oldSize);
+  writeUint32(Crc32::finish(Crc32::update(Crc32::INITIAL, oldImage, oldSize)));
+  writeUint32(NEW_SIZE);
+  writeOp(PATCH_ADD, OLD_CODE_SIZE);
+  for (uint32_t i = 0; i < OLD_CODE_SIZE; i++) patch[patchLen++] = newImage[i] - oldImage[i];
+  writeOp(PATCH_INSERT, NEW_SIZE - OLD_CODE_SIZE);
+  memcpy(patch + patchLen, newImage + OLD_CODE_SIZE, NEW_SIZE - OLD_CODE_SIZE);
+  patchLen += NEW_SIZE - OLD_CODE_SIZE;
+}
+
+/**
+ * Streams the patch in the way FirmwareUpdate does, returns true if it produced newImage
+ */
+bool applyPatch(uint32_t maxOldSize) {
+  writer.open(NEW_SIZE, Crc32::finish(Crc32::update(Crc32::INITIAL, newImage, NEW_SIZE)));
+  decoder.begin(NEW_SIZE, maxOldSize);
+  for (size_t pos = 0; pos < patchLen && !decoder.isFailed();) {
+    size_t len = min(patchLen - pos, (size_t)OTA_MAX_CHUNK);
+    while (!decoder.write(patch + pos, len)) {
+      while (writer.commit());
+      decoder.pump();
+    }
+    pos += len;
+  }
+  while (!decoder.isFailed() && !decoder.isIdle()) {
+    while (writer.commit());
+    decoder.pump();
+  }
+  bool isCrcValid = writer.close();
+  return decoder.isDone() && isCrcValid && storage.len == NEW_SIZE && memcmp(storage.data, newImage, NEW_SIZE) == 0;
+}
+
+void setUp() {
+  for (uint32_t i = 0; i < OLD_CODE_SIZE; i++) oldImage[i] = i * 7;
+  memset(oldImage + OLD_CODE_SIZE, 0, OTA_ROW_SIZE);
+  for (uint32_t i = 0; i < NEW_SIZE; i++) newImage[i] = i % 97 == 0 ? i : i * 7;
+}
+
+void tearDown() {}
+
+void test_applies_over_code() {
+  buildPatch(OLD_CODE_SIZE);
+  TEST_ASSERT_TRUE(applyPatch(OLD_CODE_SIZE));
+}
+
+void test_ignores_written_storage_row() {
+  buildPatch(OLD_CODE_SIZE);
+  // The hub saved something after the image was built
+  oldImage[OLD_CODE_SIZE + 10] ^= 0xFF;
+  TEST_ASSERT_TRUE(applyPatch(OLD_CODE_SIZE));
+}
+
+void test_refuses_old_image_over_storage() {
+  buildPatch(OLD_CODE_SIZE + OTA_ROW_SIZE);
+  TEST_ASSERT_FALSE(applyPatch(OLD_CODE_SIZE));
+  TEST_ASSERT_TRUE(decoder.isFailed());
+}
+
+void test_registers_storage_rows() {
+  TEST_ASSERT_NOT_NULL(Hal::firstStorageRow());
+  TEST_ASSERT_TRUE(Hal::firstStorageRow() <= testStorageRow);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_applies_over_code);
+  RUN_TEST(test_ignores_written_storage_row);
+  RUN_TEST(test_refuses_old_image_over_storage);
+  RUN_TEST(test_registers_storage_rows);
+  return UNITY_END();
+}